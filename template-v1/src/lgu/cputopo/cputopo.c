@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+
+#include <sys/syscall.h>
+
+#include "cputopo.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED (1)
+#endif
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define CPUTOPO_SYSFS_CPU "/sys/devices/system/cpu"
+
+static int read_int(const char *path, const int dfl)
+{
+	FILE *fp;
+	int val;
+
+	fp = fopen(path, "r");
+	if (!fp)
+	{
+		return dfl;
+	}
+
+	if (fscanf(fp, "%d", &val) != 1)
+	{
+		val = dfl;
+	}
+
+	fclose(fp);
+	return val;
+}
+
+/**
+ * @brief Get the NUMA node of a cpu. Return 0 if the system has no NUMA info.
+ */
+int cputopo_cpu2node(const int cpu)
+{
+	char path[128];
+	DIR *dir;
+	struct dirent *ent;
+	int node = 0;
+
+	snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d", cpu);
+
+	dir = opendir(path);
+	if (!dir)
+	{
+		return 0;
+	}
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (strncmp(ent->d_name, "node", 4) == 0 && sscanf(ent->d_name + 4, "%d", &node) == 1)
+		{
+			break;
+		}
+	}
+
+	closedir(dir);
+	return node;
+}
+
+/**
+ * @brief Load the topology of cpus this process is allowed to run on.
+ *
+ * @return Number of cpus in tbl, or -1 if error.
+ */
+int cputopo_load(struct cputopo_cpu *tbl, const unsigned int max)
+{
+	cpu_set_t set;
+	char path[128];
+	unsigned int nr = 0;
+	int cpu;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set))
+	{
+		return -1;
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE && nr < max; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &set))
+		{
+			continue;
+		}
+
+		tbl[nr].cpu = cpu;
+		tbl[nr].node = cputopo_cpu2node(cpu);
+
+		snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+		tbl[nr].pkg = read_int(path, 0);
+
+		snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/topology/core_id", cpu);
+		tbl[nr].core = read_int(path, cpu);
+
+		nr++;
+	}
+
+	return nr;
+}
+
+struct spread_key
+{
+	struct cputopo_cpu c;
+	unsigned int smt; //!< 0: First hw thread of the core, 1: 2nd, ...
+	unsigned int rank; //!< Order inside the node among cpus of the same smt level.
+};
+
+static int spread_cmp(const void *a, const void *b)
+{
+	const struct spread_key *ka = a, *kb = b;
+
+	if (ka->smt != kb->smt)
+	{
+		return ka->smt < kb->smt ? -1 : 1;
+	}
+
+	if (ka->rank != kb->rank)
+	{
+		return ka->rank < kb->rank ? -1 : 1;
+	}
+
+	if (ka->c.node != kb->c.node)
+	{
+		return ka->c.node < kb->c.node ? -1 : 1;
+	}
+
+	return ka->c.cpu - kb->c.cpu;
+}
+
+/**
+ * @brief Reorder tbl so that taking cpus from the head spreads over NUMA nodes first, then physical cores,
+ *     and SMT siblings last.
+ */
+unsigned int cputopo_spread(struct cputopo_cpu *tbl, const unsigned int nr)
+{
+	struct spread_key *key;
+	unsigned int i, j;
+
+	key = malloc(sizeof(*key) * nr);
+	if (!key)
+	{
+		return nr; // Keep the original order.
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		key[i].c = tbl[i];
+		key[i].smt = 0;
+		key[i].rank = 0;
+
+		for (j = 0; j < i; j++)
+		{
+			if (tbl[j].pkg == tbl[i].pkg && tbl[j].core == tbl[i].core)
+			{
+				key[i].smt++;
+			}
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		for (j = 0; j < i; j++)
+		{
+			if (key[j].c.node == key[i].c.node && key[j].smt == key[i].smt)
+			{
+				key[i].rank++;
+			}
+		}
+	}
+
+	qsort(key, nr, sizeof(*key), spread_cmp);
+
+	for (i = 0; i < nr; i++)
+	{
+		tbl[i] = key[i].c;
+	}
+
+	free(key);
+	return nr;
+}
+
+/**
+ * @brief Prefer (and migrate) the pages of [addr, addr + len) on a NUMA node. addr must be page aligned.
+ */
+int cputopo_mbind(void *addr, const size_t len, const int node)
+{
+	unsigned long mask;
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+
+	if (node < 0 || node >= (int) (sizeof(mask) * 8 - 1))
+	{
+		return -1;
+	}
+
+	if ((unsigned long) addr % pgsz)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	mask = 1UL << node;
+
+	if (syscall(SYS_mbind, addr, (len + pgsz - 1) / pgsz * pgsz, MPOL_PREFERRED, &mask, sizeof(mask) * 8, MPOL_MF_MOVE))
+	{
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef SRC_LGU_CPUTOPO_CPUTOPO_H_
+#define SRC_LGU_CPUTOPO_CPUTOPO_H_
+
+/*!
+ * @file cputopo.h
+ * @brief Read cpu topology (NUMA node, package, core) from sysfs, and place memory on a NUMA node.
+ *
+ * @details No libnuma is required. Missing sysfs entries are treated as node 0 / package 0 / core = cpu.
+ */
+
+#include <stdlib.h>
+
+struct cputopo_cpu
+{
+	int cpu;
+	int node; //!< NUMA node
+	int pkg; //!< Physical package (socket)
+	int core; //!< Core id in the package
+};
+
+#define CPUTOPO_CPU_MAX (1024)
+
+extern int cputopo_load(struct cputopo_cpu *tbl, const unsigned int max);
+extern unsigned int cputopo_spread(struct cputopo_cpu *tbl, const unsigned int nr);
+extern int cputopo_cpu2node(const int cpu);
+extern int cputopo_mbind(void *addr, const size_t len, const int node);
+
+#endif /* SRC_LGU_CPUTOPO_CPUTOPO_H_ */
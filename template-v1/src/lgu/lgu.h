@@ -12,6 +12,7 @@
 #include "asciidump/asciidump.h"
 #include "bug/bug.h"
 #include "stdmsg/stdmsg.h"
+#include "cputopo/cputopo.h"
 
 #include "atomic/atomic.h"
 
@@ -50,6 +50,7 @@ int main(void)
 #define TM_H_
 
 #include <time.h>
+#include <stdint.h>
 
 /*!
  * Recommended time string length
@@ -61,4 +62,15 @@ extern char *tm_time2str(time_t ts, char *result, size_t len);
 
 extern long tm_uptime(void);
 
+/*!
+ * \brief Monotonic clock in nanoseconds. Cheap (vdso) on Linux.
+ */
+static inline __attribute__((unused)) uint64_t tm_mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #endif /* TM_H_ */
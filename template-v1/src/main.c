@@ -3,6 +3,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
 
 #include <getopt.h>
 
@@ -12,8 +14,15 @@
 #include "lgu/lgu.h"
 #include "initops/initops.h"
 
+#include "lgu/fio/fio_easyrw.h"
 #include "mempool/mempool.h"
 #include "threadwq/threadwq.h"
+#include "threadwq/threadwq_timer.h"
+#include "threadwq/threadwq_dag.h"
+#include "threadwq/threadwq_parallel.h"
+#include "threadwq/threadwq_future.h"
+#include "threadwq/threadwq_fiber.h"
+#include "threadwq/threadwq_aio.h"
 
 #include <time.h>
 
@@ -32,12 +41,35 @@ static void cb_exit_worker(struct threadwq *twq, void *unused)
 	VBS("exit twq %p", twq);
 }
 
+static threadwq_idle_t opt_idle = THREADWQ_IDLE_BLOCK;
+
+static void set_idle_ops(struct threadwq_ops *ops)
+{
+	ops->idle = opt_idle;
+	ops->idle_spin = THREADWQ_IDLE_SPIN_DFL;
+	ops->idle_yield = THREADWQ_IDLE_YIELD_DFL;
+	ops->idle_park_us = THREADWQ_IDLE_PARK_US_DFL;
+}
+
 static unsigned long int wait = 0; // Queue full counter
 static unsigned long int cnt_start = 0;
 static unsigned long int cnt_finish = 0;
 
 #include "json-c/json.h"
 
+static void scan_database(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 16384; i++)
+	{
+		if (CMM_LOAD_SHARED(database[i]) == 1)
+		{
+			break;
+		}
+	}
+}
+
 void cb_start(struct threadwq_job *job, void *priv)
 {
 	/*
@@ -54,17 +86,7 @@ void cb_start(struct threadwq_job *job, void *priv)
 #endif
 
 #if 1 // cpu-bound job, high cpu/memory cost... Time to prove the ability.
-	{
-		unsigned int i;
-
-		for (i = 0; i < 16384; i++)
-		{
-			if (database[i] == 1)
-			{
-				break;
-			}
-		}
-	}
+	scan_database();
 #endif
 }
 
@@ -153,6 +175,7 @@ static void test_threadwq2(void)
 	wait = 0;
 
 	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
 	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
 
 	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
@@ -173,6 +196,8 @@ static void test_threadwq2(void)
 		pthread_join(tid, NULL);
 	}
 
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
 	threadwq_exit_multi(twq, TWQNUM);
 
 	cmm_smp_mb();
@@ -253,6 +278,7 @@ static void test_threadwq3(void)
 	wait = 0;
 
 	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
 	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
 
 	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
@@ -277,6 +303,8 @@ static void test_threadwq3(void)
 		pthread_join(tid, NULL);
 	}
 
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
 	threadwq_exit_multi(twq, TWQNUM);
 
 	threadwq_man_exit(&twq_man);
@@ -289,185 +317,3157 @@ static void test_threadwq3(void)
 	return;
 }
 
-static void test_threadwq(void)
+/*
+ * Batch submission: Use a light job to measure the submit path, not the job itself.
+ */
+#define BATCH_MAX 512
+
+static void cb_start_light(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&cnt_start);
+}
+
+struct batch_arg
+{
+	struct threadwq_man *man;
+	unsigned int batch;
+	const char *queue; //!< Backend name to print.
+	const char *finish; //!< Completion mode name to print.
+};
+
+static void *threadfunc_batch(void *argin)
 {
 	struct timespec ts, ts_now;
+	struct batch_arg *arg = argin;
 
-	cnt_start = 0;
-	cnt_finish = 0;
-	wait = 0;
+	rcu_register_thread();
 
 	clock_gettime(CLOCK_REALTIME, &ts);
 
-	for (;;)
 	{
-		cb_start(NULL, NULL);
+		struct threadwq_job *job_tbl[BATCH_MAX];
+		unsigned int nr = 0;
+
+		for (;;)
+		{
+			job_tbl[nr] = mempool_alloc(&mp);
+			if (!job_tbl[nr])
+			{
+				if (nr == 0)
+				{
+					clock_gettime(CLOCK_REALTIME, &ts_now);
+					if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+
+					caa_cpu_relax();
+					wait++; // It means queue full.
+					continue;
+				}
+				// Queue full. Submit what we have.
+			}
+			else
+			{
+				threadwq_job_init(job_tbl[nr], cb_start_light, cb_finish, NULL);
+				nr++;
+				if (nr < arg->batch)
+				{
+					continue;
+				}
+			}
+
+			BUG_ON(threadwq_man_add_jobs(arg->man, job_tbl, nr) != nr);
+			nr = 0;
+
+			clock_gettime(CLOCK_REALTIME, &ts_now);
+			if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+		}
+
+		if (nr)
+		{
+			BUG_ON(threadwq_man_add_jobs(arg->man, job_tbl, nr) != nr);
+		}
 
-		/*
-		 * xxx
-		 */
 		clock_gettime(CLOCK_REALTIME, &ts_now);
-		if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+		{
+			double sec = (ts_now.tv_sec - ts.tv_sec) + (ts_now.tv_nsec - ts.tv_nsec) / 1e9;
+
+			printf("%u thread, %s, finish %s, batch %u:\ncnt=%lu, fail=%lu time=%.2f jobs/sec=%.0f\n",
+				TWQNUM, arg->queue, arg->finish, arg->batch,
+				cnt_start, wait, sec, cnt_start / sec);
+		}
 	}
 
-	clock_gettime(CLOCK_REALTIME, &ts_now);
-	printf("no thread:\ncnt=%lu, wait/waste=%lu time=%lu\n", cnt_start, wait, (ts_now.tv_sec - ts.tv_sec));
+	rcu_unregister_thread();
 
-	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+	return NULL;
 }
 
-static void print_help(const char *path)
+/*
+ * nr_slot = 0: lfq backend. Otherwise: ring backend w/ nr_slot slots.
+ */
+static void test_threadwq_batch(const unsigned int batch, const unsigned int nr_slot, const threadwq_finish_t finish)
 {
-	printf("%s [--help|-h]\n", path);
-	printf("\n");
-}
+	static const char *finish_name[THREADWQ_FINISH_MAX] = { "dfl", "rcu", "inline", "batch" };
 
-static unsigned int opt_background = 0;
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct batch_arg arg;
 
-static int argparse(int argc, char **argv)
-{
-	int c;
-	int digit_optind = 0;
+	BUG_ON(batch == 0 || batch > BATCH_MAX);
 
-	while (1)
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	if (nr_slot)
 	{
-		int this_option_optind = optind ? optind : 1;
-		int option_index = 0;
-		static struct option long_options[] =
-		{
-			{ "verbose", no_argument, 0, 'v' },
-			{ "quiet", no_argument, 0, 'q' },
-			{ "background", no_argument, 0, 'b' },
-			{ "help", no_argument, 0, 'h' },
-			{ 0, 0, 0, 0 }
-		};
+		BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, nr_slot));
+	}
+	else
+	{
+		BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	}
+	set_idle_ops(&twq_ops);
+	twq_ops.finish = finish;
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
 
-		c = getopt_long(argc, argv, "bhvqc:e:",
-			long_options, &option_index);
-		if (c == -1)
-			break;
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
 
-		switch (c)
-		{
-		case 'b': // background
-			opt_background = 1;
-			break;
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
 
-		case 'q':
-			stdmsg_lv_dec();
-			break;
-		case 'v':
-			stdmsg_lv_inc();
-			break;
-		case 'h':
-			print_help(argv[0]);
-			return -1;
-		default:
-			print_help(argv[0]);
-			return -1;
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	arg.man = &twq_man;
+	arg.batch = batch;
+	arg.queue = nr_slot ? "ring" : "lfq";
+	arg.finish = finish_name[finish];
+
+	{ // Create another writer thread
+		pthread_t tid;
+		pthread_attr_t tattr;
+
+		pthread_attr_init(&tattr);
+
+		if (pthread_create(&tid, &tattr, &threadfunc_batch, &arg))
+		{
+			BUG();
 		}
-	}
 
-	if (optind < argc)
-	{
-		fprintf(stderr, "non-option ARGV-elements: ");
-		while (optind < argc)
-			fprintf(stderr, "%s ", argv[optind++]);
-		fprintf(stderr, "\n");
-		print_help(argv[0]);
-		return -1;
+		pthread_join(tid, NULL);
 	}
 
-	return 0;
-}
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
 
-static int process_lock_fd = -1;
+	threadwq_exit_multi(twq, TWQNUM);
 
-static int trylock_process(void)
-{
-	const char *process_lock_path = CONFIG_TEMPLATE_LOCK_PATH;
+	threadwq_man_exit(&twq_man);
 
-	process_lock_fd = fio_trylock(process_lock_path);
-	if (process_lock_fd < 0)
-	{
-		ERR("Another instance is locking '%s'", process_lock_path);
-		return -1;
-	}
+	cmm_smp_mb();
 
-	return 0; // ok
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
 }
 
-static void unlock_process(void)
+/*
+ * Work-stealing: Job cost is skewed. Every 64th job is 64x slower.
+ */
+#define SKEW_PERIOD 64
+
+static void cb_start_skew(struct threadwq_job *job, void *priv)
 {
-	if (process_lock_fd >= 0)
+	unsigned int n = priv ? SKEW_PERIOD : 1;
+
+	uatomic_inc(&cnt_start);
+
+	while (n--)
 	{
-		fio_unlock(process_lock_fd);
-		process_lock_fd = -1;
+		scan_database();
 	}
 }
 
-static int keep_single(void)
+static void *threadfunc_skew(void *twqmanin)
 {
-	if (trylock_process())
+	struct timespec ts, ts_now;
+	struct threadwq_man *man = twqmanin;
+
+	rcu_register_thread();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
 	{
-		return -1;
+		struct threadwq_job *job;
+		unsigned long accl = 0;
+
+		for (;;)
+		{
+			job = mempool_alloc(&mp);
+			if (!job)
+			{
+				clock_gettime(CLOCK_REALTIME, &ts_now);
+				if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+
+				caa_cpu_relax();
+				wait++; // It means queue full.
+				continue;
+			}
+
+			accl++;
+
+			threadwq_job_init(job, cb_start_skew, cb_finish, (accl % SKEW_PERIOD) ? NULL : job);
+			BUG_ON(threadwq_man_add_job(man, job));
+
+			clock_gettime(CLOCK_REALTIME, &ts_now);
+			if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+		}
 	}
 
-	atexit(unlock_process);
-	return 0;
+	rcu_unregister_thread();
+
+	return NULL;
 }
 
-int main(int argc, char **argv)
+static void test_threadwq_steal(const unsigned int steal)
 {
-	if (argparse(argc, argv))
-	{
-		return -1;
-	}
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct timespec ts, ts_now;
+	unsigned long stolen = 0;
+	unsigned int i;
 
-	/*
-	 * Avoid multiple instance. Or my wife will be angry.
-	 */
-	if (keep_single())
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	if (steal)
 	{
-		return -1;
+		BUG_ON(threadwq_set_steal_multi(twq, TWQNUM, THREADWQ_STEAL_BATCH_DFL));
 	}
 
-	/*
-	 * Run bg
-	 */
-	if (opt_background)
-	{
-		DBG("Run as background service");
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
 
-		if (setsid() < 0)
-		{
-			ERR("Cannot setsid '%s'", strerror(errno));
-			return -1;
-		}
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
 
-		if (daemon(0, 0))
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	{ // Create another writer thread
+		pthread_t tid;
+		pthread_attr_t tattr;
+
+		pthread_attr_init(&tattr);
+
+		if (pthread_create(&tid, &tattr, &threadfunc_skew, &twq_man))
 		{
-			ERR("Cannot put into background '%s'", strerror(errno));
-			return -1;
+			BUG();
 		}
 
-		stdmsg_lv_set(STDMSG_LV_NONE); // TODO: Use other logger instead.
+		pthread_join(tid, NULL);
 	}
 
-	/*
-	 * Prepare subsys. Init tasks are done here.
-	 */
-	if (initops_exec_init())
+	for (i = 0; i < TWQNUM; i++)
 	{
-		return -1;
+		stolen += uatomic_read(&twq[i].stolen);
 	}
 
-	DBG("Running program: %s", argv[0]);
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
 
-	mempool_init(&mp, "name", sizeof(struct threadwq_job), 65536 * 4, NULL, NULL);
-	test_threadwq();
-	test_threadwq2();
-	test_threadwq3();
+	threadwq_exit_multi(twq, TWQNUM);
+
+	clock_gettime(CLOCK_REALTIME, &ts_now);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("%u thread, skewed job, steal=%u:\ncnt=%lu, stolen=%lu, fail=%lu time=%lu\n",
+		TWQNUM, steal,
+		cnt_start, stolen, wait, (ts_now.tv_sec - ts.tv_sec));
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define PRIO_URGENT_PERIOD 16 // 1 urgent job per 16 bulk jobs
+
+static void *threadfunc_prio(void *twqmanin)
+{
+	struct timespec ts, ts_now;
+	struct threadwq_man *man = twqmanin;
+
+	rcu_register_thread();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	{
+		struct threadwq_job *job;
+		unsigned long accl = 0;
+
+		for (;;)
+		{
+			job = mempool_alloc(&mp);
+			if (!job)
+			{
+				clock_gettime(CLOCK_REALTIME, &ts_now);
+				if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+
+				caa_cpu_relax();
+				wait++; // It means queue full.
+				continue;
+			}
+
+			accl++;
+
+			threadwq_job_init(job, cb_start, cb_finish, NULL);
+			threadwq_job_set_prio(job, (accl % PRIO_URGENT_PERIOD) ? 1 : 0);
+			BUG_ON(threadwq_man_add_job(man, job));
+
+			clock_gettime(CLOCK_REALTIME, &ts_now);
+			if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+		}
+	}
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Bulk (prio 1) and urgent (prio 0) jobs of the same cost. Compare the queue wait of both classes.
+ */
+static void test_threadwq_prio(const unsigned int nr_prio, const unsigned int weight)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_prio_stat st[2], tmp;
+	struct timespec ts, ts_now;
+	unsigned int i, c;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_set_prio_multi(twq, TWQNUM, nr_prio, weight, 1));
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	{ // Create another writer thread
+		pthread_t tid;
+		pthread_attr_t tattr;
+
+		pthread_attr_init(&tattr);
+
+		if (pthread_create(&tid, &tattr, &threadfunc_prio, &twq_man))
+		{
+			BUG();
+		}
+
+		pthread_join(tid, NULL);
+	}
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	clock_gettime(CLOCK_REALTIME, &ts_now);
+
+	memset(st, 0x00, sizeof(st));
+	for (c = 0; c < nr_prio; c++)
+	{
+		for (i = 0; i < TWQNUM; i++)
+		{
+			threadwq_get_prio_stat(&twq[i], c, &tmp);
+			st[c].done += tmp.done;
+			st[c].wait_ns_avg += tmp.wait_ns_avg * tmp.done; // Sum back, averaged below.
+			if (tmp.wait_ns_max > st[c].wait_ns_max)
+			{
+				st[c].wait_ns_max = tmp.wait_ns_max;
+			}
+		}
+
+		if (st[c].done)
+		{
+			st[c].wait_ns_avg /= st[c].done;
+		}
+	}
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("%u thread, prio class=%u weight=%u:\ncnt=%lu, fail=%lu time=%lu\n",
+		TWQNUM, nr_prio, weight,
+		cnt_start, wait, (ts_now.tv_sec - ts.tv_sec));
+	for (c = 0; c < nr_prio; c++)
+	{
+		printf("\tprio %u: done=%lu wait avg=%luus max=%luus\n",
+			c, st[c].done, st[c].wait_ns_avg / 1000, st[c].wait_ns_max / 1000);
+	}
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define TIMER_NR (200000) // Pending timers at once
+#define TIMER_DELAY_MAX_MS (1000)
+#define TIMER_PERIOD_MS (10)
+
+static unsigned long timer_late_ns = 0;
+static unsigned long timer_late_ns_max = 0;
+
+static void cb_start_timer(struct threadwq_job *job, void *priv)
+{
+	const uint64_t *due = priv;
+	unsigned long late = tm_mono_ns() - *due, old;
+
+	uatomic_inc(&cnt_start);
+	uatomic_add(&timer_late_ns, late);
+
+	old = CMM_LOAD_SHARED(timer_late_ns_max);
+	while (late > old)
+	{
+		unsigned long cur = uatomic_cmpxchg(&timer_late_ns_max, old, late);
+
+		if (cur == old)
+		{
+			break;
+		}
+		old = cur;
+	}
+}
+
+static void cb_finish_timer(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&cnt_finish);
+}
+
+static unsigned long timer_periodic_cnt = 0;
+
+static void cb_start_periodic(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&timer_periodic_cnt);
+}
+
+static unsigned long timer_slow_run = 0;
+static unsigned long timer_slow_done = 0;
+
+static void cb_start_slow(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&timer_slow_run);
+	usleep(TIMER_PERIOD_MS * 1000); // Long enough to be cancelled while running.
+}
+
+static void cb_finish_slow(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&timer_slow_done);
+}
+
+/*
+ * Cancel a periodic job while it runs, then arm it again once its cb_finish came. Arm a one-shot job again while
+ * it runs (fails), then once its cb_finish came.
+ */
+static void test_timer_rearm(struct threadwq_timer *tmr, struct threadwq *twq)
+{
+	struct threadwq_tjob slow;
+	unsigned int round;
+
+	timer_slow_run = 0;
+	timer_slow_done = 0;
+
+	threadwq_tjob_init(&slow, cb_start_slow, cb_finish_slow, NULL);
+
+	for (round = 0; round < 2; round++)
+	{
+		BUG_ON(threadwq_add_job_periodic(tmr, twq, &slow, 1, TIMER_PERIOD_MS));
+
+		while (CMM_LOAD_SHARED(timer_slow_run) == round)
+		{
+			usleep(1000);
+		}
+
+		BUG_ON(threadwq_cancel_job_timer(tmr, &slow) != -EBUSY);
+
+		while (CMM_LOAD_SHARED(timer_slow_done) == round)
+		{
+			usleep(1000);
+		}
+	}
+
+	for (; round < 4; round++)
+	{
+		BUG_ON(threadwq_add_job_delayed(tmr, twq, &slow, 1));
+
+		while (CMM_LOAD_SHARED(timer_slow_run) == round)
+		{
+			usleep(1000);
+		}
+
+		BUG_ON(threadwq_add_job_delayed(tmr, twq, &slow, 1) != -1); // Running: Not relinked into the wheel.
+		BUG_ON(threadwq_cancel_job_timer(tmr, &slow) != -EBUSY);
+
+		while (CMM_LOAD_SHARED(timer_slow_done) == round)
+		{
+			usleep(1000);
+		}
+	}
+}
+
+#define TIMER_FAR_MS (3600 * 1000) // Level 2 of the wheel
+#define TIMER_NEAR_MS (300) // Level 1: Cascaded, then fired.
+#define TIMER_IDLE_WAKEUP_MAX (16)
+
+static unsigned long timer_near_late_ns = 0;
+static unsigned long timer_near_run = 0;
+static unsigned long timer_near_done = 0;
+static unsigned long timer_idle_wakeup = 0;
+
+static void cb_start_near(struct threadwq_job *job, void *priv)
+{
+	const uint64_t *due = priv;
+
+	CMM_STORE_SHARED(timer_near_late_ns, tm_mono_ns() - *due);
+	uatomic_inc(&timer_near_run);
+}
+
+static void cb_finish_near(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&timer_near_done);
+}
+
+/*
+ * One timer an hour away, one a few hundred ms away. The timer thread sleeps until the near one (and the
+ * cascades of its slot), instead of waking up every tick.
+ */
+static void test_timer_idle(struct threadwq_timer *tmr, struct threadwq *twq)
+{
+	struct threadwq_tjob far, near;
+	unsigned long wakeup;
+	uint64_t due;
+
+	timer_near_run = 0;
+	timer_near_done = 0;
+
+	threadwq_tjob_init(&far, cb_start_periodic, cb_finish_timer, NULL);
+	threadwq_tjob_init(&near, cb_start_near, cb_finish_near, &due);
+
+	pthread_mutex_lock(&tmr->lock);
+	wakeup = tmr->wakeup;
+	pthread_mutex_unlock(&tmr->lock);
+
+	BUG_ON(threadwq_add_job_delayed(tmr, twq, &far, TIMER_FAR_MS));
+	due = tm_mono_ns() + TIMER_NEAR_MS * 1000000ULL;
+	BUG_ON(threadwq_add_job_delayed(tmr, twq, &near, TIMER_NEAR_MS));
+
+	while (CMM_LOAD_SHARED(timer_near_done) == 0)
+	{
+		usleep(1000);
+	}
+	usleep(TIMER_NEAR_MS * 1000); // Idle w/ the far timer armed
+
+	pthread_mutex_lock(&tmr->lock);
+	wakeup = tmr->wakeup - wakeup;
+	pthread_mutex_unlock(&tmr->lock);
+
+	BUG_ON(threadwq_cancel_job_timer(tmr, &far));
+	BUG_ON(timer_near_late_ns > (uint64_t) TIMER_NEAR_MS * 1000000ULL); // Never early: late is unsigned.
+	BUG_ON(timer_near_run != 1);
+	BUG_ON(wakeup > TIMER_IDLE_WAKEUP_MAX);
+
+	timer_idle_wakeup = wakeup;
+}
+
+/*
+ * Lots of one-shot timers w/ random delay and one periodic timer. Measure how late they fire.
+ */
+static void test_threadwq_timer(void)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_timer tmr;
+	struct threadwq_tjob *tj_tbl, periodic;
+	uint64_t *due_tbl, ts, ts_add;
+	unsigned long delay;
+	unsigned int i;
+	int ret;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	timer_late_ns = 0;
+	timer_late_ns_max = 0;
+	timer_periodic_cnt = 0;
+
+	tj_tbl = calloc(TIMER_NR, sizeof(*tj_tbl));
+	due_tbl = calloc(TIMER_NR, sizeof(*due_tbl));
+	BUG_ON(tj_tbl == NULL || due_tbl == NULL);
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	BUG_ON(threadwq_timer_init(&tmr, 0));
+
+	threadwq_tjob_init(&periodic, cb_start_periodic, cb_finish_timer, NULL);
+	BUG_ON(threadwq_add_job_periodic(&tmr, &twq[0], &periodic, TIMER_PERIOD_MS, TIMER_PERIOD_MS));
+
+	ts = tm_mono_ns();
+	for (i = 0; i < TIMER_NR; i++)
+	{
+		delay = 1 + rand() % TIMER_DELAY_MAX_MS;
+		due_tbl[i] = tm_mono_ns() + delay * 1000000ULL;
+
+		threadwq_tjob_init(&tj_tbl[i], cb_start_timer, cb_finish_timer, &due_tbl[i]);
+		BUG_ON(threadwq_add_job_delayed(&tmr, &twq[i % TWQNUM], &tj_tbl[i], delay));
+	}
+	ts_add = tm_mono_ns() - ts;
+
+	while (CMM_LOAD_SHARED(cnt_finish) < TIMER_NR)
+	{
+		usleep(10000);
+	}
+
+	ret = threadwq_cancel_job_timer(&tmr, &periodic);
+	while (ret == -EBUSY && CMM_LOAD_SHARED(cnt_finish) < TIMER_NR + 1)
+	{
+		usleep(1000); // cb_finish comes after the last run.
+	}
+
+	test_timer_rearm(&tmr, &twq[0]);
+	test_timer_idle(&tmr, &twq[0]);
+
+	threadwq_timer_exit(&tmr);
+
+	ts = tm_mono_ns() - ts;
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("%u thread, timer wheel, %u timers, delay 1..%ums:\ncnt=%lu, add=%luns/op, time=%lums\n",
+		TWQNUM, TIMER_NR, TIMER_DELAY_MAX_MS,
+		cnt_start, (unsigned long) (ts_add / TIMER_NR), (unsigned long) (ts / 1000000));
+	printf("\tlate avg=%luus max=%luus, fired=%lu overrun=%lu, periodic %ums runs=%lu\n",
+		timer_late_ns / (cnt_start ? cnt_start : 1) / 1000, timer_late_ns_max / 1000,
+		tmr.fired, tmr.overrun, TIMER_PERIOD_MS, timer_periodic_cnt);
+	printf("\tcancel while running, then arm again: runs=%lu finish=%lu\n", timer_slow_run, timer_slow_done);
+	printf("\tidle w/ a timer %ums away, %ums run: wakeups=%lu, late=%luus\n",
+		TIMER_FAR_MS, 2 * TIMER_NEAR_MS, timer_idle_wakeup, timer_near_late_ns / 1000);
+	printf("\t--> cnt=%lu free=%lu\n", cnt_start, cnt_finish);
+
+	free(due_tbl);
+	free(tj_tbl);
+}
+
+#define DAG_WIDTH (256) // Fan-out/fan-in width
+#define DAG_DEPTH (8) // Layers between joins
+#define DAG_ROUND (50)
+
+static unsigned long dag_done = 0;
+
+static void cb_run_dag(struct threadwq_task *task, void *priv)
+{
+	uatomic_inc(&cnt_start);
+	scan_database();
+}
+
+static void cb_done_dag(struct threadwq_dag *dag, void *priv)
+{
+	uatomic_inc(&dag_done);
+}
+
+#define DAG_RING_SLOT (64) // Less than DAG_WIDTH: A fan-out overflows the local ring.
+
+/*
+ * join -> DAG_WIDTH tasks -> join -> ... DAG_DEPTH times. Every join waits for the whole layer.
+ *
+ * nr_slot: 0: lfq. Otherwise a ring this small, which the workers fill up from their own jobs.
+ * shared: One queue for all workers. Ready tasks go into it from any member.
+ */
+static void test_threadwq_dag(const unsigned int steal, const unsigned int nr_slot, const unsigned int shared)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_dag dag;
+	struct threadwq_task *task_tbl, *join, *prev_join;
+	const unsigned int nr_task = DAG_DEPTH * (DAG_WIDTH + 1) + 1;
+	uint64_t ts;
+	unsigned int d, w, n = 0, round;
+
+	cnt_start = 0;
+	dag_done = 0;
+
+	task_tbl = calloc(nr_task, sizeof(*task_tbl));
+	BUG_ON(task_tbl == NULL);
+
+	if (nr_slot)
+	{
+		BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, nr_slot));
+	}
+	else
+	{
+		BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	}
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	if (steal)
+	{
+		BUG_ON(threadwq_set_steal_multi(twq, TWQNUM, THREADWQ_STEAL_BATCH_DFL));
+	}
+	if (shared)
+	{
+		BUG_ON(threadwq_set_shared_multi(twq, TWQNUM, 0));
+	}
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, shared ? &threadwq_man_ops_shared : &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	threadwq_dag_init(&dag, &twq_man, cb_done_dag, NULL);
+
+	prev_join = &task_tbl[n++];
+	threadwq_task_init(prev_join, &dag, cb_run_dag, NULL);
+
+	for (d = 0; d < DAG_DEPTH; d++)
+	{
+		join = &task_tbl[n++];
+		threadwq_task_init(join, &dag, cb_run_dag, NULL);
+
+		for (w = 0; w < DAG_WIDTH; w++)
+		{
+			threadwq_task_init(&task_tbl[n], &dag, cb_run_dag, NULL);
+			BUG_ON(threadwq_task_depend(&task_tbl[n], prev_join));
+			BUG_ON(threadwq_task_depend(join, &task_tbl[n]));
+			n++;
+		}
+
+		prev_join = join;
+	}
+
+	BUG_ON(n != nr_task);
+
+	ts = tm_mono_ns();
+	for (round = 0; round < DAG_ROUND; round++)
+	{
+		BUG_ON(threadwq_dag_run(&dag));
+
+		while (CMM_LOAD_SHARED(dag_done) == round)
+		{
+			caa_cpu_relax();
+		}
+	}
+	ts = tm_mono_ns() - ts;
+
+	threadwq_dag_exit(&dag);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("%u thread, dag %ux%u, %u rounds, steal=%u ring=%u shared=%u:\ncnt=%lu, time=%lums tasks/sec=%lu\n",
+		TWQNUM, DAG_DEPTH, DAG_WIDTH, DAG_ROUND, steal, nr_slot, shared,
+		cnt_start, (unsigned long) (ts / 1000000), (unsigned long) (cnt_start * 1000000000ULL / (ts ? ts : 1)));
+
+	free(task_tbl);
+}
+
+#define PAR_TABLE_NR (1UL << 24) // A big table, unlike database[]
+#define PAR_ROUND (20)
+
+static unsigned int *par_table;
+
+static void par_fill(const unsigned long lo, const unsigned long hi, void *priv)
+{
+	unsigned long i;
+
+	for (i = lo; i < hi; i++)
+	{
+		par_table[i] = (unsigned int) (i * 2654435761UL);
+	}
+}
+
+static long par_count(const unsigned long lo, const unsigned long hi, const long acc, void *priv)
+{
+	unsigned long i;
+	long nr = acc;
+
+	for (i = lo; i < hi; i++)
+	{
+		if (par_table[i] % 7 == 0)
+		{
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
+#define PAR_TOP_NR (100000) // Items just below ULONG_MAX: The chunk cursor must not wrap.
+
+static long par_span(const unsigned long lo, const unsigned long hi, const long acc, void *priv)
+{
+	return acc + (long) (hi - lo);
+}
+
+static long par_sum(const long a, const long b, void *priv)
+{
+	return a + b;
+}
+
+/*
+ * Table scan: Serial vs threadwq_parallel_reduce() w/ the caller taking part.
+ */
+static void test_threadwq_parallel(const unsigned long grain)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	uint64_t ts, ts_serial, ts_par;
+	long nr_serial = 0, nr_par = 0;
+	long nr_top = 0;
+	unsigned int round;
+
+	par_table = malloc(PAR_TABLE_NR * sizeof(*par_table));
+	BUG_ON(par_table == NULL);
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	rcu_register_thread();
+
+	BUG_ON(threadwq_parallel_for(&twq_man, 0, PAR_TABLE_NR, grain, par_fill, NULL));
+
+	ts = tm_mono_ns();
+	for (round = 0; round < PAR_ROUND; round++)
+	{
+		nr_serial = par_count(0, PAR_TABLE_NR, 0, NULL);
+	}
+	ts_serial = tm_mono_ns() - ts;
+
+	ts = tm_mono_ns();
+	for (round = 0; round < PAR_ROUND; round++)
+	{
+		BUG_ON(threadwq_parallel_reduce(&twq_man, 0, PAR_TABLE_NR, grain, 0, par_count, par_sum, NULL, &nr_par));
+	}
+	ts_par = tm_mono_ns() - ts;
+
+	BUG_ON(threadwq_parallel_reduce(&twq_man, ULONG_MAX - PAR_TOP_NR, ULONG_MAX, grain ? grain : 3, 0,
+		par_span, par_sum, NULL, &nr_top));
+
+	rcu_unregister_thread();
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("%u thread + caller, parallel reduce over %lu items, grain %lu:\n", TWQNUM, PAR_TABLE_NR, grain);
+	printf("\tserial=%luus parallel=%luus per scan, match %ld/%ld\n",
+		(unsigned long) (ts_serial / PAR_ROUND / 1000), (unsigned long) (ts_par / PAR_ROUND / 1000),
+		nr_serial, nr_par);
+	printf("\ttop of range: %ld/%d items\n", nr_top, PAR_TOP_NR);
+	BUG_ON(nr_serial != nr_par);
+	BUG_ON(nr_top != PAR_TOP_NR);
+
+	free(par_table);
+}
+
+static void print_latency(const char *name, const struct threadwq_latency *lat)
+{
+	printf("\t%s: wait p50=%luus p99=%luus p999=%luus max=%luus | run p50=%luns p99=%luns p999=%luns max=%luns (%lu jobs)\n",
+		name,
+		(unsigned long) lat->wait.p50 / 1000, (unsigned long) lat->wait.p99 / 1000,
+		(unsigned long) lat->wait.p999 / 1000, (unsigned long) lat->wait.max / 1000,
+		(unsigned long) lat->run.p50, (unsigned long) lat->run.p99,
+		(unsigned long) lat->run.p999, (unsigned long) lat->run.max,
+		lat->run.nr);
+}
+
+/*
+ * Same load as test_threadwq3(), w/ latency histograms. Print per-worker and pool percentiles.
+ */
+static void test_threadwq_hist(void)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_latency lat;
+	char name[32];
+	unsigned int i;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_set_hist_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr4idle));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	{ // Create another writer thread
+		pthread_t tid;
+		pthread_attr_t tattr;
+
+		pthread_attr_init(&tattr);
+
+		if (pthread_create(&tid, &tattr, &threadfunc3, &twq_man))
+		{
+			BUG();
+		}
+
+		pthread_join(tid, NULL);
+	}
+
+	printf("%u thread, latency histograms:\n", TWQNUM);
+	for (i = 0; i < TWQNUM; i++)
+	{
+		snprintf(name, sizeof(name), "twq%u", i);
+		threadwq_get_latency(&twq[i], &lat); // Workers are still running. Fine.
+		print_latency(name, &lat);
+	}
+	threadwq_get_latency_multi(twq, TWQNUM, &lat);
+	print_latency("pool", &lat);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM); // Histograms are freed here.
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+/*
+ * Dispatchers under skewed job cost (see threadfunc_skew()). w/o stealing, the dispatcher alone decides
+ * the balance. Compare throughput and queue wait.
+ */
+static void test_threadwq_dispatch(const struct threadwq_man_ops *ops, const char *name)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_latency lat;
+	unsigned long done, done_min = ULONG_MAX, done_max = 0;
+	pthread_t tid;
+	unsigned int i;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_set_hist_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, ops));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	if (pthread_create(&tid, NULL, &threadfunc_skew, &twq_man))
+	{
+		BUG();
+	}
+
+	pthread_join(tid, NULL);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	for (i = 0; i < TWQNUM; i++)
+	{
+		done = uatomic_read(&twq[i].prio[0].done);
+		if (done < done_min) done_min = done;
+		if (done > done_max) done_max = done;
+	}
+
+	printf("%u thread, skewed job, dispatch %s:\ncnt=%lu, per twq %lu..%lu, fail=%lu\n",
+		TWQNUM, name, cnt_start, done_min, done_max, wait);
+	threadwq_get_latency_multi(twq, TWQNUM, &lat);
+	print_latency(name, &lat);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define PROD_MAX (32)
+#define PROD_BATCH (256) // Jobs in flight per producer
+#define PROD_RUN_MS (TEST_TIME * 100 + 100) // Per producer count
+
+struct prod_arg
+{
+	struct threadwq_man *man;
+	unsigned long *stop;
+	unsigned long done __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< Bumped by workers.
+	unsigned long added;
+	struct threadwq_job job_tbl[PROD_BATCH];
+};
+
+static void cb_start_nop(struct threadwq_job *job, void *priv)
+{
+	return;
+}
+
+static void cb_finish_prod(struct threadwq_job *job, void *priv)
+{
+	struct prod_arg *arg = priv;
+
+	uatomic_inc(&arg->done);
+}
+
+/*
+ * Add PROD_BATCH empty jobs one by one, wait for them, again. Measures the submit path only.
+ */
+static void *threadfunc_prod(void *argin)
+{
+	struct prod_arg *arg = argin;
+	unsigned int i;
+
+	rcu_register_thread();
+
+	while (!uatomic_read(arg->stop))
+	{
+		for (i = 0; i < PROD_BATCH; i++)
+		{
+			threadwq_job_init(&arg->job_tbl[i], cb_start_nop, cb_finish_prod, arg);
+			BUG_ON(threadwq_man_add_job(arg->man, &arg->job_tbl[i]));
+		}
+		arg->added += PROD_BATCH;
+
+		while (uatomic_read(&arg->done) < arg->added)
+		{
+			sched_yield(); // 32 producers may outnumber the cpus.
+		}
+	}
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Submit scaling: 1 to PROD_MAX producers on one man. Ring backend and inline finish: No rcu in the way.
+ */
+static void test_threadwq_producers(const struct threadwq_man_ops *ops, const char *name)
+{
+	struct threadwq *twq = threadwq_alloc_multi(TWQNUM, -1);
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct prod_arg *arg_tbl;
+	pthread_t tid_tbl[PROD_MAX];
+	unsigned long stop, total;
+	uint64_t ts;
+	unsigned int nr, i;
+
+	BUG_ON(twq == NULL);
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL));
+	set_idle_ops(&twq_ops);
+	twq_ops.finish = THREADWQ_FINISH_INLINE;
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, ops));
+
+	BUG_ON(posix_memalign((void **) &arg_tbl, CAA_CACHE_LINE_SIZE, PROD_MAX * sizeof(*arg_tbl)));
+
+	printf("%u thread, submit scaling, dispatch %s:\n", TWQNUM, name);
+
+	for (nr = 1; nr <= PROD_MAX; nr *= 2)
+	{
+		memset(arg_tbl, 0x00, PROD_MAX * sizeof(*arg_tbl));
+		stop = 0;
+
+		for (i = 0; i < nr; i++)
+		{
+			arg_tbl[i].man = &twq_man;
+			arg_tbl[i].stop = &stop;
+
+			if (pthread_create(&tid_tbl[i], NULL, &threadfunc_prod, &arg_tbl[i]))
+			{
+				BUG();
+			}
+		}
+
+		ts = tm_mono_ns();
+		usleep(PROD_RUN_MS * 1000);
+		uatomic_set(&stop, 1);
+
+		total = 0;
+		for (i = 0; i < nr; i++)
+		{
+			pthread_join(tid_tbl[i], NULL);
+			total += arg_tbl[i].added;
+		}
+		ts = tm_mono_ns() - ts;
+
+		printf("\t%2u producers: jobs/sec=%lu\n", nr, (unsigned long) (total * 1000000000ULL / ts));
+	}
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done before arg_tbl goes.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+	threadwq_free_multi(twq);
+
+	free(arg_tbl);
+}
+
+#define FS_ITER (20000000UL)
+
+/*
+ * A producer-written and a worker-written counter, in one cache line or apart. Like depth vs busy in a
+ * threadwq, or busy of twq[0] vs twq[1].
+ */
+struct fs_packed
+{
+	unsigned long prod;
+	unsigned long cons;
+};
+
+struct fs_split
+{
+	unsigned long prod __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
+	unsigned long cons __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
+};
+
+static void *threadfunc_fs(void *cntin)
+{
+	unsigned long *cnt = cntin, i;
+
+	for (i = 0; i < FS_ITER; i++)
+	{
+		uatomic_inc(cnt);
+	}
+
+	return NULL;
+}
+
+static uint64_t fs_run(unsigned long *a, unsigned long *b)
+{
+	pthread_t tid_a, tid_b;
+	uint64_t ts = tm_mono_ns();
+
+	if (pthread_create(&tid_a, NULL, &threadfunc_fs, a) || pthread_create(&tid_b, NULL, &threadfunc_fs, b))
+	{
+		BUG();
+	}
+
+	pthread_join(tid_a, NULL);
+	pthread_join(tid_b, NULL);
+
+	return tm_mono_ns() - ts;
+}
+
+/*
+ * False sharing: Two threads bump their own counter. Same line vs own line.
+ */
+static void test_false_sharing(void)
+{
+	struct fs_packed *packed;
+	struct fs_split *split;
+	uint64_t ns_packed, ns_split;
+
+	BUG_ON(posix_memalign((void **) &packed, CAA_CACHE_LINE_SIZE, sizeof(*packed)));
+	BUG_ON(posix_memalign((void **) &split, CAA_CACHE_LINE_SIZE, sizeof(*split)));
+	memset(packed, 0x00, sizeof(*packed));
+	memset(split, 0x00, sizeof(*split));
+
+	ns_packed = fs_run(&packed->prod, &packed->cons);
+	ns_split = fs_run(&split->prod, &split->cons);
+
+	printf("false sharing, 2 threads x %lu atomic inc:\nsame line %lums (%luns/op), own line %lums (%luns/op)\n",
+		FS_ITER,
+		(unsigned long) (ns_packed / 1000000), (unsigned long) (ns_packed / FS_ITER),
+		(unsigned long) (ns_split / 1000000), (unsigned long) (ns_split / FS_ITER));
+	printf("\tstruct threadwq: %lu bytes, align %lu\n",
+		(unsigned long) sizeof(struct threadwq), (unsigned long) __alignof__(struct threadwq));
+
+	BUG_ON(packed->prod != FS_ITER || split->cons != FS_ITER);
+
+	free(packed);
+	free(split);
+}
+
+/*
+ * Queue topology: Per-worker queues behind a dispatcher, or one shared queue.
+ */
+typedef enum
+{
+	TOPO_SHORT = 0, //!< Empty jobs
+	TOPO_LONG, //!< One database scan each
+	TOPO_MIXED, //!< Empty, and 1 in 16 is 4 scans
+	TOPO_MAX
+} topo_cost_t;
+
+struct topo_arg
+{
+	struct threadwq_man *man;
+	topo_cost_t cost;
+	uint64_t ns;
+};
+
+static void cb_start_cost(struct threadwq_job *job, void *priv)
+{
+	unsigned long n = (uintptr_t) priv;
+
+	uatomic_inc(&cnt_start);
+
+	while (n--)
+	{
+		scan_database();
+	}
+}
+
+static void *threadfunc_topo(void *argin)
+{
+	struct topo_arg *arg = argin;
+	struct threadwq_job *job;
+	unsigned long accl = 0, n;
+	uint64_t ts = tm_mono_ns();
+
+	rcu_register_thread();
+
+	while (tm_mono_ns() - ts < (uint64_t) (TEST_TIME + 1) * 1000000000ULL)
+	{
+		job = mempool_alloc(&mp);
+		if (!job)
+		{
+			caa_cpu_relax();
+			wait++; // It means queue full.
+			continue;
+		}
+
+		switch (arg->cost)
+		{
+		case TOPO_SHORT:
+			n = 0;
+			break;
+		case TOPO_LONG:
+			n = 1;
+			break;
+		case TOPO_MIXED:
+		default:
+			n = (accl % 16) ? 0 : 4;
+			break;
+		}
+		accl++;
+
+		threadwq_job_init(job, cb_start_cost, cb_finish, (void *) (uintptr_t) n);
+		BUG_ON(threadwq_man_add_job(arg->man, job));
+	}
+
+	arg->ns = tm_mono_ns() - ts;
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+static void test_threadwq_topo(const struct threadwq_man_ops *ops, const char *name, const topo_cost_t cost)
+{
+	static const char *cost_name[TOPO_MAX] = { "short", "long", "mixed" };
+
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_latency lat;
+	struct topo_arg arg;
+	pthread_t tid;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	if (ops == &threadwq_man_ops_shared)
+	{
+		BUG_ON(threadwq_set_shared_multi(twq, TWQNUM, 0));
+	}
+	BUG_ON(threadwq_set_hist_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, ops));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.man = &twq_man;
+	arg.cost = cost;
+
+	if (pthread_create(&tid, NULL, &threadfunc_topo, &arg))
+	{
+		BUG();
+	}
+
+	pthread_join(tid, NULL);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	printf("%u thread, %s jobs, dispatch %s:\ncnt=%lu, jobs/sec=%lu, fail=%lu\n",
+		TWQNUM, cost_name[cost], name, cnt_start,
+		(unsigned long) (cnt_start * 1000000000ULL / (arg.ns ? arg.ns : 1)), wait);
+	threadwq_get_latency_multi(twq, TWQNUM, &lat);
+	print_latency(name, &lat);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define EDF_TIGHT_NS (200000ULL) // 1 in 8 jobs: empty, due in 200us
+#define EDF_LOOSE_NS (20000000ULL) // The rest: 1 in 16 scans the database, due in 20ms
+
+static unsigned long edf_late; // Started after the deadline
+
+static void cb_start_edf(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&cnt_start);
+
+	if (tm_mono_ns() > job->deadline)
+	{
+		uatomic_inc(&edf_late);
+	}
+
+	if (priv)
+	{
+		scan_database();
+	}
+}
+
+static void *threadfunc_edf(void *argin)
+{
+	struct topo_arg *arg = argin;
+	struct threadwq_job *job;
+	unsigned long accl = 0;
+	uint64_t ts = tm_mono_ns(), now;
+
+	rcu_register_thread();
+
+	while ((now = tm_mono_ns()) - ts < (uint64_t) (TEST_TIME + 1) * 1000000000ULL)
+	{
+		job = mempool_alloc(&mp);
+		if (!job)
+		{
+			caa_cpu_relax();
+			wait++; // It means queue full.
+			continue;
+		}
+
+		if (accl % 8 == 0)
+		{
+			threadwq_job_init(job, cb_start_edf, cb_finish, NULL);
+			threadwq_job_set_deadline(job, now + EDF_TIGHT_NS);
+		}
+		else
+		{
+			threadwq_job_init(job, cb_start_edf, cb_finish, (void *) (uintptr_t) (accl % 16 == 1));
+			threadwq_job_set_deadline(job, now + EDF_LOOSE_NS);
+		}
+		accl++;
+
+		BUG_ON(threadwq_man_add_job(arg->man, job));
+	}
+
+	arg->ns = tm_mono_ns() - ts;
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Tight and loose deadlines behind a backlog. FIFO vs EDF: Compare the miss rate.
+ */
+static void test_threadwq_edf(const unsigned int edf, const threadwq_edf_miss_t miss)
+{
+	static const char *miss_name[THREADWQ_EDF_MAX] = { "run", "drop", "call" };
+
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_edf_stat st, sum;
+	struct topo_arg arg;
+	pthread_t tid;
+	unsigned int i;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+	edf_late = 0;
+
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	if (edf)
+	{
+		BUG_ON(threadwq_set_edf_multi(twq, TWQNUM, 0, miss, NULL));
+	}
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.man = &twq_man;
+
+	if (pthread_create(&tid, NULL, &threadfunc_edf, &arg))
+	{
+		BUG();
+	}
+
+	pthread_join(tid, NULL);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	memset(&sum, 0x00, sizeof(sum));
+	for (i = 0; i < TWQNUM; i++)
+	{
+		threadwq_get_edf_stat(&twq[i], &st);
+		sum.nr += st.nr;
+		sum.late += st.late;
+		sum.expired += st.expired;
+	}
+
+	printf("%u thread, deadlines, %s%s:\ncnt=%lu, jobs/sec=%lu, fail=%lu\n",
+		TWQNUM, edf ? "edf, miss " : "fifo", edf ? miss_name[miss] : "", cnt_start,
+		(unsigned long) (cnt_start * 1000000000ULL / (arg.ns ? arg.ns : 1)), wait);
+	printf("\tstarted late=%lu (%lu ppm) | edf nr=%lu late=%lu expired=%lu\n",
+		edf_late, cnt_start ? edf_late * 1000000 / cnt_start : 0, sum.nr, sum.late, sum.expired);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define BP_DEPTH_MAX (256) // Per twq
+
+struct bp_arg
+{
+	struct threadwq_man *man;
+	struct threadwq *twq_tbl;
+	unsigned int block; //!< 0: threadwq_man_add_job() and retry on -EAGAIN. 1: threadwq_add_job_wait().
+	unsigned long full; //!< -EAGAIN count
+	unsigned long depth_max; //!< Max depth seen
+};
+
+static void *threadfunc_bp(void *argin)
+{
+	struct bp_arg *arg = argin;
+	struct timespec ts, ts_now;
+	struct threadwq_job *job;
+	unsigned long accl = 0, depth;
+	unsigned int i;
+
+	rcu_register_thread();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (;;)
+	{
+		job = mempool_alloc(&mp);
+		if (!job)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts_now);
+			if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+
+			caa_cpu_relax();
+			wait++; // Should not happen: Depth limits keep the pool from running dry.
+			continue;
+		}
+
+		threadwq_job_init(job, cb_start, cb_finish, NULL);
+
+		if (arg->block)
+		{
+			BUG_ON(threadwq_add_job_wait(&arg->twq_tbl[accl % TWQNUM], job, 0));
+		}
+		else
+		{
+			while (threadwq_man_add_job(arg->man, job) == -EAGAIN)
+			{
+				arg->full++;
+				caa_cpu_relax();
+			}
+		}
+
+		accl++;
+
+		for (i = 0; i < TWQNUM; i++)
+		{
+			depth = CMM_LOAD_SHARED(arg->twq_tbl[i].depth);
+			if (depth > arg->depth_max)
+			{
+				arg->depth_max = depth;
+			}
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts_now);
+		if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+	}
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Depth limited twqs. The producer is held back by the queues, not by the mempool running dry.
+ */
+static void test_threadwq_backpressure(const unsigned int block)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct bp_arg arg;
+	struct timespec ts, ts_now;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_set_depth_max_multi(twq, TWQNUM, BP_DEPTH_MAX));
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.man = &twq_man;
+	arg.twq_tbl = twq;
+	arg.block = block;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	{ // Create another writer thread
+		pthread_t tid;
+		pthread_attr_t tattr;
+
+		pthread_attr_init(&tattr);
+
+		if (pthread_create(&tid, &tattr, &threadfunc_bp, &arg))
+		{
+			BUG();
+		}
+
+		pthread_join(tid, NULL);
+	}
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	clock_gettime(CLOCK_REALTIME, &ts_now);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("%u thread, depth max %u, %s:\ncnt=%lu, full=%lu, depth seen=%lu, fail=%lu time=%lu\n",
+		TWQNUM, BP_DEPTH_MAX, block ? "blocking add" : "man try add",
+		cnt_start, arg.full, arg.depth_max, wait, (ts_now.tv_sec - ts.tv_sec));
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define FLUSH_PHASE_JOBS (4096)
+
+struct flush_arg
+{
+	struct threadwq_man *man;
+	unsigned long phase;
+	unsigned long bad; //!< Phases which returned before all of their jobs were finished.
+	uint64_t flush_ns_max;
+	uint64_t flush_ns_sum;
+};
+
+/*
+ * Phase after phase: Add a burst, flush, and check every job of the burst is finished. The pool keeps running.
+ */
+static void *threadfunc_flush(void *argin)
+{
+	struct flush_arg *arg = argin;
+	struct threadwq_job *job;
+	struct timespec ts, ts_now;
+	unsigned long i, added = 0;
+	uint64_t t0, dt;
+
+	rcu_register_thread();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts_now);
+		if (ts_now.tv_sec - ts.tv_sec > TEST_TIME)
+		{
+			break;
+		}
+
+		for (i = 0; i < FLUSH_PHASE_JOBS; i++)
+		{
+			while (!(job = mempool_alloc(&mp)))
+			{
+				caa_cpu_relax();
+				wait++; // It means queue full.
+			}
+
+			threadwq_job_init(job, cb_start, cb_finish, NULL);
+			BUG_ON(threadwq_man_add_job(arg->man, job));
+		}
+		added += FLUSH_PHASE_JOBS;
+
+		t0 = tm_mono_ns();
+		threadwq_man_flush(arg->man);
+		dt = tm_mono_ns() - t0;
+
+		if (uatomic_read(&cnt_finish) != added)
+		{
+			arg->bad++;
+		}
+
+		arg->phase++;
+		arg->flush_ns_sum += dt;
+		if (dt > arg->flush_ns_max)
+		{
+			arg->flush_ns_max = dt;
+		}
+	}
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+static void test_threadwq_flush(const threadwq_finish_t finish)
+{
+	static const char *finish_name[THREADWQ_FINISH_MAX] = { "dfl", "rcu", "inline", "batch" };
+
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct flush_arg arg;
+	pthread_t tid;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	if (finish == THREADWQ_FINISH_RCU)
+	{
+		BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	}
+	else
+	{
+		BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL)); // lfq is rcu only.
+	}
+	set_idle_ops(&twq_ops);
+	twq_ops.finish = finish;
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.man = &twq_man;
+
+	if (pthread_create(&tid, NULL, &threadfunc_flush, &arg))
+	{
+		BUG();
+	}
+
+	pthread_join(tid, NULL);
+
+	printf("%u thread, flush every %u jobs, finish %s:\n%lu phases, bad=%lu, flush avg %luus max %luus\n",
+		TWQNUM, FLUSH_PHASE_JOBS, finish_name[finish], arg.phase, arg.bad,
+		arg.phase ? (unsigned long) (arg.flush_ns_sum / arg.phase / 1000) : 0,
+		(unsigned long) (arg.flush_ns_max / 1000));
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define FLUSH_STRESS_PROD (4)
+#define FLUSH_STRESS_BATCH (64) // Jobs in flight per producer
+
+struct flush_stress_arg
+{
+	struct threadwq_man *man;
+	unsigned long *stop;
+	unsigned long done __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< Bumped by cb_finish.
+	unsigned long added; //!< Bumped once threadwq_man_add_job() returned.
+	struct threadwq_job job_tbl[FLUSH_STRESS_BATCH];
+};
+
+static void cb_finish_flush_stress(struct threadwq_job *job, void *priv)
+{
+	struct flush_stress_arg *arg = priv;
+
+	uatomic_inc(&arg->done);
+}
+
+static void *threadfunc_flush_stress(void *argin)
+{
+	struct flush_stress_arg *arg = argin;
+	unsigned int i;
+
+	rcu_register_thread();
+
+	while (!uatomic_read(arg->stop))
+	{
+		for (i = 0; i < FLUSH_STRESS_BATCH; i++)
+		{
+			threadwq_job_init(&arg->job_tbl[i], cb_start_nop, cb_finish_flush_stress, arg);
+			BUG_ON(threadwq_man_add_job(arg->man, &arg->job_tbl[i]));
+			uatomic_inc(&arg->added);
+		}
+
+		while (uatomic_read(&arg->done) < arg->added)
+		{
+			caa_cpu_relax();
+		}
+	}
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Producers add w/o pause while we flush back to back: An add racing w/ the epoch flip must still be waited for.
+ * Every job added before a flush started must be finished when it returns.
+ */
+static void test_threadwq_flush_stress(void)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct flush_stress_arg *arg_tbl;
+	pthread_t tid_tbl[FLUSH_STRESS_PROD];
+	struct timespec ts, ts_now;
+	unsigned long stop = 0, added, done, nr_flush = 0, bad = 0;
+	unsigned int i;
+
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL));
+	set_idle_ops(&twq_ops);
+	twq_ops.finish = THREADWQ_FINISH_INLINE; // Short epochs: The flip races w/ adds all the time.
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(posix_memalign((void **) &arg_tbl, CAA_CACHE_LINE_SIZE, FLUSH_STRESS_PROD * sizeof(*arg_tbl)));
+	memset(arg_tbl, 0x00, FLUSH_STRESS_PROD * sizeof(*arg_tbl));
+
+	for (i = 0; i < FLUSH_STRESS_PROD; i++)
+	{
+		arg_tbl[i].man = &twq_man;
+		arg_tbl[i].stop = &stop;
+
+		if (pthread_create(&tid_tbl[i], NULL, &threadfunc_flush_stress, &arg_tbl[i]))
+		{
+			BUG();
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts_now);
+		if (ts_now.tv_sec - ts.tv_sec > TEST_TIME)
+		{
+			break;
+		}
+
+		added = 0;
+		for (i = 0; i < FLUSH_STRESS_PROD; i++)
+		{
+			added += uatomic_read(&arg_tbl[i].added);
+		}
+
+		threadwq_flush_multi(twq, TWQNUM);
+
+		done = 0;
+		for (i = 0; i < FLUSH_STRESS_PROD; i++)
+		{
+			done += uatomic_read(&arg_tbl[i].done);
+		}
+
+		if (done < added)
+		{
+			bad++;
+		}
+		nr_flush++;
+	}
+
+	uatomic_set(&stop, 1);
+
+	added = 0;
+	for (i = 0; i < FLUSH_STRESS_PROD; i++)
+	{
+		pthread_join(tid_tbl[i], NULL);
+		added += arg_tbl[i].added;
+	}
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done before arg_tbl goes.
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	printf("%u thread, %u producers vs back to back flush:\n%lu flushes, jobs=%lu, bad=%lu\n",
+		TWQNUM, FLUSH_STRESS_PROD, nr_flush, added, bad);
+
+	free(arg_tbl);
+}
+
+#define HASH_FLOW_NR (256)
+#define HASH_DEPTH_MAX (1024) // Per twq
+
+/*
+ * One job of a flow. seq is per flow, in the order the producer added it.
+ */
+struct flow_job
+{
+	struct threadwq_job job;
+	unsigned int flow;
+	unsigned long seq;
+};
+
+static unsigned long flow_seq[HASH_FLOW_NR]; // Next seq to run, per flow.
+static struct threadwq *flow_owner[HASH_FLOW_NR]; // Last worker, per flow.
+static unsigned long flow_misorder, flow_move;
+static unsigned long hash_done;
+
+static void cb_start_flow(struct threadwq_job *job, void *priv)
+{
+	struct flow_job *fj = caa_container_of(job, struct flow_job, job);
+	struct threadwq *self = threadwq_self();
+
+	uatomic_inc(&cnt_start);
+
+	if (fj->seq != flow_seq[fj->flow])
+	{
+		uatomic_inc(&flow_misorder);
+	}
+	flow_seq[fj->flow] = fj->seq + 1;
+
+	if (flow_owner[fj->flow] != self)
+	{
+		if (flow_owner[fj->flow])
+		{
+			uatomic_inc(&flow_move);
+		}
+		flow_owner[fj->flow] = self;
+	}
+
+	scan_database();
+}
+
+static void cb_finish_flow(struct threadwq_job *job, void *priv)
+{
+	free(caa_container_of(job, struct flow_job, job));
+	uatomic_inc(&cnt_finish);
+}
+
+static void *threadfunc_hash(void *twqmanin)
+{
+	struct threadwq_man *man = twqmanin;
+	unsigned long next[HASH_FLOW_NR] = { 0 };
+	struct timespec ts, ts_now;
+	struct flow_job *fj;
+	uint32_t x = 2463534242U;
+
+	rcu_register_thread();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts_now);
+		if (ts_now.tv_sec - ts.tv_sec > TEST_TIME)
+		{
+			break;
+		}
+
+		fj = malloc(sizeof(*fj));
+		BUG_ON(fj == NULL);
+
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+
+		fj->flow = x % HASH_FLOW_NR;
+		fj->seq = next[fj->flow]++;
+
+		threadwq_job_init(&fj->job, cb_start_flow, cb_finish_flow, NULL);
+		threadwq_job_set_key(&fj->job, fj->flow);
+
+		while (threadwq_man_add_job(man, &fj->job) == -EAGAIN)
+		{
+			caa_cpu_relax();
+			wait++; // It means queue full.
+		}
+	}
+
+	uatomic_set(&hash_done, 1);
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Per-flow order w/ the hash affinity dispatcher. resize: Resize the pool all along.
+ */
+static void test_threadwq_hash(const unsigned int resize)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	unsigned int round = 0;
+	pthread_t tid;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+	memset(flow_seq, 0x00, sizeof(flow_seq));
+	memset(flow_owner, 0x00, sizeof(flow_owner));
+	flow_misorder = 0;
+	flow_move = 0;
+	hash_done = 0;
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_set_depth_max_multi(twq, TWQNUM, HASH_DEPTH_MAX));
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_hash));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	if (resize)
+	{
+		BUG_ON(threadwq_man_set_elastic(&twq_man, NULL)); // Resize by hand.
+	}
+
+	cmm_smp_mb();
+
+	if (pthread_create(&tid, NULL, &threadfunc_hash, &twq_man))
+	{
+		BUG();
+	}
+
+	while (!uatomic_read(&hash_done))
+	{
+		usleep(100000);
+
+		if (resize)
+		{
+			BUG_ON(threadwq_man_resize(&twq_man, (++round % TWQNUM) + 1));
+		}
+	}
+
+	pthread_join(tid, NULL);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	printf("%u thread, hash affinity, %u flows, %s:\ncnt=%lu, misorder=%lu, moved=%lu, resize=%u, fail=%lu\n",
+		TWQNUM, HASH_FLOW_NR, resize ? "resizing" : "fixed pool",
+		cnt_start, flow_misorder, flow_move, round, wait);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+typedef enum
+{
+	HASH_POOL_PLAIN = 0,
+	HASH_POOL_STEAL,
+	HASH_POOL_SHARED,
+	HASH_POOL_EDF,
+	HASH_POOL_PRIO,
+	HASH_POOL_MAX
+} hash_pool_t;
+
+/*
+ * Hash affinity promises the order of a key. Pools which reorder jobs must fail threadwq_man_init(). EDF and
+ * priority classes are set on the last twq only: Every twq is checked.
+ */
+static void test_threadwq_hash_reject(void)
+{
+	static const char *name_tbl[HASH_POOL_MAX] = { "plain", "stealing", "shared", "EDF", "priority classes" };
+	struct threadwq twq[TWQNUM];
+	struct threadwq_man twq_man;
+	hash_pool_t pool;
+	int ret;
+
+	printf("%u thread, hash affinity on unordered pools:\n", TWQNUM);
+
+	for (pool = HASH_POOL_PLAIN; pool < HASH_POOL_MAX; pool++)
+	{
+		BUG_ON(threadwq_init_multi(twq, TWQNUM));
+
+		switch (pool)
+		{
+		case HASH_POOL_STEAL:
+			BUG_ON(threadwq_set_steal_multi(twq, TWQNUM, 0));
+			break;
+		case HASH_POOL_SHARED:
+			BUG_ON(threadwq_set_shared_multi(twq, TWQNUM, 0));
+			break;
+		case HASH_POOL_EDF:
+			BUG_ON(threadwq_set_edf(&twq[TWQNUM - 1], 0, THREADWQ_EDF_RUN, NULL));
+			break;
+		case HASH_POOL_PRIO:
+			BUG_ON(threadwq_set_prio(&twq[TWQNUM - 1], 2, 0, 0));
+			break;
+		case HASH_POOL_PLAIN:
+		default:
+			break;
+		}
+
+		ret = threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_hash);
+		printf("\t%s: init=%d\n", name_tbl[pool], ret);
+		BUG_ON(ret != (pool == HASH_POOL_PLAIN ? 0 : -1));
+
+		if (ret == 0)
+		{
+			threadwq_man_exit(&twq_man);
+		}
+
+		threadwq_exit_multi(twq, TWQNUM);
+	}
+}
+
+#define FUT_BATCH (64)
+#define FUT_SLOW_MS (50)
+
+static struct mempool mp_fut;
+
+struct fut_arg
+{
+	struct threadwq_man *man;
+	unsigned long round;
+	unsigned long bad; //!< Wrong results
+	unsigned long timeout; //!< Expected -ETIMEDOUT seen
+	uint64_t wait_ns;
+};
+
+static long cb_run_square(struct threadwq_future *fut, void *priv)
+{
+	long x = (long) (uintptr_t) priv;
+
+	uatomic_inc(&cnt_start);
+
+	return x * x;
+}
+
+static long cb_run_inc(struct threadwq_future *fut, void *priv)
+{
+	uatomic_inc(&cnt_start);
+
+	return threadwq_future_result(fut->src) + 1;
+}
+
+static long cb_run_slow(struct threadwq_future *fut, void *priv)
+{
+	uatomic_inc(&cnt_start);
+	usleep(FUT_SLOW_MS * 1000);
+
+	return -1;
+}
+
+static void cb_free_fut(struct threadwq_future *fut, void *priv)
+{
+	mempool_free(&mp_fut, fut);
+	uatomic_inc(&cnt_finish);
+}
+
+static struct threadwq_future *fut_new(long (*cb_run)(struct threadwq_future *fut, void *priv), void *priv)
+{
+	struct threadwq_future *fut;
+
+	while (!(fut = mempool_alloc(&mp_fut)))
+	{
+		caa_cpu_relax();
+		wait++;
+	}
+
+	threadwq_future_init(fut, cb_run, cb_free_fut, priv);
+
+	return fut;
+}
+
+static void *threadfunc_future(void *argin)
+{
+	struct fut_arg *arg = argin;
+	struct threadwq_future *fut_tbl[FUT_BATCH], *a, *b, *c;
+	struct timespec ts, ts_now;
+	unsigned int i;
+	uint64_t t0;
+
+	rcu_register_thread();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts_now);
+		if (ts_now.tv_sec - ts.tv_sec > TEST_TIME)
+		{
+			break;
+		}
+
+		/*
+		 * Fan out, then wait for each
+		 */
+		for (i = 0; i < FUT_BATCH; i++)
+		{
+			fut_tbl[i] = fut_new(cb_run_square, (void *) (uintptr_t) i);
+			BUG_ON(threadwq_future_submit(arg->man, fut_tbl[i]));
+		}
+
+		t0 = tm_mono_ns();
+		for (i = 0; i < FUT_BATCH; i++)
+		{
+			BUG_ON(threadwq_future_wait(fut_tbl[i], 0));
+			if (threadwq_future_result(fut_tbl[i]) != (long) i * i)
+			{
+				arg->bad++;
+			}
+			threadwq_future_put(fut_tbl[i]);
+		}
+		arg->wait_ns += tm_mono_ns() - t0;
+
+		/*
+		 * Chain: c = b + 1 = a + 2. b is chained before a runs, c maybe after b is done. Poll c.
+		 */
+		a = fut_new(cb_run_square, (void *) (uintptr_t) 3);
+		b = fut_new(cb_run_inc, NULL);
+		c = fut_new(cb_run_inc, NULL);
+		BUG_ON(threadwq_future_then(a, arg->man, b));
+		BUG_ON(threadwq_future_submit(arg->man, a));
+		BUG_ON(threadwq_future_then(b, arg->man, c));
+		while (!threadwq_future_done(c))
+		{
+			sched_yield();
+		}
+		if (threadwq_future_result(c) != 3 * 3 + 2)
+		{
+			arg->bad++;
+		}
+		threadwq_future_put(a);
+		threadwq_future_put(b);
+		threadwq_future_put(c);
+
+		arg->round++;
+	}
+
+	/*
+	 * Timed wait
+	 */
+	a = fut_new(cb_run_slow, NULL);
+	BUG_ON(threadwq_future_submit(arg->man, a));
+	if (threadwq_future_wait(a, 1) == -ETIMEDOUT)
+	{
+		arg->timeout++;
+	}
+	BUG_ON(threadwq_future_wait(a, FUT_SLOW_MS * 10));
+	threadwq_future_put(a);
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+static void test_threadwq_future(void)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct fut_arg arg;
+	pthread_t tid;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(mempool_init(&mp_fut, "future", sizeof(struct threadwq_future), FUT_BATCH * 64, NULL, NULL)); // Freed after a grace period.
+
+	BUG_ON(threadwq_init_multi(twq, TWQNUM));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.man = &twq_man;
+
+	if (pthread_create(&tid, NULL, &threadfunc_future, &arg))
+	{
+		BUG();
+	}
+
+	pthread_join(tid, NULL);
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	printf("%u thread, futures, fan out %u + chain of 3:\ncnt=%lu, rounds=%lu, bad=%lu, timed out=%lu, wait avg %luns/future\n",
+		TWQNUM, FUT_BATCH, cnt_start, arg.round, arg.bad, arg.timeout,
+		arg.round ? (unsigned long) (arg.wait_ns / arg.round / FUT_BATCH) : 0);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	mempool_exit(&mp_fut);
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define FIBER_NR (4096)
+#define FIBER_IO (4) // Waits per fiber
+#define FIBER_IO_MS (2) // Per wait. A blocking job holds its worker for it.
+
+static void cb_run_fiber(struct threadwq_fiber *f, void *priv)
+{
+	struct threadwq_timer *tmr = priv;
+	unsigned int i;
+
+	uatomic_inc(&cnt_start);
+
+	for (i = 0; i < FIBER_IO; i++)
+	{
+		BUG_ON(threadwq_fiber_sleep(f, tmr, FIBER_IO_MS)); // "I/O"
+		threadwq_fiber_yield(f);
+	}
+}
+
+static void cb_done_fiber(struct threadwq_fiber *f, void *priv)
+{
+	uatomic_inc(&cnt_finish);
+}
+
+#define FIBER_YIELD_NR (100000) // Per worker
+
+/*
+ * A yield costs two switches and a trip through the queue of the worker.
+ */
+static void cb_run_fiber_yield(struct threadwq_fiber *f, void *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < FIBER_YIELD_NR; i++)
+	{
+		threadwq_fiber_yield(f);
+	}
+}
+
+/*
+ * Many fibers waiting on timers, multiplexed on a few workers. Blocking jobs would take
+ * FIBER_NR * FIBER_IO * FIBER_IO_MS / TWQNUM.
+ */
+static void test_threadwq_fiber(void)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_timer tmr;
+	struct threadwq_fiber_pool pool;
+	struct threadwq_fiber *f_tbl;
+	unsigned long mapped;
+	uint64_t ts, ts_yield;
+	unsigned int i;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	f_tbl = calloc(FIBER_NR, sizeof(*f_tbl));
+	BUG_ON(f_tbl == NULL);
+
+	BUG_ON(threadwq_fiber_pool_init(&pool, 0, FIBER_NR));
+	BUG_ON(threadwq_timer_init(&tmr, 0));
+
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL)); // Resumes requeue inline.
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	rcu_register_thread();
+
+	ts = tm_mono_ns();
+	for (i = 0; i < FIBER_NR; i++)
+	{
+		threadwq_fiber_init(&f_tbl[i], &pool, cb_run_fiber, cb_done_fiber, &tmr);
+		BUG_ON(threadwq_fiber_submit(&twq_man, &f_tbl[i]));
+	}
+
+	while (uatomic_read(&cnt_finish) < FIBER_NR)
+	{
+		usleep(1000);
+	}
+	ts = tm_mono_ns() - ts;
+
+	/*
+	 * One yielding fiber per worker.
+	 */
+	ts_yield = tm_mono_ns();
+	for (i = 0; i < TWQNUM; i++)
+	{
+		threadwq_fiber_init(&f_tbl[i], &pool, cb_run_fiber_yield, cb_done_fiber, NULL);
+		threadwq_fiber_add(&twq[i], &f_tbl[i]);
+	}
+
+	while (uatomic_read(&cnt_finish) < FIBER_NR + TWQNUM)
+	{
+		usleep(1000);
+	}
+	ts_yield = tm_mono_ns() - ts_yield;
+
+	rcu_unregister_thread();
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	mapped = pool.nr;
+
+	threadwq_timer_exit(&tmr);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	threadwq_fiber_pool_exit(&pool);
+	free(f_tbl);
+
+	printf("%u thread, %u fibers, %u waits of %ums each:\n\ttook %lums (blocking: %lums), stacks mapped=%lu\n",
+		TWQNUM, FIBER_NR, FIBER_IO, FIBER_IO_MS, (unsigned long) (ts / 1000000),
+		(unsigned long) FIBER_NR * FIBER_IO * FIBER_IO_MS / TWQNUM, mapped);
+	printf("\tyield: %u x %u, %luns/op\n", TWQNUM, FIBER_YIELD_NR, (unsigned long) (ts_yield / FIBER_YIELD_NR));
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish - TWQNUM, wait);
+}
+
+#define AIO_FILE_NR (1024)
+#define AIO_FILE_SZ (4096)
+#define AIO_ROUND (8)
+
+typedef enum
+{
+	AIO_OPEN = 0,
+	AIO_READ,
+	AIO_CLOSE,
+	AIO_DONE
+} aio_state_t;
+
+struct aio_file
+{
+	struct threadwq_aio aio;
+	aio_state_t state;
+	unsigned int last; //!< No op submitted by this run.
+	int fd;
+	char path[64];
+	char buf[AIO_FILE_SZ];
+};
+
+static unsigned long aio_done;
+static unsigned long aio_bytes;
+static unsigned long aio_err;
+
+/*
+ * The blocking path: One job reads the whole file w/ read(), holding the worker.
+ */
+static void cb_start_file_block(struct threadwq_job *job, void *priv)
+{
+	struct aio_file *af = priv;
+	struct fio_easyrw erw;
+
+	uatomic_inc(&cnt_start);
+
+	fio_easyrw_init(&erw, af->path, AIO_FILE_SZ);
+	if (fio_easyrw_read_simple(&erw) == FIO_EASYRW_RES_OK)
+	{
+		uatomic_add(&aio_bytes, fio_easyrw_get_out_len(&erw));
+	}
+	else
+	{
+		uatomic_inc(&aio_err);
+	}
+	fio_easyrw_exit(&erw);
+
+	af->state = AIO_DONE;
+	af->last = 1;
+}
+
+/*
+ * open, read, close: One op per run. The worker goes on w/ other files while each op is in flight.
+ */
+static void cb_start_file_aio(struct threadwq_job *job, void *priv)
+{
+	struct aio_file *af = priv;
+	int res = threadwq_aio_res(&af->aio);
+
+	uatomic_inc(&cnt_start);
+
+	switch (af->state)
+	{
+	case AIO_OPEN:
+		af->state = AIO_READ;
+		BUG_ON(threadwq_aio_openat(&af->aio, AT_FDCWD, af->path, O_RDONLY, 0));
+		return;
+	case AIO_READ:
+		if (res < 0)
+		{
+			uatomic_inc(&aio_err);
+			af->state = AIO_DONE;
+			af->last = 1;
+			return;
+		}
+
+		af->fd = res;
+		af->state = AIO_CLOSE;
+		BUG_ON(threadwq_aio_read(&af->aio, af->fd, af->buf, AIO_FILE_SZ, 0));
+		return;
+	case AIO_CLOSE:
+		if (res < 0)
+		{
+			uatomic_inc(&aio_err);
+		}
+		else
+		{
+			uatomic_add(&aio_bytes, res);
+		}
+
+		af->state = AIO_DONE;
+		BUG_ON(threadwq_aio_close(&af->aio, af->fd));
+		return;
+	case AIO_DONE:
+	default:
+		af->last = 1; // Closed
+		return;
+	}
+}
+
+/*
+ * Called after every run. The file is done once the close (or a failure) ran.
+ */
+static void cb_finish_file(struct threadwq_job *job, void *priv)
+{
+	struct aio_file *af = priv;
+
+	uatomic_inc(&cnt_finish);
+
+	if (af->last)
+	{
+		uatomic_inc(&aio_done);
+	}
+}
+
+/*
+ * Read many small files in parallel. Blocking read() vs one io_uring per worker.
+ */
+static void test_threadwq_aio(const unsigned int aio)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct aio_file *af_tbl;
+	char dir[] = "/tmp/twq_aio_XXXXXX";
+	unsigned int i, round;
+	uint64_t ts;
+	int fd;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+	aio_bytes = 0;
+	aio_err = 0;
+
+	af_tbl = calloc(AIO_FILE_NR, sizeof(*af_tbl));
+	BUG_ON(af_tbl == NULL);
+
+	BUG_ON(mkdtemp(dir) == NULL);
+	for (i = 0; i < AIO_FILE_NR; i++)
+	{
+		snprintf(af_tbl[i].path, sizeof(af_tbl[i].path), "%s/%u", dir, i);
+		fd = open(af_tbl[i].path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+		BUG_ON(fd < 0);
+		memset(af_tbl[i].buf, 'a' + i % 26, AIO_FILE_SZ);
+		BUG_ON(write(fd, af_tbl[i].buf, AIO_FILE_SZ) != AIO_FILE_SZ);
+		close(fd);
+	}
+
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	if (aio)
+	{
+		BUG_ON(threadwq_set_aio_multi(twq, TWQNUM, AIO_FILE_NR)); // One op per file in flight. Never full.
+	}
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, TWQNUM, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	rcu_register_thread();
+
+	ts = tm_mono_ns();
+	for (round = 0; round < AIO_ROUND; round++)
+	{
+		aio_done = 0;
+
+		for (i = 0; i < AIO_FILE_NR; i++)
+		{
+			threadwq_aio_init(&af_tbl[i].aio, aio ? cb_start_file_aio : cb_start_file_block, cb_finish_file, &af_tbl[i]);
+			af_tbl[i].state = AIO_OPEN;
+			af_tbl[i].last = 0;
+			af_tbl[i].fd = -1;
+			BUG_ON(threadwq_man_add_job(&twq_man, &af_tbl[i].aio.job));
+		}
+
+		while (uatomic_read(&aio_done) < AIO_FILE_NR)
+		{
+			usleep(100);
+		}
+	}
+	ts = tm_mono_ns() - ts;
+
+	rcu_unregister_thread();
+
+	threadwq_flush_multi(twq, TWQNUM); // Every cb_finish is done. The counters below are final.
+
+	printf("%u thread, %u files of %uB x %u rounds, %s:\n\tfiles/sec=%lu, bytes=%lu, err=%lu\n",
+		TWQNUM, AIO_FILE_NR, AIO_FILE_SZ, AIO_ROUND, aio ? "io_uring" : "blocking read",
+		(unsigned long) ((uint64_t) AIO_FILE_NR * AIO_ROUND * 1000000000ULL / (ts ? ts : 1)), aio_bytes, aio_err);
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+
+	for (i = 0; i < AIO_FILE_NR; i++)
+	{
+		unlink(af_tbl[i].path);
+	}
+	rmdir(dir);
+	free(af_tbl);
+
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define AIO_SHORT_SQ (4) //!< SQ entries per worker. A submitter fills it up.
+#define AIO_SHORT_NR (8) //!< Ops a submitter tries. The ones past the SQ get -EAGAIN.
+#define AIO_SHORT_REFUSE (3) //!< Submits the kernel refuses per worker.
+#define AIO_SHORT_LEN (64)
+
+struct aio_short
+{
+	struct threadwq_job job; //!< The submitter
+	int fd;
+	unsigned int sent;
+	struct threadwq_aio aio_tbl[AIO_SHORT_NR];
+	char buf[AIO_SHORT_NR][AIO_SHORT_LEN];
+};
+
+static unsigned long aio_full;
+
+static void cb_start_aio_short(struct threadwq_job *job, void *priv)
+{
+	struct aio_short *as = priv;
+	unsigned int i;
+	int err;
+
+	uatomic_inc(&cnt_start);
+
+	for (i = 0; i < AIO_SHORT_NR; i++)
+	{
+		err = threadwq_aio_read(&as->aio_tbl[i], as->fd, as->buf[i], AIO_SHORT_LEN, 0);
+		if (err == -EAGAIN)
+		{
+			uatomic_inc(&aio_full);
+			break;
+		}
+		BUG_ON(err);
+	}
+
+	as->sent = i;
+}
+
+static void cb_finish_aio_short(struct threadwq_job *job, void *priv)
+{
+	uatomic_inc(&cnt_finish);
+}
+
+static void cb_start_aio_read(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_aio *aio = caa_container_of(job, struct threadwq_aio, job);
+
+	uatomic_inc(&cnt_start);
+
+	if (threadwq_aio_res(aio) != AIO_SHORT_LEN)
+	{
+		uatomic_inc(&aio_err);
+	}
+	uatomic_inc(&aio_done);
+}
+
+/*
+ * A short SQ, and a kernel which refuses the first submits (EAGAIN). Refused SQEs post no eventfd: Parked workers
+ * must still resend them, or threadwq_flush() and the exit drain hang.
+ */
+static void test_threadwq_aio_refuse(void)
+{
+	struct threadwq twq[TWQNUM];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct aio_short *as_tbl;
+	unsigned long sent = 0;
+	unsigned int round, i, j;
+	int fd;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+	aio_done = 0;
+	aio_err = 0;
+	aio_full = 0;
+
+	fd = open("/dev/zero", O_RDONLY);
+	BUG_ON(fd < 0);
+
+	as_tbl = calloc(TWQNUM * 2, sizeof(*as_tbl));
+	BUG_ON(as_tbl == NULL);
+
+	BUG_ON(threadwq_init_multi_ring(twq, TWQNUM, THREADWQ_RING_SLOT_DFL));
+	twq_ops.idle = THREADWQ_IDLE_BLOCK; // Park right away: Nothing else would resend.
+	threadwq_set_ops_multi(twq, &twq_ops, TWQNUM);
+	BUG_ON(threadwq_set_aio_multi(twq, TWQNUM, AIO_SHORT_SQ));
+	for (i = 0; i < TWQNUM; i++)
+	{
+		__threadwq_aio_refuse(&twq[i], AIO_SHORT_REFUSE);
+	}
+	BUG_ON(threadwq_exec_multi(twq, TWQNUM));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	rcu_register_thread();
+
+	/*
+	 * Round 0 ends w/ a flush, round 1 w/ the exit drain.
+	 */
+	for (round = 0; round < 2; round++)
+	{
+		for (i = 0; i < TWQNUM; i++)
+		{
+			struct aio_short *as = &as_tbl[round * TWQNUM + i];
+
+			as->fd = fd;
+			threadwq_job_init(&as->job, cb_start_aio_short, cb_finish_aio_short, as);
+			for (j = 0; j < AIO_SHORT_NR; j++)
+			{
+				threadwq_aio_init(&as->aio_tbl[j], cb_start_aio_read, cb_finish_aio_short, NULL);
+			}
+			threadwq_add_job(&twq[i], &as->job);
+		}
+
+		if (round == 0)
+		{
+			threadwq_flush_multi(twq, TWQNUM);
+			BUG_ON(uatomic_read(&aio_done) != uatomic_read(&cnt_start) - TWQNUM);
+		}
+	}
+
+	rcu_unregister_thread();
+
+	threadwq_exit_multi(twq, TWQNUM);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+
+	for (i = 0; i < TWQNUM * 2; i++)
+	{
+		sent += as_tbl[i].sent;
+	}
+	free(as_tbl);
+	close(fd);
+
+	printf("%u thread, aio w/ %u SQEs, %u refused submits each:\n\tsent=%lu, done=%lu, full=%lu, err=%lu\n",
+		TWQNUM, AIO_SHORT_SQ, AIO_SHORT_REFUSE, sent, aio_done, aio_full, aio_err);
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+#define ELASTIC_CAP (TWQNUM * 2)
+#define ELASTIC_PHASE_MS (500) // Burst, then idle, then burst...
+
+static unsigned long elastic_done;
+
+static void *threadfunc_elastic(void *twqmanin)
+{
+	struct threadwq_man *man = twqmanin;
+	struct threadwq_job *job;
+	uint64_t ts = tm_mono_ns(), elapsed;
+
+	rcu_register_thread();
+
+	for (;;)
+	{
+		elapsed = (tm_mono_ns() - ts) / 1000000;
+		if (elapsed > (TEST_TIME + 2) * 1000) break;
+
+		if ((elapsed / ELASTIC_PHASE_MS) % 2)
+		{
+			usleep(1000); // Idle phase
+			continue;
+		}
+
+		job = mempool_alloc(&mp);
+		if (!job)
+		{
+			caa_cpu_relax();
+			wait++; // It means queue full.
+			continue;
+		}
+
+		threadwq_job_init(job, cb_start, cb_finish, NULL);
+		BUG_ON(threadwq_man_add_job(man, job));
+	}
+
+	uatomic_set(&elastic_done, 1);
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Bursty load on an elastic pool. Start w/ 1 worker, the autoscaler follows the load.
+ */
+static void test_threadwq_elastic(void)
+{
+	struct threadwq twq[ELASTIC_CAP];
+	struct threadwq_ops twq_ops = THREQDWQ_OPS_INITIALIZER(cb_init_worker, NULL, cb_exit_worker, NULL);
+	struct threadwq_man twq_man;
+	struct threadwq_scale scale = THREADWQ_SCALE_INITIALIZER(1);
+	pthread_t tid;
+	unsigned int nr, nr_min = ELASTIC_CAP, nr_max = 0;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	BUG_ON(threadwq_init_multi(twq, ELASTIC_CAP));
+	set_idle_ops(&twq_ops);
+	threadwq_set_ops_multi(twq, &twq_ops, ELASTIC_CAP);
+	BUG_ON(threadwq_exec_multi(twq, ELASTIC_CAP));
+
+	BUG_ON(threadwq_man_init(&twq_man, twq, ELASTIC_CAP, &threadwq_man_ops_rr));
+
+	BUG_ON(create_all_cpu_call_rcu_data(0));
+
+	BUG_ON(threadwq_man_set_elastic(&twq_man, NULL));
+	BUG_ON(threadwq_man_resize(&twq_man, 1));
+	BUG_ON(threadwq_man_set_elastic(&twq_man, &scale));
+
+	elastic_done = 0;
+	cmm_smp_mb();
+
+	if (pthread_create(&tid, NULL, &threadfunc_elastic, &twq_man))
+	{
+		BUG();
+	}
+
+	while (!uatomic_read(&elastic_done))
+	{
+		usleep(10000);
+
+		nr = threadwq_man_nr(&twq_man);
+		if (nr < nr_min) nr_min = nr;
+		if (nr > nr_max) nr_max = nr;
+	}
+
+	pthread_join(tid, NULL);
+
+	BUG_ON(threadwq_man_set_elastic(&twq_man, NULL)); // Stop the autoscaler before the workers.
+
+	threadwq_flush_multi(twq, ELASTIC_CAP); // Every cb_finish is done. The counters below are final.
+
+	threadwq_exit_multi(twq, ELASTIC_CAP);
+
+	printf("%u thread max, elastic, burst/idle %ums:\ncnt=%lu, workers %u..%u, grow=%lu shrink=%lu, fail=%lu\n",
+		ELASTIC_CAP, ELASTIC_PHASE_MS, cnt_start, nr_min, nr_max,
+		twq_man.elastic->grow, twq_man.elastic->shrink, wait);
+
+	threadwq_man_exit(&twq_man);
+
+	cmm_smp_mb();
+
+	free_all_cpu_call_rcu_data();
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+static void test_threadwq(void)
+{
+	struct timespec ts, ts_now;
+
+	cnt_start = 0;
+	cnt_finish = 0;
+	wait = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (;;)
+	{
+		cb_start(NULL, NULL);
+
+		/*
+		 * xxx
+		 */
+		clock_gettime(CLOCK_REALTIME, &ts_now);
+		if ((ts_now.tv_sec - ts.tv_sec) > TEST_TIME) break;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts_now);
+	printf("no thread:\ncnt=%lu, wait/waste=%lu time=%lu\n", cnt_start, wait, (ts_now.tv_sec - ts.tv_sec));
+
+	printf("\t--> cnt=%lu free=%lu, wait=%lu\n", cnt_start, cnt_finish, wait);
+}
+
+static void print_help(const char *path)
+{
+	printf("%s [--help|-h] [--idle|-i block|poll|adaptive]\n", path);
+	printf("\n");
+}
+
+static unsigned int opt_background = 0;
+
+static int argparse(int argc, char **argv)
+{
+	int c;
+	int digit_optind = 0;
+
+	while (1)
+	{
+		int this_option_optind = optind ? optind : 1;
+		int option_index = 0;
+		static struct option long_options[] =
+		{
+			{ "verbose", no_argument, 0, 'v' },
+			{ "quiet", no_argument, 0, 'q' },
+			{ "background", no_argument, 0, 'b' },
+			{ "idle", required_argument, 0, 'i' },
+			{ "help", no_argument, 0, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "bhvqc:e:i:",
+			long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c)
+		{
+		case 'b': // background
+			opt_background = 1;
+			break;
+
+		case 'i': // idle policy
+			if (strcmp(optarg, "block") == 0)
+			{
+				opt_idle = THREADWQ_IDLE_BLOCK;
+			}
+			else if (strcmp(optarg, "poll") == 0)
+			{
+				opt_idle = THREADWQ_IDLE_POLL;
+			}
+			else if (strcmp(optarg, "adaptive") == 0)
+			{
+				opt_idle = THREADWQ_IDLE_ADAPTIVE;
+			}
+			else
+			{
+				print_help(argv[0]);
+				return -1;
+			}
+			break;
+
+		case 'q':
+			stdmsg_lv_dec();
+			break;
+		case 'v':
+			stdmsg_lv_inc();
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return -1;
+		default:
+			print_help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind < argc)
+	{
+		fprintf(stderr, "non-option ARGV-elements: ");
+		while (optind < argc)
+			fprintf(stderr, "%s ", argv[optind++]);
+		fprintf(stderr, "\n");
+		print_help(argv[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int process_lock_fd = -1;
+
+static int trylock_process(void)
+{
+	const char *process_lock_path = CONFIG_TEMPLATE_LOCK_PATH;
+
+	process_lock_fd = fio_trylock(process_lock_path);
+	if (process_lock_fd < 0)
+	{
+		ERR("Another instance is locking '%s'", process_lock_path);
+		return -1;
+	}
+
+	return 0; // ok
+}
+
+static void unlock_process(void)
+{
+	if (process_lock_fd >= 0)
+	{
+		fio_unlock(process_lock_fd);
+		process_lock_fd = -1;
+	}
+}
+
+static int keep_single(void)
+{
+	if (trylock_process())
+	{
+		return -1;
+	}
+
+	atexit(unlock_process);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argparse(argc, argv))
+	{
+		return -1;
+	}
+
+	/*
+	 * Avoid multiple instance. Or my wife will be angry.
+	 */
+	if (keep_single())
+	{
+		return -1;
+	}
+
+	/*
+	 * Run bg
+	 */
+	if (opt_background)
+	{
+		DBG("Run as background service");
+
+		if (setsid() < 0)
+		{
+			ERR("Cannot setsid '%s'", strerror(errno));
+			return -1;
+		}
+
+		if (daemon(0, 0))
+		{
+			ERR("Cannot put into background '%s'", strerror(errno));
+			return -1;
+		}
+
+		stdmsg_lv_set(STDMSG_LV_NONE); // TODO: Use other logger instead.
+	}
+
+	/*
+	 * Prepare subsys. Init tasks are done here.
+	 */
+	if (initops_exec_init())
+	{
+		return -1;
+	}
+
+	DBG("Running program: %s", argv[0]);
+
+	mempool_init(&mp, "name", sizeof(struct threadwq_job), 65536 * 4, NULL, NULL);
+	test_threadwq();
+	test_threadwq2();
+	test_threadwq3();
+	test_threadwq_batch(1, 0, THREADWQ_FINISH_RCU);
+	test_threadwq_batch(8, 0, THREADWQ_FINISH_RCU);
+	test_threadwq_batch(64, 0, THREADWQ_FINISH_RCU);
+	test_threadwq_batch(512, 0, THREADWQ_FINISH_RCU);
+	test_threadwq_batch(1, THREADWQ_RING_SLOT_DFL, THREADWQ_FINISH_RCU);
+	test_threadwq_batch(64, THREADWQ_RING_SLOT_DFL, THREADWQ_FINISH_RCU);
+	test_threadwq_batch(1, THREADWQ_RING_SLOT_DFL, THREADWQ_FINISH_INLINE);
+	test_threadwq_batch(64, THREADWQ_RING_SLOT_DFL, THREADWQ_FINISH_INLINE);
+	test_threadwq_batch(64, THREADWQ_RING_SLOT_DFL, THREADWQ_FINISH_BATCH);
+	test_threadwq_steal(0);
+	test_threadwq_steal(1);
+	test_threadwq_prio(1, 0);
+	test_threadwq_prio(2, 0);
+	test_threadwq_prio(2, THREADWQ_PRIO_WEIGHT_DFL);
+	test_threadwq_timer();
+	test_threadwq_dag(0, 0, 0);
+	test_threadwq_dag(1, 0, 0);
+	test_threadwq_dag(0, DAG_RING_SLOT, 0);
+	test_threadwq_dag(1, DAG_RING_SLOT, 0);
+	test_threadwq_dag(0, 0, 1);
+	test_threadwq_dag(0, DAG_RING_SLOT, 1);
+	test_threadwq_parallel(0);
+	test_threadwq_parallel(65536);
+	test_threadwq_hist();
+	test_threadwq_backpressure(0);
+	test_threadwq_backpressure(1);
+	test_threadwq_elastic();
+	test_threadwq_flush(THREADWQ_FINISH_RCU);
+	test_threadwq_flush(THREADWQ_FINISH_BATCH);
+	test_threadwq_flush_stress();
+	test_threadwq_hash(0);
+	test_threadwq_hash(1);
+	test_threadwq_hash_reject();
+	test_threadwq_dispatch(&threadwq_man_ops_rr, "rr");
+	test_threadwq_dispatch(&threadwq_man_ops_rr4idle, "rr4idle");
+	test_threadwq_dispatch(&threadwq_man_ops_least, "least");
+	test_threadwq_dispatch(&threadwq_man_ops_p2c, "p2c");
+	test_threadwq_producers(&threadwq_man_ops_rr, "rr");
+	test_threadwq_producers(&threadwq_man_ops_rr_local, "rr_local");
+	test_threadwq_producers(&threadwq_man_ops_p2c, "p2c");
+	test_false_sharing();
+	test_threadwq_future();
+	{
+		topo_cost_t cost;
+
+		for (cost = TOPO_SHORT; cost < TOPO_MAX; cost++)
+		{
+			test_threadwq_topo(&threadwq_man_ops_rr, "rr", cost);
+			test_threadwq_topo(&threadwq_man_ops_rr4idle, "rr4idle", cost);
+			test_threadwq_topo(&threadwq_man_ops_shared, "shared", cost);
+		}
+	}
+	test_threadwq_edf(0, THREADWQ_EDF_RUN);
+	test_threadwq_edf(1, THREADWQ_EDF_RUN);
+	test_threadwq_edf(1, THREADWQ_EDF_DROP);
+	test_threadwq_fiber();
+	test_threadwq_aio(0);
+	test_threadwq_aio(1);
+	test_threadwq_aio_refuse();
 	mempool_exit(&mp);
 
 
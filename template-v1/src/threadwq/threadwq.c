@@ -10,15 +10,60 @@
 
 
 #include <sched.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+
+#include <urcu/futex.h>
 
 #include "lgu/lgu.h"
 #include "threadwq.h"
+#include "threadwq_aio.h"
+
+/*
+ * Deadline heap of one worker. Owner only.
+ *
+ * 4-ary: The 4 children of a node are 64 bytes, and the array is shifted so they sit in one cache line.
+ * Jobs w/o a deadline get EDF_KEY_NONE | seq: After every deadline, and FIFO among themselves.
+ */
+#define EDF_KEY_NONE (1ULL << 63)
+#define EDF_ARY (4)
+#define EDF_SHIFT (EDF_ARY - 1)
+
+struct edf_ent
+{
+	uint64_t key;
+	struct threadwq_job *job;
+};
+
+struct threadwq_edf
+{
+	unsigned int nr;
+	unsigned int cap;
+	uint64_t seq;
+
+	threadwq_edf_miss_t miss;
+	void (*cb_expired)(struct threadwq_job *job, void *priv);
+
+	struct threadwq_edf_stat stat;
+
+	struct edf_ent *heap; //!< base + EDF_SHIFT
+	struct edf_ent *base;
+};
 
 void threadwq_set_ops(struct threadwq *twq, const struct threadwq_ops *ops)
 {
 	BUG_ON(ops->worker_exit == NULL || ops->worker_init == NULL);
+	BUG_ON(ops->idle >= THREADWQ_IDLE_MAX);
+	BUG_ON(ops->finish >= THREADWQ_FINISH_MAX);
 	BUG_ON(sizeof(twq->ops) != sizeof(*ops));
 	memcpy(&twq->ops, ops, sizeof(*ops));
+
+	if (twq->queue == THREADWQ_QUEUE_LFQ && ops->finish > THREADWQ_FINISH_RCU)
+	{
+		ERR("twq %p: lfq backend needs rcu to finish jobs. Ignore finish mode %d", twq, ops->finish);
+		twq->ops.finish = THREADWQ_FINISH_RCU;
+	}
 }
 
 void threadwq_set_ops_multi(struct threadwq *twq_tbl, const struct threadwq_ops *ops, const unsigned int nr)
@@ -33,17 +78,89 @@ void threadwq_set_ops_multi(struct threadwq *twq_tbl, const struct threadwq_ops
 	}
 }
 
+/*!
+ * \brief Alloc a table of nr twqs, page aligned. Then init it as usual, e.g. threadwq_init_multi().
+ *
+ * \details Every twq starts on its own cache line (as on the stack). The pages can be placed on a NUMA node:
+ *     Use one table per node for a pool spread over nodes.
+ *
+ * \param node NUMA node of the workers. -1: First touch, i.e. the node of the caller.
+ */
+struct threadwq *threadwq_alloc_multi(const unsigned int nr, const int node)
+{
+	const size_t pgsz = sysconf(_SC_PAGESIZE);
+	const size_t len = (nr * sizeof(struct threadwq) + pgsz - 1) / pgsz * pgsz;
+	struct threadwq *twq_tbl;
+
+	if (nr == 0)
+	{
+		ERR("Invalid twq number %u", nr);
+		return NULL;
+	}
+
+	if (posix_memalign((void **) &twq_tbl, pgsz, len))
+	{
+		ERR("Cannot alloc %u twqs", nr);
+		return NULL;
+	}
+
+	if (node >= 0 && cputopo_mbind(twq_tbl, len, node))
+	{
+		VBS("Cannot place %u twqs on node %d %s", nr, node, strerror(errno));
+	}
+
+	memset(twq_tbl, 0x00, len); // First touch after mbind.
+
+	return twq_tbl;
+}
+
+/*!
+ * \brief Free a table from threadwq_alloc_multi(), after threadwq_exit_multi().
+ */
+void threadwq_free_multi(struct threadwq *twq_tbl)
+{
+	free(twq_tbl);
+}
+
 int threadwq_init(struct threadwq *twq)
 {
 	twq->exit = 0;
 	twq->exit_ack = 0;
 	twq->running = 0;
 
-	pthread_cond_init(&twq->cond, NULL);
-	pthread_mutex_init(&twq->mutex, NULL);
+	twq->sleeping = 0;
+	twq->efd = eventfd(0, EFD_CLOEXEC);
+	if (twq->efd < 0)
+	{
+		ERR("Cannot create eventfd %s", strerror(errno));
+		return -1;
+	}
+
+	twq->queue = THREADWQ_QUEUE_LFQ;
+	memset(twq->ring, 0x00, sizeof(twq->ring));
+
+	twq->nr_prio = 1;
+	twq->prio_weight = 0;
+	twq->stat = 0;
+	memset(twq->prio, 0x00, sizeof(twq->prio));
+	twq->hist = NULL;
+	twq->edf = NULL;
+	twq->aio = NULL;
+	twq->spill_head = NULL;
+	twq->spill_tail = NULL;
+
+	twq->depth_max = 0;
+	twq->space_waiter = 0;
+	twq->space_seq = 0;
+
+	memset(twq->inflight, 0x00, sizeof(twq->inflight));
+	twq->flush_epoch = 0;
+	twq->flush_waiter = 0;
+	twq->flush_seq = 0;
+	pthread_mutex_init(&twq->flush_lock, NULL);
 
 	{
-		cds_lfq_init_rcu(&twq->lfq, call_rcu);
+		cds_lfq_init_rcu(&twq->lfq[0], call_rcu);
 #if THREADWQ_LFQ_CREATE_RCU_DATA
 		if (create_all_cpu_call_rcu_data(0))
 		{
@@ -55,19 +172,62 @@ int threadwq_init(struct threadwq *twq)
 
 	memset(&twq->ops, 0x00, sizeof(twq->ops));
 
+	twq->busy = 0;
+	twq->depth = 0;
+	twq->drain_batch = THREADWQ_DRAIN_BATCH_DFL;
+
+	twq->sibling_tbl = NULL;
+	twq->sibling_nr = 0;
+	twq->steal_batch = 0;
+	twq->stolen = 0;
+
+	twq->src = twq;
+	twq->shared = 0;
+
+	CPU_ZERO(&twq->cpuset);
+	twq->has_cpuset = 0;
+	twq->node = -1;
+
 	return 0;
 }
 
-int threadwq_init_multi(struct threadwq *twq_tbl, const unsigned int nr)
+/*!
+ * \brief Init twq w/ the bounded ring backend. nr_slot is rounded up to power of 2.
+ *
+ * \details Producers spin (and kick the worker) when the ring is full.
+ */
+int threadwq_init_ring(struct threadwq *twq, const unsigned int nr_slot)
+{
+	if (threadwq_init(twq))
+	{
+		return -1;
+	}
+
+	if (threadwq_ring_init(&twq->ring[0], nr_slot))
+	{
+		threadwq_exit(twq);
+		return -1;
+	}
+
+	twq->queue = THREADWQ_QUEUE_RING;
+	return 0;
+}
+
+/*
+ * nr_slot = 0: lfq backend.
+ */
+static int init_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int nr_slot)
 {
 	unsigned int i;
 	struct threadwq *twq;
+	int ret;
 
 	for (i = 0; i < nr; i++)
 	{
 		twq = &twq_tbl[i];
 
-		if (threadwq_init(twq))
+		ret = nr_slot ? threadwq_init_ring(twq, nr_slot) : threadwq_init(twq);
+		if (ret)
 		{
 			threadwq_exit_multi(twq_tbl, i);
 			return (nr - i) * (-1);
@@ -77,210 +237,1722 @@ int threadwq_init_multi(struct threadwq *twq_tbl, const unsigned int nr)
 	return 0; // ok
 }
 
+int threadwq_init_multi(struct threadwq *twq_tbl, const unsigned int nr)
+{
+	return init_multi(twq_tbl, nr, 0);
+}
+
+int threadwq_init_multi_ring(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int nr_slot)
+{
+	BUG_ON(nr_slot == 0);
+	return init_multi(twq_tbl, nr, nr_slot);
+}
+
+void __threadwq_wakeup(struct threadwq *twq)
+{
+	uint64_t cnt = 1;
+
+	if (write(twq->efd, &cnt, sizeof(cnt)) < 0)
+	{
+		ERR("Cannot wake up twq %p %s", twq, strerror(errno));
+	}
+}
+
 static void kill_online_worker(struct threadwq *twq)
 {
 	VBS("Push worker to offline");
 
+	uatomic_set(&twq->exit, 1);
+	cmm_smp_mb();
+
 	/*
-	 * Wait all workers to exit.
+	 * Kick the worker even if it is not parked. It checks exit before sleeping.
 	 */
-	while (1) // Pooling until all workers finish the job.
+	__threadwq_wakeup(twq);
+
+	pthread_join(twq->tid, NULL);
+	twq->running = 0;
+}
+
+/*!
+ * \brief Stop the worker after it runs the queued jobs. The twq keeps its queues; threadwq_exec() restarts it.
+ *
+ * \details Plz make sure nobody adds jobs into it anymore. Never call it from the worker itself.
+ */
+void threadwq_stop(struct threadwq *twq)
+{
+	if (!twq->running)
 	{
-		pthread_mutex_lock(&twq->mutex);
-		twq->exit++;
-		pthread_cond_broadcast(&twq->cond);
-		pthread_mutex_unlock(&twq->mutex);
+		return;
+	}
 
-		cmm_smp_mb();
-		if (twq->exit_ack)
+	BUG_ON(threadwq_self() == twq);
+
+	kill_online_worker(twq);
+
+	uatomic_set(&twq->exit, 0);
+	twq->exit_ack = 0;
+	uatomic_set(&twq->busy, 0);
+	cmm_smp_mb();
+}
+
+void threadwq_exit(struct threadwq *twq)
+{
+	/*
+	 * Warn the user if queue is not empty. Possibly forget to flush queue first.
+	 */
+
+	if (twq->running)
+	{
+		kill_online_worker(twq);
+	}
+
+	close(twq->efd);
+	twq->efd = -1;
+
+	if (twq->queue == THREADWQ_QUEUE_RING)
+	{
+		unsigned int c;
+
+		for (c = 0; c < twq->nr_prio; c++)
 		{
-			break;
+			threadwq_ring_exit(&twq->ring[c]);
 		}
 	}
 
-	pthread_join(twq->tid, NULL);
+	free(twq->hist);
+	twq->hist = NULL;
+
+	if (twq->edf)
+	{
+		free(twq->edf->base);
+		free(twq->edf);
+		twq->edf = NULL;
+	}
+
+	__threadwq_aio_free(twq);
+
+	pthread_mutex_destroy(&twq->flush_lock);
 }
 
-void threadwq_exit(struct threadwq *twq)
+/*!
+ * \brief Use nr_prio priority classes. Call this before threadwq_exec().
+ *
+ * \details The worker serves classes in strict order. A lower class passed over weight times in a row
+ *     (while it has jobs) gets one turn. Jobs w/ a class >= nr_prio go to the lowest class.
+ *
+ * \param weight Anti-starvation weight. 0: Strict priority.
+ * \param stat 1: Timestamp jobs at enqueue and count queue wait per class. Costs a clock read per job.
+ */
+int threadwq_set_prio(struct threadwq *twq, const unsigned int nr_prio, const unsigned int weight, const unsigned int stat)
 {
+	unsigned int c;
+
+	if (nr_prio == 0 || nr_prio > THREADWQ_PRIO_NR || nr_prio < twq->nr_prio)
+	{
+		ERR("Invalid priority class number %u", nr_prio);
+		return -1;
+	}
+
+	BUG_ON(twq->running);
+
 	/*
-	 * Warn the user if queue is not empty. Possibly forget to flush queue first.
+	 * Class 0 is ready since init. Create the rest w/ the same backend.
 	 */
+	for (c = twq->nr_prio; c < nr_prio; c++)
+	{
+		if (twq->queue == THREADWQ_QUEUE_RING)
+		{
+			if (threadwq_ring_init(&twq->ring[c], twq->ring[0].mask + 1))
+			{
+				return -1; // Classes done so far stay usable.
+			}
+		}
+		else
+		{
+			cds_lfq_init_rcu(&twq->lfq[c], call_rcu);
+		}
 
-	kill_online_worker(twq);
+		twq->nr_prio = c + 1;
+	}
+
+	twq->prio_weight = weight;
+	twq->stat = stat ? (twq->stat | THREADWQ_STAT_PRIO) : (twq->stat & ~THREADWQ_STAT_PRIO);
+
+	return 0; // ok
 }
 
-void threadwq_exit_multi(struct threadwq *twq_tbl, const unsigned int nr)
+int threadwq_set_prio_multi(struct threadwq *twq_tbl, const unsigned int nr,
+	const unsigned int nr_prio, const unsigned int weight, const unsigned int stat)
 {
 	unsigned int i;
-	struct threadwq *twq;
 
 	for (i = 0; i < nr; i++)
 	{
-		twq = &twq_tbl[i];
-		threadwq_exit(twq);
+		if (threadwq_set_prio(&twq_tbl[i], nr_prio, weight, stat))
+		{
+			return -1;
+		}
 	}
+
+	return 0; // ok
 }
 
-static inline struct threadwq_job *dequeue_one_job(struct threadwq *twq)
+void threadwq_get_prio_stat(struct threadwq *twq, const unsigned int prio, struct threadwq_prio_stat *st)
 {
-	struct threadwq_job *job;
-	struct cds_lfq_node_rcu *lfq_node;
+	const struct threadwq_prio *p;
 
-	rcu_read_lock();
-	lfq_node = cds_lfq_dequeue_rcu(&twq->lfq);
-	rcu_read_unlock();
+	BUG_ON(prio >= THREADWQ_PRIO_NR);
+	p = &twq->prio[prio];
 
-	if (!lfq_node)
+	st->depth = (twq->nr_prio > 1) ? CMM_LOAD_SHARED(p->depth) : CMM_LOAD_SHARED(twq->depth);
+	st->done = CMM_LOAD_SHARED(p->done);
+	st->wait_ns_avg = st->done ? CMM_LOAD_SHARED(p->wait_ns) / st->done : 0;
+	st->wait_ns_max = CMM_LOAD_SHARED(p->wait_ns_max);
+}
+
+/*!
+ * \brief Limit queued jobs of twq. threadwq_add_job() ignores it; use the try/wait variants, or a threadwq_man.
+ *
+ * \param max 0: Unbounded.
+ */
+int threadwq_set_depth_max(struct threadwq *twq, const unsigned long max)
+{
+	if (twq->queue == THREADWQ_QUEUE_RING && max > (unsigned long) twq->ring[0].mask + 1)
 	{
-		return NULL;
+		VBS("twq %p: depth limit %lu is over the ring size %lu", twq, max, (unsigned long) twq->ring[0].mask + 1);
 	}
 
-	job = caa_container_of(lfq_node, struct threadwq_job, lfq_node);
-	return job;
-}
+	CMM_STORE_SHARED(twq->depth_max, max);
+	cmm_smp_mb();
 
-static void __exec_finish_rcu(struct rcu_head *head)
-{
-	struct threadwq_job *job =
-		caa_container_of(head, struct threadwq_job, rcu_head);
-	void (*cb_finish)(struct threadwq_job *job, void *priv);
+	/*
+	 * Raised or removed the limit: Let waiters retry.
+	 */
+	uatomic_inc(&twq->space_seq);
+	futex_noasync(&twq->space_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 
-	cb_finish = job->cb_finish;
-	cb_finish(job, job->priv);
+	return 0; // ok
 }
 
+int threadwq_set_depth_max_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned long max)
+{
+	unsigned int i;
 
-#if THREADWQ_BLOCKED_ENQUEUE
-#define wait4job(_twq) \
-	{ \
-		pthread_mutex_lock(&twq->mutex); \
-		pthread_cond_wait(&twq->cond, &twq->mutex); \
-		pthread_mutex_unlock(&twq->mutex); \
-	}
-#elif THREADWQ_NONBLOCKED_ENQUEUE
-#if THREADWQ_NONBLOCKED_ENQUEUE_TIMEDWAIT
-#define wait4job(_twq) \
-	{ \
-		struct timespec ts; \
-		clock_gettime(CLOCK_REALTIME, &ts); \
-		ts.tv_sec = 0; \
-		ts.tv_nsec = THREADWQ_NONBLOCKED_ENQUEUE_TIMEDWAIT; \
-		pthread_mutex_lock(&twq->mutex); \
-		pthread_cond_wait(&twq->cond, &twq->mutex); \
-		pthread_mutex_unlock(&twq->mutex); \
+	for (i = 0; i < nr; i++)
+	{
+		if (threadwq_set_depth_max(&twq_tbl[i], max))
+		{
+			return -1;
+		}
 	}
-#else
-/*
- * TBD: Choose one. sched is more friendly. relax is w/ better throughput.
- */
-#define wait4job(_twq) caa_cpu_relax()
-#endif
-#else
-#error "fixme"
-#endif // THREADWQ_BLOCKED_ENQUEUE
 
-static inline unsigned int exec_pending_jobs(struct threadwq *twq)
+	return 0; // ok
+}
+
+/*!
+ * \brief Add a job. Block (futex, no spinning) while twq is full.
+ *
+ * \param timeout_ms 0: Wait forever.
+ * \return 0: Added. -ETIMEDOUT: Still full after timeout_ms.
+ */
+int threadwq_add_job_wait(struct threadwq *twq, struct threadwq_job *job, const unsigned int timeout_ms)
 {
-	struct threadwq_job *job;
-	unsigned int accl = 0;
+	struct threadwq *q = twq->src; // Space is freed where the jobs are dequeued.
+	struct timespec ts;
+	uint64_t deadline = 0, now;
+	int32_t seq;
+	int ret = 0;
 
-	job = dequeue_one_job(twq);
-	if (caa_unlikely(!job))
+	if (!threadwq_try_add_job(twq, job))
 	{
-		return 0;
+		return 0; // Fast path
 	}
 
-	do
+	if (timeout_ms)
 	{
-		accl++;
-		job->cb_start(job, job->priv);
-		call_rcu(&job->rcu_head, __exec_finish_rcu);
+		deadline = tm_mono_ns() + (uint64_t) timeout_ms * 1000000ULL;
+	}
 
-		job = dequeue_one_job(twq); // next job
-	} while (job);
+	uatomic_inc(&q->space_waiter);
 
-	return accl;
+	for (;;)
+	{
+		cmm_smp_mb();
+		seq = CMM_LOAD_SHARED(q->space_seq); // Before the try: A dequeue after it changes seq.
+
+		if (!threadwq_try_add_job(twq, job))
+		{
+			break;
+		}
+
+		if (timeout_ms)
+		{
+			now = tm_mono_ns();
+			if (now >= deadline)
+			{
+				ret = -ETIMEDOUT;
+				break;
+			}
+
+			ts.tv_sec = (deadline - now) / 1000000000ULL;
+			ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		}
+
+		futex_noasync(&q->space_seq, FUTEX_WAIT, seq, timeout_ms ? &ts : NULL, NULL, 0);
+	}
+
+	uatomic_dec(&q->space_waiter);
+
+	return ret;
 }
 
-static void *thread_func(void *in)
+/*
+ * Wait until every job counted in epoch e is finished. No spinning: The last cb_finish wakes us.
+ */
+static void wait_epoch(struct threadwq *twq, const unsigned int e)
 {
-	struct threadwq *twq = in;
+	int32_t seq;
 
-	rcu_register_thread();
+	uatomic_inc(&twq->flush_waiter);
 
-	VBS("twq %p online", twq);
-	if (twq->ops.worker_init)
+	for (;;)
 	{
-		/* Basic hint: sched_setaffinity & rcu_register_thread. */
-		if (twq->ops.worker_init(twq, twq->ops.worker_init_priv))
+		cmm_smp_mb(); // Pairs w/ put_inflight(): Either it sees the waiter, or we see the counter drained.
+		seq = CMM_LOAD_SHARED(twq->flush_seq);
+
+		if (uatomic_read(&twq->inflight[e]) == 0)
 		{
-			ERR("Failed to exec user initializer");
-			BUG(); // FIXME: Hard to recover...
+			break;
 		}
+
+		futex_noasync(&twq->flush_seq, FUTEX_WAIT, seq, NULL, NULL, 0);
 	}
 
-	twq->running = 1;
-	cmm_smp_mb();
+	uatomic_dec(&twq->flush_waiter);
+}
+
+/*!
+ * \brief Block until every job added into the twqs before the call has finished (cb_finish returned).
+ *
+ * \details Jobs added meanwhile go to the next epoch and are not waited for. The workers keep running.
+ *     Plz never call it from a worker of these twqs, or from cb_finish.
+ */
+void threadwq_flush_multi(struct threadwq *twq_tbl, const unsigned int nr)
+{
+	struct threadwq *self = threadwq_self();
+	unsigned int i;
 
+	/*
+	 * Flip all first, then wait: The twqs drain in parallel.
+	 */
+	for (i = 0; i < nr; i++)
 	{
-		unsigned int cnt = 0, busy = 0;
-		struct threadwq_job *job;
+		BUG_ON(self == &twq_tbl[i]);
 
-		while (caa_unlikely(twq->exit == 0))
-		{
-			cnt++;
-			if (caa_unlikely(cnt >= THREADWQ_STAT_PERIOD))
-			{
-				uatomic_set(&twq->busy, busy);
-				cnt = 0;
-				busy >>= 1;
-			}
+		pthread_mutex_lock(&twq_tbl[i].flush_lock);
+		uatomic_set(&twq_tbl[i].flush_epoch, !twq_tbl[i].flush_epoch);
+	}
 
-			job = dequeue_one_job(twq);
-			if (caa_unlikely(!job))
-			{
-				wait4job(twq);
-				continue;
-			}
+	cmm_smp_mb(); // Pairs w/ __threadwq_get_inflight(): New counts go to the new epoch before we read the old one.
 
-			do
-			{
-				busy++;
-				job->cb_start(job, job->priv);
-				call_rcu(&job->rcu_head, __exec_finish_rcu);
+	for (i = 0; i < nr; i++)
+	{
+		wait_epoch(&twq_tbl[i], !twq_tbl[i].flush_epoch); // The old one. Stable under flush_lock.
+		pthread_mutex_unlock(&twq_tbl[i].flush_lock);
+	}
+}
 
-				job = dequeue_one_job(twq); // next job
-			} while (job);
+void threadwq_flush(struct threadwq *twq)
+{
+	threadwq_flush_multi(twq, 1);
+}
 
-			wait4job(twq);
-		}
+/*!
+ * \brief Record queue wait and run time of every job into per-worker histograms. Call this before threadwq_exec().
+ *
+ * \details Costs two clock reads per job. Use it on every twq of a pool, since thieves record into their own.
+ */
+int threadwq_set_hist(struct threadwq *twq)
+{
+	BUG_ON(twq->running);
 
-		/*
-		 * Got a signal to exit. Flush queue.
-		 */
-		exec_pending_jobs(twq);
+	if (twq->hist)
+	{
+		return 0; // ok, on already
 	}
 
-	VBS("twq %p offline", twq);
-	if (twq->ops.worker_exit)
+	if (posix_memalign((void **) &twq->hist, CAA_CACHE_LINE_SIZE, sizeof(*twq->hist)))
 	{
-		twq->ops.worker_exit(twq, twq->ops.worker_exit_priv);
+		ERR("Cannot alloc histograms for twq %p", twq);
+		twq->hist = NULL;
+		return -1;
 	}
 
-	twq->exit_ack = 1;
-	cmm_smp_mb();
-
-	rcu_unregister_thread();
+	threadwq_hist_reset(&twq->hist->wait);
+	threadwq_hist_reset(&twq->hist->run);
+	twq->stat |= THREADWQ_STAT_HIST;
 
-	return NULL;
+	return 0; // ok
 }
 
-int threadwq_exec(struct threadwq *twq)
+int threadwq_set_hist_multi(struct threadwq *twq_tbl, const unsigned int nr)
 {
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+	{
+		if (threadwq_set_hist(&twq_tbl[i]))
+		{
+			return -1;
+		}
+	}
+
+	return 0; // ok
+}
+
+/*!
+ * \brief p50/p99/p999/max of the jobs run by the workers of twq_tbl, merged. Safe while running.
+ */
+void threadwq_get_latency_multi(struct threadwq *twq_tbl, const unsigned int nr, struct threadwq_latency *lat)
+{
+	struct threadwq_lat_hist *sum;
+	unsigned int i;
+
+	memset(lat, 0x00, sizeof(*lat));
+
+	sum = calloc(1, sizeof(*sum)); // 30KB. Keep it off the stack.
+	if (!sum)
+	{
+		ERR("Cannot alloc histograms");
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		if (twq_tbl[i].hist)
+		{
+			threadwq_hist_merge(&sum->wait, &twq_tbl[i].hist->wait);
+			threadwq_hist_merge(&sum->run, &twq_tbl[i].hist->run);
+		}
+	}
+
+	threadwq_hist_get_pct(&sum->wait, &lat->wait);
+	threadwq_hist_get_pct(&sum->run, &lat->run);
+
+	free(sum);
+}
+
+void threadwq_get_latency(struct threadwq *twq, struct threadwq_latency *lat)
+{
+	threadwq_get_latency_multi(twq, 1, lat);
+}
+
+/*!
+ * \brief Run jobs by earliest deadline first. Call this before threadwq_exec().
+ *
+ * \details The worker moves up to cap queued jobs into a private heap and always starts the earliest
+ *     deadline. Jobs w/o a deadline run after those w/ one, in FIFO order. Costs a clock read per job
+ *     w/ a deadline. Thieves still take jobs from the queue in FIFO order.
+ *
+ * \param cap Heap size. 0: THREADWQ_EDF_CAP_DFL.
+ * \param miss What to do w/ a job whose deadline passed before it starts.
+ * \param cb_expired THREADWQ_EDF_CALL only.
+ */
+int threadwq_set_edf(struct threadwq *twq, const unsigned int cap, const threadwq_edf_miss_t miss,
+	void (*cb_expired)(struct threadwq_job *job, void *priv))
+{
+	struct threadwq_edf *edf;
+
+	BUG_ON(twq->running);
+
+	if (miss >= THREADWQ_EDF_MAX || (miss == THREADWQ_EDF_CALL && cb_expired == NULL))
+	{
+		ERR("Invalid deadline miss policy %d", miss);
+		return -1;
+	}
+
+	if (twq->edf)
+	{
+		ERR("twq %p is in EDF mode already", twq);
+		return -1;
+	}
+
+	edf = calloc(1, sizeof(*edf));
+	if (!edf)
+	{
+		ERR("Cannot alloc EDF for twq %p", twq);
+		return -1;
+	}
+
+	edf->cap = cap ? cap : THREADWQ_EDF_CAP_DFL;
+	edf->miss = miss;
+	edf->cb_expired = cb_expired;
+
+	if (posix_memalign((void **) &edf->base, CAA_CACHE_LINE_SIZE, (edf->cap + EDF_SHIFT) * sizeof(edf->base[0])))
+	{
+		ERR("Cannot alloc EDF heap w/ %u jobs", edf->cap);
+		free(edf);
+		return -1;
+	}
+
+	edf->heap = edf->base + EDF_SHIFT;
+	twq->edf = edf;
+
+	return 0; // ok
+}
+
+int threadwq_set_edf_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int cap,
+	const threadwq_edf_miss_t miss, void (*cb_expired)(struct threadwq_job *job, void *priv))
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+	{
+		if (threadwq_set_edf(&twq_tbl[i], cap, miss, cb_expired))
+		{
+			return -1;
+		}
+	}
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Deadline counters of the worker. Miss rate = (late + expired) / nr. Safe while running.
+ */
+void threadwq_get_edf_stat(struct threadwq *twq, struct threadwq_edf_stat *st)
+{
+	memset(st, 0x00, sizeof(*st));
+
+	if (!twq->edf)
+	{
+		return;
+	}
+
+	st->nr = CMM_LOAD_SHARED(twq->edf->stat.nr);
+	st->late = CMM_LOAD_SHARED(twq->edf->stat.late);
+	st->expired = CMM_LOAD_SHARED(twq->edf->stat.expired);
+}
+
+static inline void edf_push(struct threadwq_edf *edf, struct threadwq_job *job)
+{
+	struct edf_ent ent = { .key = job->deadline ? job->deadline : (EDF_KEY_NONE | edf->seq++), .job = job };
+	unsigned int i = edf->nr++, p;
+
+	while (i > 0)
+	{
+		p = (i - 1) / EDF_ARY;
+		if (edf->heap[p].key <= ent.key)
+		{
+			break;
+		}
+
+		edf->heap[i] = edf->heap[p];
+		i = p;
+	}
+
+	edf->heap[i] = ent;
+}
+
+static inline struct threadwq_job *edf_pop(struct threadwq_edf *edf)
+{
+	struct threadwq_job *job = edf->heap[0].job;
+	struct edf_ent last = edf->heap[--edf->nr];
+	unsigned int i = 0, c, end, min;
+
+	for (;;)
+	{
+		c = i * EDF_ARY + 1;
+		if (c >= edf->nr)
+		{
+			break;
+		}
+
+		end = (c + EDF_ARY < edf->nr) ? c + EDF_ARY : edf->nr;
+		for (min = c++; c < end; c++)
+		{
+			if (edf->heap[c].key < edf->heap[min].key)
+			{
+				min = c;
+			}
+		}
+
+		if (last.key <= edf->heap[min].key)
+		{
+			break;
+		}
+
+		edf->heap[i] = edf->heap[min];
+		i = min;
+	}
+
+	edf->heap[i] = last;
+
+	return job;
+}
+
+void threadwq_exit_multi(struct threadwq *twq_tbl, const unsigned int nr)
+{
+	unsigned int i;
+	struct threadwq *twq;
+
+	for (i = nr; i > 0; i--) // The head of a shared pool goes last.
+	{
+		twq = &twq_tbl[i - 1];
+		threadwq_exit(twq);
+	}
+}
+
+/*
+ * Dequeue from the class queue. Plz hold rcu read-side lock for lfq.
+ */
+static inline struct threadwq_job *__dequeue_job(struct threadwq *twq, const unsigned int c)
+{
+	struct cds_lfq_node_rcu *lfq_node;
+
+	if (twq->queue == THREADWQ_QUEUE_RING)
+	{
+		return threadwq_ring_dequeue(&twq->ring[c]);
+	}
+
+	lfq_node = cds_lfq_dequeue_rcu(&twq->lfq[c]);
+	if (!lfq_node)
+	{
+		return NULL;
+	}
+
+	return caa_container_of(lfq_node, struct threadwq_job, lfq_node);
+}
+
+/*
+ * Pick a job in priority order. The owner also runs the anti-starvation turn; thieves take strict order.
+ */
+static inline struct threadwq_job *dequeue_prio_job(struct threadwq *twq, unsigned int *cls, const int owner)
+{
+	struct threadwq_job *job = NULL;
+	unsigned int c, k;
+
+	if (owner && twq->prio_weight)
+	{
+		for (c = twq->nr_prio - 1; c > 0; c--) // Lowest first.
+		{
+			if (twq->prio[c].starve >= twq->prio_weight)
+			{
+				twq->prio[c].starve = 0;
+
+				job = __dequeue_job(twq, c);
+				if (job)
+				{
+					*cls = c;
+					return job;
+				}
+			}
+		}
+	}
+
+	for (c = 0; c < twq->nr_prio; c++)
+	{
+		job = __dequeue_job(twq, c);
+		if (job)
+		{
+			break;
+		}
+	}
+
+	if (!job)
+	{
+		return NULL;
+	}
+
+	if (owner && twq->prio_weight)
+	{
+		for (k = c + 1; k < twq->nr_prio; k++)
+		{
+			if (CMM_LOAD_SHARED(twq->prio[k].depth))
+			{
+				twq->prio[k].starve++;
+			}
+		}
+	}
+
+	*cls = c;
+	return job;
+}
+
+/*
+ * Update per-class counters once per batch.
+ */
+static inline void account_prio(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int nr,
+	const unsigned int *cls_tbl)
+{
+	unsigned long cnt[THREADWQ_PRIO_NR] = { 0 }, wsum[THREADWQ_PRIO_NR] = { 0 }, wmax[THREADWQ_PRIO_NR] = { 0 };
+	unsigned long wait, old;
+	uint64_t now = 0;
+	unsigned int i, c;
+
+	if (twq->stat & THREADWQ_STAT_PRIO)
+	{
+		now = tm_mono_ns();
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		c = cls_tbl[i];
+		cnt[c]++;
+
+		if (twq->stat & THREADWQ_STAT_PRIO)
+		{
+			wait = now - job_tbl[i]->ts_enq;
+			wsum[c] += wait;
+			if (wait > wmax[c])
+			{
+				wmax[c] = wait;
+			}
+		}
+	}
+
+	for (c = 0; c < twq->nr_prio; c++)
+	{
+		if (!cnt[c])
+		{
+			continue;
+		}
+
+		if (twq->nr_prio > 1)
+		{
+			uatomic_sub(&twq->prio[c].depth, cnt[c]);
+		}
+
+		uatomic_add(&twq->prio[c].done, cnt[c]); // Thieves update it, too.
+
+		if (twq->stat & THREADWQ_STAT_PRIO)
+		{
+			uatomic_add(&twq->prio[c].wait_ns, wsum[c]);
+
+			old = CMM_LOAD_SHARED(twq->prio[c].wait_ns_max);
+			while (wmax[c] > old)
+			{
+				unsigned long cur = uatomic_cmpxchg(&twq->prio[c].wait_ns_max, old, wmax[c]);
+
+				if (cur == old)
+				{
+					break;
+				}
+				old = cur;
+			}
+		}
+	}
+}
+
+/*
+ * Pairs w/ threadwq_add_job_wait(): depth is lowered, then check waiters. The waiter is counted, then checks depth.
+ */
+static inline void wake_space_waiter(struct threadwq *twq, const unsigned int nr)
+{
+	cmm_smp_mb();
+
+	if (CMM_LOAD_SHARED(twq->space_waiter))
+	{
+		uatomic_inc(&twq->space_seq);
+		futex_noasync(&twq->space_seq, FUTEX_WAKE, nr < INT_MAX ? nr : INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/*
+ * The jobs left the queue of twq: Lower depth and update the class counters.
+ */
+static inline void uncount_jobs(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int nr,
+	const unsigned int *cls_tbl)
+{
+	uatomic_sub(&twq->depth, nr);
+	account_prio(twq, job_tbl, nr, cls_tbl);
+
+	if (caa_unlikely(twq->depth_max))
+	{
+		wake_space_waiter(twq, nr);
+	}
+}
+
+/*
+ * Detach up to max jobs in one pass. The rcu read-side lock (lfq) and the depth update are paid once.
+ *
+ * owner: 1 if the caller is the worker of twq. 0 for thieves.
+ */
+static inline unsigned int dequeue_jobs(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int max,
+	const int owner)
+{
+	unsigned int nr;
+	unsigned int cls_tbl[THREADWQ_DRAIN_BATCH_MAX > THREADWQ_STEAL_BATCH_MAX ? THREADWQ_DRAIN_BATCH_MAX : THREADWQ_STEAL_BATCH_MAX];
+	const unsigned int need_rcu = (twq->queue == THREADWQ_QUEUE_LFQ);
+
+	if (need_rcu)
+	{
+		rcu_read_lock();
+	}
+
+	if (caa_likely(twq->nr_prio == 1))
+	{
+		for (nr = 0; nr < max; nr++)
+		{
+			job_tbl[nr] = __dequeue_job(twq, 0);
+			if (!job_tbl[nr])
+			{
+				break;
+			}
+
+			cls_tbl[nr] = 0;
+		}
+	}
+	else
+	{
+		for (nr = 0; nr < max; nr++)
+		{
+			job_tbl[nr] = dequeue_prio_job(twq, &cls_tbl[nr], owner);
+			if (!job_tbl[nr])
+			{
+				break;
+			}
+		}
+	}
+
+	if (need_rcu)
+	{
+		rcu_read_unlock();
+	}
+
+	if (nr)
+	{
+		uncount_jobs(twq, job_tbl, nr, cls_tbl);
+	}
+
+	return nr;
+}
+
+static inline struct threadwq_job *dequeue_one_job(struct threadwq *twq)
+{
+	struct threadwq_job *job;
+
+	if (dequeue_jobs(twq->src, &job, 1, twq->src == twq))
+	{
+		return job;
+	}
+
+	return NULL;
+}
+
+static inline void put_inflight(struct threadwq *twq, const unsigned int e)
+{
+	if (uatomic_sub_return(&twq->inflight[e], 1) == 0 && CMM_LOAD_SHARED(twq->flush_waiter))
+	{
+		uatomic_inc(&twq->flush_seq);
+		futex_noasync(&twq->flush_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/*!
+ * \brief Uncount one from epoch e. See __threadwq_get_inflight().
+ */
+void __threadwq_put_inflight(struct threadwq *twq, const unsigned int e)
+{
+	put_inflight(twq, e);
+}
+
+/*
+ * Run cb_finish, then uncount the job. cb_finish may free it, so read the counter first.
+ */
+static inline void finish_job(struct threadwq_job *job)
+{
+	struct threadwq *twq = job->twq;
+	const unsigned int e = job->epoch;
+
+	job->cb_finish(job, job->priv);
+	put_inflight(twq, e);
+}
+
+static void __exec_finish_rcu(struct rcu_head *head)
+{
+	struct threadwq_job *job =
+		caa_container_of(head, struct threadwq_job, rcu_head);
+
+	finish_job(job);
+}
+
+/*
+ * Finished jobs waiting for cb_finish. Owned by one worker.
+ */
+struct finish_batch
+{
+	unsigned int nr;
+	struct threadwq_job *job_tbl[THREADWQ_FINISH_BATCH_MAX];
+};
+
+static inline void flush_finish(struct finish_batch *fb)
+{
+	struct threadwq_job *job;
+	unsigned int i;
+
+	for (i = 0; i < fb->nr; i++)
+	{
+		job = fb->job_tbl[i];
+		finish_job(job);
+	}
+
+	fb->nr = 0;
+}
+
+/*
+ * Hand a job whose cb_start is done (or skipped) over to its completion mode.
+ *
+ * src: The twq which the job was dequeued from. Its backend decides whether rcu is a must.
+ */
+static inline void complete_job(struct threadwq *src, struct threadwq_job *job, struct finish_batch *fb)
+{
+	threadwq_finish_t finish = job->finish;
+
+	if (finish == THREADWQ_FINISH_DFL)
+	{
+		finish = src->ops.finish;
+	}
+
+	if (finish == THREADWQ_FINISH_DFL || src->queue == THREADWQ_QUEUE_LFQ)
+	{
+		finish = THREADWQ_FINISH_RCU;
+	}
+
+	switch (finish)
+	{
+	case THREADWQ_FINISH_INLINE:
+		finish_job(job);
+		break;
+	case THREADWQ_FINISH_BATCH:
+		fb->job_tbl[fb->nr++] = job;
+		if (caa_unlikely(fb->nr >= THREADWQ_FINISH_BATCH_MAX))
+		{
+			flush_finish(fb);
+		}
+		break;
+	case THREADWQ_FINISH_RCU:
+	default:
+		call_rcu(&job->rcu_head, __exec_finish_rcu);
+		break;
+	}
+}
+
+/*
+ * self: The twq of this worker.
+ * src: The twq which the job was dequeued from.
+ */
+static inline void exec_one_job(struct threadwq *self, struct threadwq *src, struct threadwq_job *job,
+	struct finish_batch *fb)
+{
+	if (caa_unlikely(self->hist))
+	{
+		uint64_t ts = tm_mono_ns();
+
+		if (src->stat)
+		{
+			threadwq_hist_record(&self->hist->wait, ts - job->ts_enq);
+		}
+
+		job->cb_start(job, job->priv);
+		threadwq_hist_record(&self->hist->run, tm_mono_ns() - ts);
+	}
+	else
+	{
+		job->cb_start(job, job->priv);
+	}
+
+	complete_job(src, job, fb);
+}
+
+/*
+ * Start a job out of the deadline heap. Apply the miss policy if its deadline passed.
+ */
+static inline void edf_exec(struct threadwq *self, struct threadwq *src, struct threadwq_job *job,
+	struct finish_batch *fb)
+{
+	struct threadwq_edf *edf = self->edf;
+
+	if (job->deadline)
+	{
+		CMM_STORE_SHARED(edf->stat.nr, edf->stat.nr + 1);
+
+		if (caa_unlikely(tm_mono_ns() > job->deadline))
+		{
+			if (edf->miss == THREADWQ_EDF_RUN)
+			{
+				CMM_STORE_SHARED(edf->stat.late, edf->stat.late + 1);
+			}
+			else
+			{
+				CMM_STORE_SHARED(edf->stat.expired, edf->stat.expired + 1);
+
+				if (edf->miss == THREADWQ_EDF_CALL)
+				{
+					edf->cb_expired(job, job->priv);
+				}
+
+				complete_job(src, job, fb);
+				return;
+			}
+		}
+	}
+
+	exec_one_job(self, src, job, fb);
+}
+
+/*
+ * Send the ops prepared last round, then run the aio jobs whose ops completed. wait: Block for one (exit drain).
+ */
+static inline unsigned int aio_round(struct threadwq *twq, struct finish_batch *fb, const unsigned int wait)
+{
+	struct threadwq_job *job_tbl[THREADWQ_DRAIN_BATCH_MAX];
+	unsigned int nr, i;
+
+	nr = __threadwq_aio_reap(twq, job_tbl, twq->drain_batch, wait);
+	for (i = 0; i < nr; i++)
+	{
+		exec_one_job(twq, twq, job_tbl[i], fb);
+	}
+
+	return nr;
+}
+
+/*
+ * Move queued jobs into the heap (up to a drain batch), then start the earliest one. 0: Nothing to run.
+ */
+static inline unsigned int edf_round(struct threadwq *twq, struct threadwq *q, struct finish_batch *fb)
+{
+	struct threadwq_edf *edf = twq->edf;
+	struct threadwq_job *job_tbl[THREADWQ_DRAIN_BATCH_MAX];
+	unsigned int room = edf->cap - edf->nr, nr, i;
+
+	if (room > twq->drain_batch)
+	{
+		room = twq->drain_batch;
+	}
+
+	if (room)
+	{
+		nr = dequeue_jobs(q, job_tbl, room, q == twq);
+		for (i = 0; i < nr; i++)
+		{
+			edf_push(edf, job_tbl[i]);
+		}
+	}
+
+	if (edf->nr == 0)
+	{
+		return 0;
+	}
+
+	edf_exec(twq, q, edf_pop(edf), fb);
+
+	return 1;
+}
+
+/*!
+ * \brief Let the workers in one pool steal jobs from each other.
+ *
+ * \details A worker whose own queue is empty steals up to batch jobs from the most loaded sibling
+ *     before it parks. A worker who finds jobs queued behind itself wakes up a parked sibling to steal.
+ *     Call this before threadwq_exec_multi().
+ *
+ * \param batch Max jobs to steal at once. 0: Use THREADWQ_STEAL_BATCH_DFL.
+ */
+int threadwq_set_steal_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int batch)
+{
+	unsigned int i;
+	struct threadwq *twq;
+
+	if (batch > THREADWQ_STEAL_BATCH_MAX || nr < 2)
+	{
+		ERR("Invalid steal batch %u or pool size %u", batch, nr);
+		return -1;
+	}
+
+	if (twq_tbl[0].shared)
+	{
+		ERR("A shared pool has nothing to steal");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		twq = &twq_tbl[i];
+
+		twq->sibling_tbl = twq_tbl;
+		twq->sibling_nr = nr;
+		twq->steal_batch = batch ? batch : THREADWQ_STEAL_BATCH_DFL;
+
+		/*
+		 * Jobs detached by the owner cannot be stolen. Keep the owner batch small.
+		 */
+		if (twq->drain_batch > twq->steal_batch / 4 + 1)
+		{
+			twq->drain_batch = twq->steal_batch / 4 + 1;
+		}
+	}
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Let all workers of one pool drain the queue of twq_tbl[0]. Call this before threadwq_exec_multi().
+ *
+ * \details One MPMC queue, nr consumers: No job waits behind a long one while another worker idles, at the
+ *     cost of one queue bounced between all workers. Good for uniform short jobs. Add jobs w/
+ *     threadwq_man_ops_shared, which wakes a parked worker per job. Use the ring backend to scale: Its slots
+ *     carry sequence numbers, so consumers only meet on the tail index. A job added into any member (e.g. from
+ *     threadwq_self()) goes into the shared queue, under the depth limit of twq_tbl[0].
+ *
+ * \param batch Max jobs a worker detaches at once. Detached jobs cannot go to an idle worker. 0: Default.
+ */
+int threadwq_set_shared_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int batch)
+{
+	unsigned int i;
+
+	if (batch > THREADWQ_DRAIN_BATCH_MAX || nr == 0)
+	{
+		ERR("Invalid batch %u or pool size %u", batch, nr);
+		return -1;
+	}
+
+	if (twq_tbl[0].sibling_tbl)
+	{
+		ERR("A shared pool has nothing to steal");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		twq_tbl[i].src = &twq_tbl[0];
+		twq_tbl[i].shared = 1;
+		twq_tbl[i].drain_batch = batch ? batch : THREADWQ_SHARED_BATCH_DFL;
+	}
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Set max jobs the worker detaches from its queue per round. Larger is cheaper; smaller leaves more to steal.
+ */
+int threadwq_set_drain_batch(struct threadwq *twq, const unsigned int batch)
+{
+	if (batch == 0 || batch > THREADWQ_DRAIN_BATCH_MAX)
+	{
+		ERR("Invalid drain batch %u", batch);
+		return -1;
+	}
+
+	twq->drain_batch = batch;
+	return 0; // ok
+}
+
+/*
+ * Steal from the most loaded sibling, and run the jobs here. Return the number of jobs done.
+ */
+static unsigned int steal_jobs(struct threadwq *twq, struct finish_batch *fb)
+{
+	struct threadwq *victim = NULL, *sib;
+	struct threadwq_job *job_tbl[THREADWQ_STEAL_BATCH_MAX];
+	unsigned long depth, depth_max = 0;
+	unsigned int i, nr, want;
+
+	for (i = 0; i < twq->sibling_nr; i++)
+	{
+		sib = &twq->sibling_tbl[i];
+		if (sib == twq)
+		{
+			continue;
+		}
+
+		depth = CMM_LOAD_SHARED(sib->depth);
+		if (depth > depth_max)
+		{
+			depth_max = depth;
+			victim = sib;
+		}
+	}
+
+	if (!victim)
+	{
+		return 0;
+	}
+
+	/*
+	 * Take half of the victim queue at most. Leave the rest to the owner.
+	 */
+	want = (depth_max + 1) / 2;
+	if (want > twq->steal_batch)
+	{
+		want = twq->steal_batch;
+	}
+
+	nr = dequeue_jobs(victim, job_tbl, want, 0);
+	if (nr == 0)
+	{
+		return 0;
+	}
+
+	uatomic_add(&twq->stolen, nr);
+
+	for (i = 0; i < nr; i++)
+	{
+		exec_one_job(twq, victim, job_tbl[i], fb);
+	}
+
+	return nr;
+}
+
+/*
+ * Jobs are waiting behind this worker. Wake up one parked sibling to steal them.
+ */
+static void kick_thief(struct threadwq *twq)
+{
+	struct threadwq *sib;
+	unsigned int i;
+
+	for (i = 0; i < twq->sibling_nr; i++)
+	{
+		sib = &twq->sibling_tbl[i];
+		if (sib == twq)
+		{
+			continue;
+		}
+
+		if (CMM_LOAD_SHARED(sib->sleeping) && uatomic_xchg(&sib->sleeping, 0))
+		{
+			__threadwq_wakeup(sib);
+			return;
+		}
+	}
+}
+
+
+/*
+ * Park the worker. The handshake w/ threadwq_wakeup() is lost-wakeup-safe:
+ *
+ *   worker:   sleeping = 1; mb; dequeue again; read(efd)
+ *   producer: enqueue; mb; if (xchg(sleeping, 0)) write(efd)
+ *
+ * Either the worker sees the new job, or the producer sees sleeping = 1 and posts the eventfd.
+ *
+ * park_us = 0: Park until wakeup.
+ */
+static struct threadwq_job *park(struct threadwq *twq, const unsigned int park_us)
+{
+	struct threadwq_job *job;
+	uint64_t cnt;
+
+	uatomic_set(&twq->sleeping, 1);
+	cmm_smp_mb();
+
+	job = dequeue_one_job(twq);
+	if (job || CMM_LOAD_SHARED(twq->exit))
+	{
+		/*
+		 * A producer might have taken sleeping already. The extra eventfd count only costs one empty loop.
+		 */
+		uatomic_set(&twq->sleeping, 0);
+		return job;
+	}
+
+	if (park_us)
+	{
+		struct pollfd pfd = { .fd = twq->efd, .events = POLLIN };
+		struct timespec ts = { .tv_sec = park_us / 1000000, .tv_nsec = (park_us % 1000000) * 1000 };
+
+		if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+		{
+			goto out; // timeout or signal
+		}
+	}
+
+	if (read(twq->efd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+	{
+		ERR("Cannot park twq %p %s", twq, strerror(errno));
+	}
+
+out:
+	uatomic_set(&twq->sleeping, 0);
+	return NULL;
+}
+
+/*
+ * Refused SQEs post no eventfd. Park no longer than the aio retry then: The next round resends them.
+ */
+static inline unsigned int park_us_of(struct threadwq *twq, const unsigned int park_us)
+{
+	if (caa_likely(!twq->aio) || !__threadwq_aio_unsent(twq))
+	{
+		return park_us;
+	}
+
+	return (park_us && park_us < THREADWQ_AIO_RETRY_US) ? park_us : THREADWQ_AIO_RETRY_US;
+}
+
+/*
+ * idle_cnt: Number of empty rounds in a row. Reset by caller when a job is found.
+ */
+static inline struct threadwq_job *wait4job(struct threadwq *twq, unsigned int *idle_cnt)
+{
+	const struct threadwq_ops *ops = &twq->ops;
+	unsigned int cnt = (*idle_cnt)++;
+
+	switch (ops->idle)
+	{
+	case THREADWQ_IDLE_POLL:
+		caa_cpu_relax();
+		return NULL;
+	case THREADWQ_IDLE_ADAPTIVE:
+		if (cnt < ops->idle_spin)
+		{
+			caa_cpu_relax();
+			return NULL;
+		}
+
+		if (cnt - ops->idle_spin < ops->idle_yield)
+		{
+			sched_yield();
+			return NULL;
+		}
+
+		(*idle_cnt)--; // Stay in park stage. Avoid overflow.
+		return park(twq, park_us_of(twq, ops->idle_park_us));
+	case THREADWQ_IDLE_BLOCK:
+	default:
+		return park(twq, park_us_of(twq, 0));
+	}
+}
+
+static inline unsigned int exec_pending_jobs(struct threadwq *twq, struct finish_batch *fb)
+{
+	struct threadwq_job *job_tbl[THREADWQ_DRAIN_BATCH_MAX];
+	unsigned int accl = 0, nr, i;
+
+	while ((nr = dequeue_jobs(twq, job_tbl, THREADWQ_DRAIN_BATCH_MAX, 1)) > 0)
+	{
+		for (i = 0; i < nr; i++)
+		{
+			exec_one_job(twq, twq, job_tbl[i], fb);
+		}
+
+		accl += nr;
+	}
+
+	return accl;
+}
+
+/*
+ * Publish busy once per batch (or idle round). Skip the store if nothing changes.
+ */
+static inline void publish_busy(struct threadwq *twq, unsigned int *busy, const unsigned int nr)
+{
+	unsigned int val = (*busy >> 1) + nr;
+
+	if (val != *busy)
+	{
+		*busy = val;
+		uatomic_set(&twq->busy, val);
+	}
+}
+
+/*!
+ * \brief Keep a job, counted already, which a worker could not push into a full ring. See __threadwq_enqueue().
+ */
+void __threadwq_spill(struct threadwq *self, struct threadwq_job *job)
+{
+	job->spill_next = NULL;
+
+	if (self->spill_tail)
+	{
+		self->spill_tail->spill_next = job;
+	}
+	else
+	{
+		self->spill_head = job;
+	}
+
+	self->spill_tail = job;
+}
+
+/*
+ * Push the spilled jobs into their rings. A job for the queue this worker drains runs here if its ring is still
+ * full: Waiting would wait for ourselves. The others stay for the next round. all: Run every one (exit drain).
+ */
+static unsigned int spill_round(struct threadwq *twq, struct finish_batch *fb, const unsigned int all)
+{
+	struct threadwq_job *job = twq->spill_head, *next;
+	struct threadwq *dst;
+	unsigned int nr = 0, c;
+
+	twq->spill_head = twq->spill_tail = NULL; // Jobs run here may spill again.
+
+	for (; job; job = next)
+	{
+		next = job->spill_next;
+		dst = job->twq;
+		c = threadwq_job_class(dst, job);
+
+		if (!all && !threadwq_ring_enqueue(&dst->ring[c], job))
+		{
+			threadwq_wakeup(dst);
+			nr++;
+			continue;
+		}
+
+		if (all || dst == twq->src)
+		{
+			uncount_jobs(dst, &job, 1, &c);
+			exec_one_job(twq, dst, job, fb);
+			nr++;
+			continue;
+		}
+
+		__threadwq_spill(twq, job);
+	}
+
+	return nr;
+}
+
+static __thread struct threadwq *twq_self = NULL;
+
+/*!
+ * \brief The twq whose worker is the calling thread. NULL if not called from a worker.
+ *
+ * \details In a shared pool, jobs added into it go into the shared queue (its src), like into any member.
+ */
+struct threadwq *threadwq_self(void)
+{
+	return twq_self;
+}
+
+static void *thread_func(void *in)
+{
+	struct threadwq *twq = in;
+	struct threadwq *q = twq->src; // Shared pool: The head twq. Otherwise: Itself.
+
+	twq_self = twq;
+
+	rcu_register_thread();
+
+	VBS("twq %p online", twq);
+	if (twq->ops.worker_init)
+	{
+		/* Basic hint: rcu_register_thread. Affinity: Plz use threadwq_set_cpuset(). */
+		if (twq->ops.worker_init(twq, twq->ops.worker_init_priv))
+		{
+			ERR("Failed to exec user initializer");
+			BUG(); // FIXME: Hard to recover...
+		}
+	}
+
+	twq->running = 1;
+	cmm_smp_mb();
+
+	{
+		unsigned int busy = 0, idle_cnt = 0, kick_cnt = 0, pre_nr, nr, i;
+		struct threadwq_job *job_tbl[THREADWQ_DRAIN_BATCH_MAX];
+		struct finish_batch fb = { .nr = 0 };
+
+		while (caa_unlikely(twq->exit == 0))
+		{
+			/*
+			 * Completed I/O first: Its jobs hold files and buffers. Never park while they may submit more.
+			 */
+			pre_nr = 0;
+
+			if (caa_unlikely(twq->aio))
+			{
+				pre_nr = aio_round(twq, &fb, 0);
+			}
+
+			/*
+			 * Jobs this worker added while a ring was full. Never park while some are left.
+			 */
+			if (caa_unlikely(twq->spill_head))
+			{
+				pre_nr += spill_round(twq, &fb, 0);
+			}
+
+			if (caa_unlikely(twq->edf))
+			{
+				if (edf_round(twq, q, &fb))
+				{
+					idle_cnt = 0;
+					publish_busy(twq, &busy, 1);
+					continue;
+				}
+
+				if (pre_nr || twq->spill_head)
+				{
+					idle_cnt = 0;
+					publish_busy(twq, &busy, pre_nr);
+					continue;
+				}
+
+				if (twq->sibling_tbl && (nr = steal_jobs(twq, &fb)))
+				{
+					publish_busy(twq, &busy, nr);
+					continue;
+				}
+
+				publish_busy(twq, &busy, 0);
+				flush_finish(&fb);
+
+				job_tbl[0] = wait4job(twq, &idle_cnt);
+				if (job_tbl[0])
+				{
+					edf_push(twq->edf, job_tbl[0]);
+				}
+				continue;
+			}
+
+			nr = dequeue_jobs(q, job_tbl, twq->drain_batch, q == twq);
+			if (caa_unlikely(nr == 0))
+			{
+				if (pre_nr || twq->spill_head)
+				{
+					idle_cnt = 0;
+					publish_busy(twq, &busy, pre_nr);
+					continue;
+				}
+
+				if (twq->sibling_tbl)
+				{
+					nr = steal_jobs(twq, &fb);
+					if (nr)
+					{
+						publish_busy(twq, &busy, nr);
+						idle_cnt = 0;
+						continue;
+					}
+				}
+
+				publish_busy(twq, &busy, 0);
+				flush_finish(&fb); // Going idle. Do not hold finished jobs.
+
+				job_tbl[0] = wait4job(twq, &idle_cnt);
+				if (!job_tbl[0])
+				{
+					continue;
+				}
+
+				nr = 1;
+			}
+
+			idle_cnt = 0;
+			publish_busy(twq, &busy, nr);
+
+			/*
+			 * Someone is queued behind this batch. Ask a parked sibling for help, once per steal batch.
+			 */
+			if (twq->sibling_tbl)
+			{
+				if (kick_cnt > nr)
+				{
+					kick_cnt -= nr;
+				}
+				else if (CMM_LOAD_SHARED(twq->depth) > 0 || nr > 1)
+				{
+					kick_cnt = twq->steal_batch;
+					kick_thief(twq);
+				}
+			}
+
+			/*
+			 * The batch is private now. No shared queue state is touched until the next round.
+			 */
+			for (i = 0; i < nr; i++)
+			{
+				exec_one_job(twq, q, job_tbl[i], &fb);
+			}
+		}
+
+		/*
+		 * Got a signal to exit. Flush queue. A shared queue is left to the head, who exits last.
+		 */
+		for (;;)
+		{
+			while (twq->edf && twq->edf->nr)
+			{
+				edf_exec(twq, q, edf_pop(twq->edf), &fb);
+			}
+
+			if (q == twq)
+			{
+				exec_pending_jobs(twq, &fb);
+			}
+
+			if (twq->spill_head)
+			{
+				spill_round(twq, &fb, 1);
+				continue;
+			}
+
+			if (!twq->aio || !__threadwq_aio_busy(twq))
+			{
+				break;
+			}
+
+			/*
+			 * Ops in flight: Wait for them, and run their jobs. The kernel may refuse the unsent ones for a while.
+			 */
+			if (!aio_round(twq, &fb, 1) && __threadwq_aio_unsent(twq))
+			{
+				usleep(THREADWQ_AIO_RETRY_US);
+			}
+		}
+		flush_finish(&fb);
+	}
+
+	VBS("twq %p offline", twq);
+	if (twq->ops.worker_exit)
+	{
+		twq->ops.worker_exit(twq, twq->ops.worker_exit_priv);
+	}
+
+	twq->exit_ack = 1;
+	cmm_smp_mb();
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*!
+ * \brief Pin the worker on a cpuset. Call this before threadwq_exec().
+ *
+ * \details If all cpus are on one NUMA node, the queue storage is placed on that node at exec.
+ */
+int threadwq_set_cpuset(struct threadwq *twq, const cpu_set_t *set)
+{
+	int cpu, node;
+
+	if (CPU_COUNT(set) == 0)
+	{
+		ERR("Empty cpuset for twq %p", twq);
+		return -1;
+	}
+
+	memcpy(&twq->cpuset, set, sizeof(*set));
+	twq->has_cpuset = 1;
+	twq->node = -1;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, set))
+		{
+			continue;
+		}
+
+		node = cputopo_cpu2node(cpu);
+		if (twq->node == -1)
+		{
+			twq->node = node;
+		}
+		else if (twq->node != node)
+		{
+			twq->node = -1; // across nodes
+			break;
+		}
+	}
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Pin one worker per cpu. Spread over NUMA nodes first, then physical cores, then SMT siblings.
+ *
+ * \details Wrap around if there are more workers than allowed cpus. Call this before threadwq_exec_multi().
+ */
+int threadwq_spread_multi(struct threadwq *twq_tbl, const unsigned int nr)
+{
+	struct cputopo_cpu *topo;
+	cpu_set_t set;
+	unsigned int i;
+	int topo_nr;
+
+	topo = malloc(sizeof(*topo) * CPUTOPO_CPU_MAX);
+	if (!topo)
+	{
+		return -1;
+	}
+
+	topo_nr = cputopo_load(topo, CPUTOPO_CPU_MAX);
+	if (topo_nr <= 0)
+	{
+		ERR("Cannot load cpu topology");
+		free(topo);
+		return -1;
+	}
+
+	cputopo_spread(topo, topo_nr);
+
+	for (i = 0; i < nr; i++)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(topo[i % topo_nr].cpu, &set);
+
+		if (threadwq_set_cpuset(&twq_tbl[i], &set))
+		{
+			free(topo);
+			return -1;
+		}
+
+		VBS("twq %p on cpu %d node %d", &twq_tbl[i], topo[i % topo_nr].cpu, topo[i % topo_nr].node);
+	}
+
+	free(topo);
+	return 0; // ok
+}
+
+int threadwq_exec(struct threadwq *twq)
+{
+	/*
+	 * Nobody else dequeues from a ring w/o stealing. Skip the cmpxchg.
+	 */
+	{
+		unsigned int c;
+
+		for (c = 0; c < twq->nr_prio; c++)
+		{
+			twq->ring[c].sc = (twq->sibling_tbl == NULL && !twq->shared);
+		}
+	}
+
 	pthread_attr_init(&(twq->attr));
 	pthread_attr_setdetachstate(&(twq->attr), PTHREAD_CREATE_JOINABLE);
 
+	if (twq->has_cpuset)
+	{
+		if (pthread_attr_setaffinity_np(&(twq->attr), sizeof(twq->cpuset), &twq->cpuset))
+		{
+			ERR("Cannot set affinity for twq %p", twq);
+			return -1;
+		}
+
+		/*
+		 * Move the queue storage next to the worker. Optional.
+		 */
+		if (twq->node >= 0 && twq->queue == THREADWQ_QUEUE_RING)
+		{
+			struct threadwq_ring *ring;
+			unsigned int c;
+
+			for (c = 0; c < twq->nr_prio; c++)
+			{
+				ring = &twq->ring[c];
+				if (cputopo_mbind(ring->slot_tbl, (ring->mask + 1) * sizeof(ring->slot_tbl[0]), twq->node))
+				{
+					VBS("Cannot place twq %p ring on node %d %s", twq, twq->node, strerror(errno));
+				}
+			}
+		}
+	}
+
 	if (pthread_create(&twq->tid, &(twq->attr), &thread_func, (void *) twq))
 	{
 		ERR("Cannot create pthread %s", strerror(errno));
@@ -7,6 +7,8 @@
 #define SRC_THREADWQ_THREADWQ_H_
 
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 
 #include <urcu.h>
 #include <urcu/list.h>
@@ -15,22 +17,82 @@
 #include "lgu/lgu.h"
 
 #include "threadwq/threadwq_man.h"
+#include "threadwq/threadwq_ring.h"
+#include "threadwq/threadwq_hist.h"
 
 #define THREADWQ_LFQ_CREATE_RCU_DATA (1) //!< Say 0 to disable rcu thread.
 
 /*
- * Policy:
- * - If this is not critical app, BLOCKED_ENQUEUE = 1
- * - If this is critical, BLOCKED_ENQUEUE = 0
- * - If this is very crital and allow more cpu usage: say ENQUEUE_TIMEDWAIT = 0.
+ * Idle policy: What a worker does when its queue is empty. Set per twq in threadwq_ops.
+ * - If this is not critical app, BLOCK.
+ * - If this is critical, ADAPTIVE w/ a spin budget about your job inter-arrival time.
+ * - If this is very critical and allow more cpu usage: POLL.
  */
-#define THREADWQ_BLOCKED_ENQUEUE (1)
-#if !THREADWQ_BLOCKED_ENQUEUE
-#define THREADWQ_NONBLOCKED_ENQUEUE (1)
-#define THREADWQ_NONBLOCKED_ENQUEUE_TIMEDWAIT (0) //!< 1 = 1 nanosecond, or 0 = cpu_relax
-#endif
+typedef enum
+{
+	THREADWQ_IDLE_BLOCK = 0, //!< Park on eventfd right away. (default)
+	THREADWQ_IDLE_POLL, //!< Busy-poll w/ cpu_relax. Never park, so producers never make a syscall.
+	THREADWQ_IDLE_ADAPTIVE, //!< Spin w/ cpu_relax, then sched_yield, then a timed park.
+	THREADWQ_IDLE_MAX
+} threadwq_idle_t;
+
+#define THREADWQ_IDLE_SPIN_DFL (1000) //!< cpu_relax rounds before yield.
+#define THREADWQ_IDLE_YIELD_DFL (10) //!< sched_yield rounds before park.
+#define THREADWQ_IDLE_PARK_US_DFL (1000) //!< Max park time (usec).
+
+#define THREADWQ_DRAIN_BATCH_DFL (32) //!< Max jobs a worker detaches from its queue at once.
+#define THREADWQ_DRAIN_BATCH_MAX (256)
+
+/*
+ * Queue backend. Choose one at init.
+ */
+typedef enum
+{
+	THREADWQ_QUEUE_LFQ = 0, //!< Unbounded rcu lock-free queue. (default)
+	THREADWQ_QUEUE_RING, //!< Bounded array ring. No rcu, no allocation. See threadwq_init_ring().
+} threadwq_queue_t;
+
+#define THREADWQ_RING_SLOT_DFL (65536)
+
+#define THREADWQ_STEAL_BATCH_DFL (16) //!< Max jobs to steal from a sibling at once.
+#define THREADWQ_STEAL_BATCH_MAX (256)
+
+#define THREADWQ_SHARED_BATCH_DFL (4) //!< Max jobs a worker of a shared pool detaches at once.
+
+/*
+ * EDF mode: What a worker does w/ a job whose deadline passed before it started. See threadwq_set_edf().
+ */
+typedef enum
+{
+	THREADWQ_EDF_RUN = 0, //!< Run it anyway. Count it late.
+	THREADWQ_EDF_DROP, //!< Skip cb_start. cb_finish still comes.
+	THREADWQ_EDF_CALL, //!< Call cb_expired instead of cb_start. cb_finish still comes.
+	THREADWQ_EDF_MAX
+} threadwq_edf_miss_t;
 
-#define THREADWQ_STAT_PERIOD (1000) //!< Recommend: Use your max job size?
+#define THREADWQ_EDF_CAP_DFL (1024) //!< Jobs a worker keeps in its deadline heap. The rest wait in the queue.
+
+/*
+ * Completion mode: When cb_finish runs. Set per twq in threadwq_ops, or per job.
+ *
+ * lfq backend always uses RCU: A dequeued lfq node may still be read by others until a grace period passes.
+ */
+typedef enum
+{
+	THREADWQ_FINISH_DFL = 0, //!< Per job: Follow the twq. Per twq: RCU.
+	THREADWQ_FINISH_RCU, //!< Defer cb_finish w/ call_rcu.
+	THREADWQ_FINISH_INLINE, //!< Run cb_finish right after cb_start on the worker.
+	THREADWQ_FINISH_BATCH, //!< Run cb_finish on the worker after a batch of cb_start, or before it idles.
+	THREADWQ_FINISH_MAX
+} threadwq_finish_t;
+
+#define THREADWQ_FINISH_BATCH_MAX (64)
+
+/*
+ * Priority classes. 0 is the highest. Each class has its own queue per twq. See threadwq_set_prio().
+ */
+#define THREADWQ_PRIO_NR (4)
+#define THREADWQ_PRIO_WEIGHT_DFL (16) //!< A lower class gets one turn after being passed over this many times.
 
 struct threadwq_job
 {
@@ -38,6 +100,16 @@ struct threadwq_job
 	void (*cb_start)(struct threadwq_job *job, void *priv);
 	void (*cb_finish)(struct threadwq_job *job, void *priv);
 
+	threadwq_finish_t finish; //!< Completion mode. See threadwq_job_set_finish().
+	unsigned int prio; //!< Priority class. 0 is the highest. See threadwq_job_set_prio().
+	uint64_t key; //!< Flow key for ordered dispatchers. See threadwq_job_set_key().
+	uint64_t deadline; //!< Start before it (tm_mono_ns()). 0: None. See threadwq_job_set_deadline().
+	uint64_t ts_enq; //!< Enqueue time (ns). Only set when twq stat is on.
+
+	struct threadwq *twq; //!< The twq it was added into. Set at enqueue.
+	unsigned int epoch; //!< Flush epoch it was counted in. Set at enqueue.
+	struct threadwq_job *spill_next; //!< Spill list of a worker. See __threadwq_spill().
+
 	struct rcu_head rcu_head;
 	struct cds_lfq_node_rcu lfq_node;
 };
@@ -51,84 +123,578 @@ void threadwq_job_init(struct threadwq_job *job,
 	job->cb_start = cb_start;
 	job->cb_finish = cb_finish;
 	job->priv = priv;
+	job->finish = THREADWQ_FINISH_DFL;
+	job->prio = 0;
+	job->key = 0;
+	job->deadline = 0;
 
 	cds_lfq_node_init_rcu(&job->lfq_node);
 }
 
+/*!
+ * \brief Set priority class. A twq w/ fewer classes puts the job into its lowest class.
+ */
+static inline __attribute__((unused))
+void threadwq_job_set_prio(struct threadwq_job *job, const unsigned int prio)
+{
+	BUG_ON(prio >= THREADWQ_PRIO_NR);
+	job->prio = prio;
+}
+
+/*!
+ * \brief Set the flow key. threadwq_man_ops_hash runs jobs w/ the same key on one worker, in order.
+ */
+static inline __attribute__((unused))
+void threadwq_job_set_key(struct threadwq_job *job, const uint64_t key)
+{
+	job->key = key;
+}
+
+/*!
+ * \brief Absolute deadline to start by, e.g. tm_mono_ns() + budget. Only a twq in EDF mode orders by it.
+ */
+static inline __attribute__((unused))
+void threadwq_job_set_deadline(struct threadwq_job *job, const uint64_t deadline)
+{
+	job->deadline = deadline;
+}
+
+/*!
+ * \brief Override the completion mode of the twq for this job.
+ */
+static inline __attribute__((unused))
+void threadwq_job_set_finish(struct threadwq_job *job, const threadwq_finish_t finish)
+{
+	BUG_ON(finish >= THREADWQ_FINISH_MAX);
+	job->finish = finish;
+}
+
 struct threadwq_ops
 {
 	int (*worker_init)(struct threadwq *twq, void *priv);
 	void *worker_init_priv;
 	void (*worker_exit)(struct threadwq *twq, void *priv);
 	void *worker_exit_priv;
+
+	threadwq_idle_t idle; //!< Idle policy. Default: THREADWQ_IDLE_BLOCK
+	unsigned int idle_spin; //!< ADAPTIVE: cpu_relax rounds before yield.
+	unsigned int idle_yield; //!< ADAPTIVE: sched_yield rounds before park.
+	unsigned int idle_park_us; //!< ADAPTIVE: Max park time (usec). 0: Park until wakeup.
+
+	threadwq_finish_t finish; //!< Completion mode. Default: THREADWQ_FINISH_RCU
 };
 
 #define THREQDWQ_OPS_INITIALIZER(_init, _initpriv, _exit, _exitpriv) \
 	{ _init, _initpriv, _exit, _exitpriv }
 
+#define THREADWQ_OPS_IDLE_INITIALIZER(_init, _initpriv, _exit, _exitpriv, _idle, _spin, _yield, _park_us) \
+	{ _init, _initpriv, _exit, _exitpriv, _idle, _spin, _yield, _park_us }
+
+/*
+ * Per-class counters of one twq.
+ */
+struct threadwq_prio
+{
+	unsigned long depth; //!< Queued jobs in this class. (nr_prio > 1 only)
+	unsigned long done; //!< Dequeued jobs.
+	unsigned long wait_ns; //!< Sum of queue wait. (stat only)
+	unsigned long wait_ns_max; //!< (stat only)
+	unsigned int starve; //!< Times passed over while not empty. Owner only.
+};
+
+struct threadwq_prio_stat
+{
+	unsigned long depth;
+	unsigned long done;
+	unsigned long wait_ns_avg;
+	unsigned long wait_ns_max;
+};
+
+/*
+ * What twq->stat timestamps jobs for.
+ */
+#define THREADWQ_STAT_PRIO (1 << 0) //!< Queue wait per class. See threadwq_set_prio().
+#define THREADWQ_STAT_HIST (1 << 1) //!< Latency histograms. See threadwq_set_hist().
+
+/*
+ * Latency histograms of one worker. Recorded by the worker which runs the job (thieves included).
+ */
+struct threadwq_lat_hist
+{
+	struct threadwq_hist wait; //!< Enqueue -> cb_start
+	struct threadwq_hist run; //!< cb_start -> cb_start returns. cb_finish may come later (completion mode).
+};
+
+struct threadwq_latency
+{
+	struct threadwq_pct wait;
+	struct threadwq_pct run;
+};
+
+/*
+ * Deadline counters of one worker. Jobs w/o a deadline are not counted.
+ */
+struct threadwq_edf_stat
+{
+	unsigned long nr; //!< Jobs w/ a deadline, taken out of the heap.
+	unsigned long late; //!< Run after the deadline (THREADWQ_EDF_RUN).
+	unsigned long expired; //!< Dropped or called back (THREADWQ_EDF_DROP/CALL).
+};
+
+struct threadwq_edf;
+struct threadwq_aio_ring;
+
+/*
+ * Fields are grouped by who writes them, so producers and the worker do not false-share:
+ * - Read-mostly: Set up before threadwq_exec().
+ * - Producer side: Touched on every add. Bounces between the producers and the worker anyway.
+ * - Worker side: Written by the worker only, read now and then by others.
+ * The struct is cache-line aligned, so neighbours in an array never share a line either.
+ */
 struct threadwq
 {
+	/*
+	 * Read-mostly
+	 */
 	unsigned int exit;
 	unsigned int exit_ack;
 	unsigned int running;
 
 	pthread_t tid;
 	pthread_attr_t attr;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 
-	struct cds_lfq_queue_rcu lfq;
+	int efd; //!< eventfd to park/wake the worker.
+
+	threadwq_queue_t queue;
+	unsigned int nr_prio; //!< Priority classes in use. Default: 1
+	unsigned int prio_weight; //!< Anti-starvation weight. 0: Strict priority.
+	unsigned int stat; //!< THREADWQ_STAT_*: Timestamp jobs at enqueue.
+	struct threadwq_lat_hist *hist; //!< NULL: Off.
+	struct threadwq_edf *edf; //!< NULL: FIFO. See threadwq_set_edf().
+	struct threadwq_aio_ring *aio; //!< NULL: No async I/O. See threadwq_set_aio().
 
 	struct threadwq_ops ops;
 
-	unsigned int busy;
+	unsigned long depth_max; //!< 0: Unbounded. See threadwq_set_depth_max().
+	unsigned int drain_batch; //!< Max jobs to detach per round. See threadwq_set_drain_batch().
+
+	/*
+	 * Work-stealing. See threadwq_set_steal_multi().
+	 */
+	struct threadwq *sibling_tbl; //!< NULL: Stealing is disabled.
+	unsigned int sibling_nr;
+	unsigned int steal_batch;
+
+	/*
+	 * Shared pool. See threadwq_set_shared_multi().
+	 */
+	struct threadwq *src; //!< The twq whose queue this worker drains. Itself, or the head of a shared pool.
+	unsigned int shared;
+
+	/*
+	 * Placement. See threadwq_set_cpuset() and threadwq_spread_multi().
+	 */
+	cpu_set_t cpuset;
+	unsigned int has_cpuset;
+	int node; //!< NUMA node of the cpuset. -1: Unknown, or across nodes.
+
+	/*
+	 * Producer side
+	 */
+	unsigned int sleeping __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< 1: The worker is parked (or going to park) and needs a wakeup.
+	unsigned long depth; //!< Queued jobs. Never less than the real queue length.
+	unsigned int space_waiter; //!< Producers blocked in threadwq_add_job_wait().
+
+	/*
+	 * Flush. See threadwq_flush().
+	 */
+	unsigned long inflight[2]; //!< Added jobs whose cb_finish has not returned, per epoch.
+	unsigned int flush_epoch; //!< Epoch new jobs are counted in.
+	unsigned int flush_waiter; //!< Threads blocked in threadwq_flush().
+
+	/*
+	 * Queues. An lfq keeps its head and tail in one struct. A ring keeps them on their own lines.
+	 */
+	struct cds_lfq_queue_rcu lfq[THREADWQ_PRIO_NR] __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< One queue per priority class.
+	struct threadwq_ring ring[THREADWQ_PRIO_NR];
+
+	/*
+	 * Worker side
+	 */
+	unsigned int busy __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< Load signal: busy = busy / 2 + jobs, updated per drained batch or idle round.
+	unsigned long stolen; //!< Jobs this worker stole from siblings.
+	int32_t space_seq; //!< futex. Bumped when the worker frees space for waiters.
+	int32_t flush_seq; //!< futex. Bumped when an epoch drains while someone waits.
+	struct threadwq_prio prio[THREADWQ_PRIO_NR]; //!< depth is bumped by producers (nr_prio > 1 only).
+	struct threadwq_job *spill_head; //!< Jobs this worker added while their ring was full. Worker only.
+	struct threadwq_job *spill_tail;
+
+	pthread_mutex_t flush_lock; //!< One flush at a time flips the epoch.
 };
 
+struct threadwq *threadwq_alloc_multi(const unsigned int nr, const int node);
+void threadwq_free_multi(struct threadwq *twq_tbl);
 int threadwq_init(struct threadwq *twq);
 int threadwq_init_multi(struct threadwq *twq_tbl, const unsigned int nr);
+int threadwq_init_ring(struct threadwq *twq, const unsigned int nr_slot);
+int threadwq_init_multi_ring(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int nr_slot);
 void threadwq_exit(struct threadwq *twq);
+void threadwq_stop(struct threadwq *twq);
 void threadwq_exit_multi(struct threadwq *twq_tbl, const unsigned int nr);
 void threadwq_set_ops(struct threadwq *twq, const struct threadwq_ops *ops);
 void threadwq_set_ops_multi(struct threadwq *twq_tbl, const struct threadwq_ops *ops, const unsigned int nr);
 int threadwq_exec(struct threadwq *twq);
 int threadwq_exec_multi(struct threadwq *twq_tbl, const unsigned int nr);
+int threadwq_set_steal_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int batch);
+int threadwq_set_shared_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int batch);
+int threadwq_set_drain_batch(struct threadwq *twq, const unsigned int batch);
+int threadwq_set_cpuset(struct threadwq *twq, const cpu_set_t *set);
+int threadwq_set_prio(struct threadwq *twq, const unsigned int nr_prio, const unsigned int weight, const unsigned int stat);
+int threadwq_set_prio_multi(struct threadwq *twq_tbl, const unsigned int nr,
+	const unsigned int nr_prio, const unsigned int weight, const unsigned int stat);
+void threadwq_get_prio_stat(struct threadwq *twq, const unsigned int prio, struct threadwq_prio_stat *st);
+int threadwq_spread_multi(struct threadwq *twq_tbl, const unsigned int nr);
+struct threadwq *threadwq_self(void);
+int threadwq_set_depth_max(struct threadwq *twq, const unsigned long max);
+int threadwq_set_depth_max_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned long max);
+int threadwq_add_job_wait(struct threadwq *twq, struct threadwq_job *job, const unsigned int timeout_ms);
+void threadwq_flush(struct threadwq *twq);
+void threadwq_flush_multi(struct threadwq *twq_tbl, const unsigned int nr);
+int threadwq_set_hist(struct threadwq *twq);
+int threadwq_set_hist_multi(struct threadwq *twq_tbl, const unsigned int nr);
+void threadwq_get_latency(struct threadwq *twq, struct threadwq_latency *lat);
+void threadwq_get_latency_multi(struct threadwq *twq_tbl, const unsigned int nr, struct threadwq_latency *lat);
+int threadwq_set_edf(struct threadwq *twq, const unsigned int cap, const threadwq_edf_miss_t miss,
+	void (*cb_expired)(struct threadwq_job *job, void *priv));
+int threadwq_set_edf_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int cap,
+	const threadwq_edf_miss_t miss, void (*cb_expired)(struct threadwq_job *job, void *priv));
+void threadwq_get_edf_stat(struct threadwq *twq, struct threadwq_edf_stat *st);
+
+void __threadwq_wakeup(struct threadwq *twq);
+void __threadwq_spill(struct threadwq *self, struct threadwq_job *job);
+void __threadwq_put_inflight(struct threadwq *twq, const unsigned int e);
 
+/*!
+ * \brief Wake up the worker if (and only if) it is parked.
+ *
+ * \details Pairs with the barrier in the worker parking path: Either the worker sees the new job before
+ *     it sleeps, or we see twq->sleeping here. A running worker costs no syscall.
+ */
 static inline __attribute__((unused))
-void threadwq_add_job_locked(struct threadwq *twq, struct threadwq_job *job)
+void threadwq_wakeup(struct threadwq *twq)
 {
-	/*
-	 * Assume the mutex is acquired by caller.
-	 */
+	cmm_smp_mb();
+
+	if (caa_unlikely(CMM_LOAD_SHARED(twq->sleeping)))
+	{
+		if (uatomic_xchg(&twq->sleeping, 0))
+		{
+			__threadwq_wakeup(twq);
+		}
+	}
+}
+
+/*
+ * Count one in the current flush epoch. Return the epoch, for __threadwq_put_inflight() once it is done.
+ *
+ * A flush may flip the epoch between the load and the inc, and see the old counter drained before the inc
+ * lands. Re-read it after the inc (pairs w/ the mb after the flip in threadwq_flush_multi()): Either the
+ * flush sees the inc, or we see the new epoch, give the old count back and count in the new one.
+ */
+static inline __attribute__((unused))
+unsigned int __threadwq_get_inflight(struct threadwq *twq)
+{
+	unsigned int e = CMM_LOAD_SHARED(twq->flush_epoch), cur;
+
+	for (;;)
+	{
+		uatomic_inc(&twq->inflight[e]);
+		cmm_smp_mb__after_uatomic_inc();
+
+		cur = CMM_LOAD_SHARED(twq->flush_epoch);
+		if (caa_likely(cur == e))
+		{
+			return e;
+		}
+
+		__threadwq_put_inflight(twq, e);
+		e = cur;
+	}
+}
+
+static inline __attribute__((unused))
+unsigned int threadwq_job_class(const struct threadwq *twq, const struct threadwq_job *job)
+{
+	return job->prio < twq->nr_prio ? job->prio : twq->nr_prio - 1;
+}
+
+/*
+ * Enqueue one job into its class queue. Plz hold rcu read-side lock for lfq.
+ *
+ * A full ring: Make sure the worker is draining and retry. A worker never waits for a ring, though: It may be
+ * the only one who drains it (its own, or a sibling which waits for its ring in turn). Its job goes to its
+ * spill list and is pushed (or run) at its next round.
+ * Every job is counted in the current flush epoch until its cb_finish returns.
+ */
+static inline __attribute__((unused))
+void __threadwq_enqueue(struct threadwq *twq, struct threadwq_job *job)
+{
+	unsigned int c = 0;
+
 	BUG_ON(job == NULL);
 
+	job->twq = twq;
+	job->epoch = __threadwq_get_inflight(twq); // Before enqueue. cb_finish must not see it uncounted.
+
+	if (caa_unlikely(twq->nr_prio > 1))
+	{
+		c = threadwq_job_class(twq, job);
+		uatomic_inc(&twq->prio[c].depth);
+	}
+
+	if (caa_unlikely(twq->stat))
+	{
+		job->ts_enq = tm_mono_ns();
+	}
+
+	if (twq->queue == THREADWQ_QUEUE_RING)
+	{
+		while (caa_unlikely(threadwq_ring_enqueue(&twq->ring[c], job)))
+		{
+			struct threadwq *self = threadwq_self();
+
+			if (self)
+			{
+				__threadwq_spill(self, job);
+				return;
+			}
+
+			threadwq_wakeup(twq);
+			caa_cpu_relax();
+		}
+		return;
+	}
+
+	cds_lfq_enqueue_rcu(&twq->lfq[c], &job->lfq_node);
+}
+
+/*
+ * Enqueue w/o touching depth. The caller has counted it.
+ */
+static inline __attribute__((unused))
+void __threadwq_push(struct threadwq *twq, struct threadwq_job *job)
+{
+	if (twq->queue == THREADWQ_QUEUE_RING)
+	{
+		__threadwq_enqueue(twq, job); // No rcu needed.
+		return;
+	}
+
 	rcu_read_lock();
-	cds_lfq_enqueue_rcu(&twq->lfq, &job->lfq_node);
+	__threadwq_enqueue(twq, job);
 	rcu_read_unlock();
+}
+
+/*
+ * The adds below go into the queue which the worker of twq drains: twq->src. It is twq itself, or the head of
+ * a shared pool (threadwq_set_shared_multi()). The wakeup still goes to the worker of twq.
+ */
+
+static inline __attribute__((unused))
+void threadwq_add_job_nowake(struct threadwq *twq, struct threadwq_job *job)
+{
+	struct threadwq *q = twq->src;
 
-//	pthread_cond_signal(&twq->cond); // CAUTION: Plz send signal at caller, too.
+	/*
+	 * Enqueue only. Plz call threadwq_wakeup() at caller.
+	 */
+	uatomic_inc(&q->depth); // Before enqueue. Dequeue side must not see depth underflow.
+	__threadwq_push(q, job);
 }
 
 static inline __attribute__((unused))
 void threadwq_add_job(struct threadwq *twq, struct threadwq_job *job)
 {
-	BUG_ON(job == NULL);
+	threadwq_add_job_nowake(twq, job);
+	threadwq_wakeup(twq);
+}
 
-	rcu_read_lock();
-	cds_lfq_enqueue_rcu(&twq->lfq, &job->lfq_node);
-	rcu_read_unlock();
+static inline __attribute__((unused))
+void threadwq_add_jobs_nowake(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	struct threadwq *q = twq->src;
+	unsigned int i;
 
 	/*
-	 * * NOTE: If the worker is not waiting, we might get a latency.
+	 * Enqueue only. Plz call threadwq_wakeup() at caller.
 	 */
-#if THREADWQ_BLOCKED_ENQUEUE
-	pthread_mutex_lock(&twq->mutex);
-	pthread_cond_signal(&twq->cond);
-	pthread_mutex_unlock(&twq->mutex);
-#elif THREADWQ_NONBLOCKED_ENQUEUE
-	pthread_cond_signal(&twq->cond);
-#else
-#error "fixme"
-#endif
+	BUG_ON(job_tbl == NULL);
+
+	uatomic_add(&q->depth, nr);
+
+	if (q->queue == THREADWQ_QUEUE_RING)
+	{
+		for (i = 0; i < nr; i++)
+		{
+			__threadwq_enqueue(q, job_tbl[i]);
+		}
+		return;
+	}
+
+	rcu_read_lock();
+	for (i = 0; i < nr; i++)
+	{
+		__threadwq_enqueue(q, job_tbl[i]);
+	}
+	rcu_read_unlock();
+}
+
+/*!
+ * \brief Add a batch of jobs into twq, and wake up the worker at most once.
+ *
+ * \details The rcu read-side lock and the wakeup are paid once per batch instead of once per job.
+ */
+static inline __attribute__((unused))
+void threadwq_add_jobs(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	if (caa_unlikely(nr == 0))
+	{
+		return;
+	}
+
+	threadwq_add_jobs_nowake(twq, job_tbl, nr);
+	threadwq_wakeup(twq);
+}
+
+/*!
+ * \brief 1 if twq has a depth limit and reached it.
+ */
+static inline __attribute__((unused))
+int threadwq_full(const struct threadwq *twq)
+{
+	const struct threadwq *q = twq->src;
+
+	return q->depth_max && CMM_LOAD_SHARED(q->depth) >= q->depth_max;
+}
+
+/*
+ * Reserve nr in depth. Fail if it goes over the limit.
+ *
+ * Commit only if depth + nr fits: A reserve never takes depth over the limit, not even for a moment, so it never
+ * fails because of another one which is going to back off.
+ */
+static inline __attribute__((unused))
+int __threadwq_reserve(struct threadwq *twq, const unsigned int nr)
+{
+	const unsigned long max = CMM_LOAD_SHARED(twq->depth_max);
+	unsigned long old, cur;
+
+	if (!max)
+	{
+		uatomic_add(&twq->depth, nr);
+		return 0;
+	}
+
+	old = CMM_LOAD_SHARED(twq->depth);
+	for (;;)
+	{
+		if (old + nr > max)
+		{
+			return -EAGAIN;
+		}
+
+		cur = uatomic_cmpxchg(&twq->depth, old, old + nr);
+		if (cur == old)
+		{
+			return 0;
+		}
+		old = cur;
+	}
+}
+
+/*!
+ * \brief Add a job unless twq is full.
+ *
+ * \return 0: Added. -EAGAIN: twq is at its depth limit. The job is untouched.
+ */
+static inline __attribute__((unused))
+int threadwq_try_add_job(struct threadwq *twq, struct threadwq_job *job)
+{
+	struct threadwq *q = twq->src;
+
+	if (__threadwq_reserve(q, 1))
+	{
+		return -EAGAIN;
+	}
+
+	__threadwq_push(q, job);
+	threadwq_wakeup(twq);
+
+	return 0;
+}
+
+/*!
+ * \brief Add all jobs, or none of them if they do not fit. Enqueue only: Plz call threadwq_wakeup() at caller.
+ *
+ * \return 0: Added. -EAGAIN: Not enough space.
+ */
+static inline __attribute__((unused))
+int threadwq_try_add_jobs_nowake(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	struct threadwq *q = twq->src;
+	unsigned int i;
+
+	if (caa_unlikely(nr == 0))
+	{
+		return 0;
+	}
+
+	if (__threadwq_reserve(q, nr))
+	{
+		return -EAGAIN;
+	}
+
+	if (q->queue == THREADWQ_QUEUE_RING)
+	{
+		for (i = 0; i < nr; i++)
+		{
+			__threadwq_enqueue(q, job_tbl[i]);
+		}
+	}
+	else
+	{
+		rcu_read_lock();
+		for (i = 0; i < nr; i++)
+		{
+			__threadwq_enqueue(q, job_tbl[i]);
+		}
+		rcu_read_unlock();
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Add all jobs, or none of them if they do not fit.
+ *
+ * \return 0: Added. -EAGAIN: Not enough space.
+ */
+static inline __attribute__((unused))
+int threadwq_try_add_jobs(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	if (caa_unlikely(nr == 0))
+	{
+		return 0;
+	}
+
+	if (threadwq_try_add_jobs_nowake(twq, job_tbl, nr))
+	{
+		return -EAGAIN;
+	}
+
+	threadwq_wakeup(twq);
+
+	return 0;
 }
 
 
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <urcu.h>
+
+#include "lgu/lgu.h"
+#include "threadwq.h"
+#include "threadwq_aio.h"
+
+/*
+ * One io_uring per worker. Only the owner touches it, so no lock: Submit from the jobs it runs, reap in
+ * its loop. Raw syscalls, w/o liburing.
+ */
+struct threadwq_aio_ring
+{
+	int fd;
+
+	unsigned int *sq_khead;
+	unsigned int *sq_ktail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_khead;
+	unsigned int *cq_ktail;
+	unsigned int cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+
+	unsigned int sq_tail; //!< Prepared
+	unsigned int sq_sent; //!< Taken by the kernel
+	unsigned int inflight; //!< Ops w/o a reaped completion.
+	unsigned int refuse; //!< Test only: Submits left to fail as if the kernel said EAGAIN.
+
+	struct threadwq_aio *done_head; //!< Reaped, not run yet. FIFO.
+	struct threadwq_aio *done_tail;
+
+	void *sq_ptr;
+	size_t sq_sz;
+	void *cq_ptr;
+	size_t cq_sz;
+	size_t sqes_sz;
+};
+
+static void ring_unmap(struct threadwq_aio_ring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+	{
+		munmap(ring->sqes, ring->sqes_sz);
+	}
+
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+	{
+		munmap(ring->cq_ptr, ring->cq_sz);
+	}
+
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+	{
+		munmap(ring->sq_ptr, ring->sq_sz);
+	}
+
+	close(ring->fd);
+}
+
+static struct threadwq_aio_ring *ring_create(const unsigned int entries, const int efd)
+{
+	struct threadwq_aio_ring *ring = calloc(1, sizeof(*ring));
+	struct io_uring_params p;
+	unsigned int *array, i;
+
+	if (!ring)
+	{
+		ERR("Cannot alloc aio ring");
+		return NULL;
+	}
+
+	memset(&p, 0x00, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+	{
+		ERR("Cannot setup io_uring w/ %u entries %s", entries, strerror(errno));
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->sq_sz = ring->cq_sz = (ring->sq_sz > ring->cq_sz) ? ring->sq_sz : ring->cq_sz;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+	{
+		goto err;
+	}
+
+	ring->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ptr :
+		mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED)
+	{
+		goto err;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		goto err;
+	}
+
+	ring->sq_khead = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_ktail = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+
+	ring->cq_khead = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_ktail = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cq_entries = p.cq_entries;
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+	/*
+	 * Slot i always holds sqe i. The index array is never touched again.
+	 */
+	array = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.array);
+	for (i = 0; i < ring->sq_entries; i++)
+	{
+		array[i] = i;
+	}
+
+	ring->sq_tail = *ring->sq_ktail;
+	ring->sq_sent = ring->sq_tail;
+
+	/*
+	 * Completions post the eventfd of the twq: A parked worker wakes up to reap them.
+	 */
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &efd, 1))
+	{
+		ERR("Cannot register eventfd to io_uring %s", strerror(errno));
+		ring_unmap(ring);
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+
+err:
+	ERR("Cannot map io_uring %s", strerror(errno));
+	ring_unmap(ring);
+	free(ring);
+	return NULL;
+}
+
+/*!
+ * \brief Give the worker an io_uring. Call this before threadwq_exec().
+ *
+ * \param entries SQ size. 0: THREADWQ_AIO_ENTRIES_DFL. Clamped by the kernel.
+ */
+int threadwq_set_aio(struct threadwq *twq, const unsigned int entries)
+{
+	BUG_ON(twq->running);
+
+	if (twq->queue != THREADWQ_QUEUE_RING)
+	{
+		ERR("twq %p: aio needs a ring backend. lfq finishes jobs via rcu", twq);
+		return -1;
+	}
+
+	if (twq->aio)
+	{
+		ERR("twq %p has aio already", twq);
+		return -1;
+	}
+
+	twq->aio = ring_create(entries ? entries : THREADWQ_AIO_ENTRIES_DFL, twq->efd);
+
+	return twq->aio ? 0 : -1;
+}
+
+int threadwq_set_aio_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int entries)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+	{
+		if (threadwq_set_aio(&twq_tbl[i], entries))
+		{
+			return -1;
+		}
+	}
+
+	return 0; // ok
+}
+
+void __threadwq_aio_free(struct threadwq *twq)
+{
+	if (!twq->aio)
+	{
+		return;
+	}
+
+	if (twq->aio->inflight || twq->aio->done_head)
+	{
+		ERR("twq %p: Drop %u aio ops in flight", twq, twq->aio->inflight);
+	}
+
+	ring_unmap(twq->aio);
+	free(twq->aio);
+	twq->aio = NULL;
+}
+
+/*
+ * Hand prepared SQEs to the kernel. wait: Block for one completion at least.
+ */
+static void ring_enter(struct threadwq_aio_ring *ring, const unsigned int wait)
+{
+	unsigned int nr = ring->sq_tail - ring->sq_sent;
+	int ret;
+
+	if (nr == 0 && !wait)
+	{
+		return;
+	}
+
+	cmm_smp_wmb(); // SQEs before tail
+	CMM_STORE_SHARED(*ring->sq_ktail, ring->sq_tail);
+
+	if (caa_unlikely(ring->refuse))
+	{
+		ring->refuse--;
+		errno = EAGAIN;
+		ret = -1;
+	}
+	else
+	{
+		ret = syscall(__NR_io_uring_enter, ring->fd, nr, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}
+
+	if (ret < 0)
+	{
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			ERR("Cannot enter io_uring %s", strerror(errno));
+		}
+		return; // Retry next round. Unsent SQEs post no eventfd: The worker parks w/ a timeout meanwhile.
+	}
+
+	ring->sq_sent += ret;
+}
+
+/*
+ * A free sqe of the calling worker. NULL: Not a worker w/ aio, or the ring is full.
+ */
+static struct io_uring_sqe *sqe_get(struct threadwq_aio_ring **ringp, int *err)
+{
+	struct threadwq *self = threadwq_self();
+	struct threadwq_aio_ring *ring;
+	struct io_uring_sqe *sqe;
+
+	if (!self || !self->aio)
+	{
+		ERR("Submit aio from a worker w/ threadwq_set_aio() only");
+		*err = -EINVAL;
+		return NULL;
+	}
+
+	ring = self->aio;
+
+	if (ring->inflight >= ring->cq_entries)
+	{
+		*err = -EAGAIN; // The CQ could overflow.
+		return NULL;
+	}
+
+	if (ring->sq_tail - CMM_LOAD_SHARED(*ring->sq_khead) >= ring->sq_entries)
+	{
+		ring_enter(ring, 0);
+		if (ring->sq_tail - CMM_LOAD_SHARED(*ring->sq_khead) >= ring->sq_entries)
+		{
+			*err = -EAGAIN;
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sq_tail & ring->sq_mask];
+	memset(sqe, 0x00, sizeof(*sqe));
+
+	*ringp = ring;
+
+	return sqe;
+}
+
+/*
+ * The op is in. Count the aio job in the flush epoch now, as an enqueue would.
+ */
+static void sqe_commit(struct threadwq_aio_ring *ring, struct io_uring_sqe *sqe, struct threadwq_aio *aio)
+{
+	struct threadwq *self = threadwq_self();
+
+	sqe->user_data = (uint64_t) (uintptr_t) aio;
+
+	aio->epoch = __threadwq_get_inflight(self);
+
+	ring->sq_tail++;
+	ring->inflight++;
+}
+
+/*!
+ * \brief Same as threadwq_job_init(). The job finishes inline, so it may submit again from its cb_start.
+ */
+void threadwq_aio_init(struct threadwq_aio *aio,
+	void (*cb_start)(struct threadwq_job *job, void *priv),
+	void (*cb_finish)(struct threadwq_job *job, void *priv),
+	void *priv)
+{
+	threadwq_job_init(&aio->job, cb_start, cb_finish, priv);
+	threadwq_job_set_finish(&aio->job, THREADWQ_FINISH_INLINE);
+	aio->res = 0;
+	aio->epoch = 0;
+	aio->next = NULL;
+}
+
+/*!
+ * \brief pread(). From a worker only. The aio job runs w/ the result.
+ *
+ * \return 0: Submitted. -EAGAIN: The ring is full; retry later. -EINVAL: Not a worker w/ aio.
+ */
+int threadwq_aio_read(struct threadwq_aio *aio, const int fd, void *buf, const unsigned int len, const uint64_t off)
+{
+	struct threadwq_aio_ring *ring;
+	struct io_uring_sqe *sqe;
+	int err;
+
+	sqe = sqe_get(&ring, &err);
+	if (!sqe)
+	{
+		return err;
+	}
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = off;
+
+	sqe_commit(ring, sqe, aio);
+
+	return 0; // ok
+}
+
+/*!
+ * \brief pwrite(). See threadwq_aio_read().
+ */
+int threadwq_aio_write(struct threadwq_aio *aio, const int fd, const void *buf, const unsigned int len,
+	const uint64_t off)
+{
+	struct threadwq_aio_ring *ring;
+	struct io_uring_sqe *sqe;
+	int err;
+
+	sqe = sqe_get(&ring, &err);
+	if (!sqe)
+	{
+		return err;
+	}
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = off;
+
+	sqe_commit(ring, sqe, aio);
+
+	return 0; // ok
+}
+
+/*!
+ * \brief openat(). The result is the fd. path must live until the job runs. See threadwq_aio_read().
+ */
+int threadwq_aio_openat(struct threadwq_aio *aio, const int dfd, const char *path, const int flags,
+	const mode_t mode)
+{
+	struct threadwq_aio_ring *ring;
+	struct io_uring_sqe *sqe;
+	int err;
+
+	sqe = sqe_get(&ring, &err);
+	if (!sqe)
+	{
+		return err;
+	}
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dfd;
+	sqe->addr = (uint64_t) (uintptr_t) path;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+
+	sqe_commit(ring, sqe, aio);
+
+	return 0; // ok
+}
+
+/*!
+ * \brief close(). See threadwq_aio_read().
+ */
+int threadwq_aio_close(struct threadwq_aio *aio, const int fd)
+{
+	struct threadwq_aio_ring *ring;
+	struct io_uring_sqe *sqe;
+	int err;
+
+	sqe = sqe_get(&ring, &err);
+	if (!sqe)
+	{
+		return err;
+	}
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+
+	sqe_commit(ring, sqe, aio);
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Ops in flight or completed jobs not run yet. Unsent SQEs are in flight too.
+ */
+unsigned int __threadwq_aio_busy(struct threadwq *twq)
+{
+	return twq->aio->inflight + (twq->aio->done_head != NULL) + (twq->aio->sq_tail != twq->aio->sq_sent);
+}
+
+/*!
+ * \brief SQEs the kernel did not take yet (EAGAIN/EBUSY). They complete nothing, so nothing posts the eventfd.
+ */
+unsigned int __threadwq_aio_unsent(struct threadwq *twq)
+{
+	return twq->aio->sq_tail - twq->aio->sq_sent;
+}
+
+/*!
+ * \brief Test only: Fail the next nr submits of the twq w/ EAGAIN. Before threadwq_exec().
+ */
+void __threadwq_aio_refuse(struct threadwq *twq, const unsigned int nr)
+{
+	BUG_ON(twq->running);
+
+	twq->aio->refuse = nr;
+}
+
+/*
+ * Move every CQE into the completion list: The CQ never overflows while jobs wait to run.
+ */
+static void ring_reap(struct threadwq_aio_ring *ring)
+{
+	unsigned int head = *ring->cq_khead, tail;
+	struct io_uring_cqe *cqe;
+	struct threadwq_aio *aio;
+
+	tail = CMM_LOAD_SHARED(*ring->cq_ktail);
+	if (head == tail)
+	{
+		return;
+	}
+	cmm_smp_rmb(); // tail before cqes
+
+	for (; head != tail; head++)
+	{
+		cqe = &ring->cqes[head & ring->cq_mask];
+		aio = (struct threadwq_aio *) (uintptr_t) cqe->user_data;
+		aio->res = cqe->res;
+		aio->next = NULL;
+
+		if (ring->done_tail)
+		{
+			ring->done_tail->next = aio;
+		}
+		else
+		{
+			ring->done_head = aio;
+		}
+		ring->done_tail = aio;
+
+		ring->inflight--;
+	}
+
+	cmm_smp_mb(); // cqes read before the slots are given back
+	CMM_STORE_SHARED(*ring->cq_khead, head);
+}
+
+/*!
+ * \brief Submit what the last round prepared, reap completions, and take up to max jobs to run.
+ *
+ * \details Owner only. wait: Block until one op completes (exit drain).
+ */
+unsigned int __threadwq_aio_reap(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int max,
+	const unsigned int wait)
+{
+	struct threadwq_aio_ring *ring = twq->aio;
+	struct threadwq_aio *aio;
+	unsigned int nr = 0;
+
+	ring_enter(ring, wait && ring->inflight && !ring->done_head);
+	ring_reap(ring);
+
+	while (nr < max && (aio = ring->done_head))
+	{
+		ring->done_head = aio->next;
+		if (!ring->done_head)
+		{
+			ring->done_tail = NULL;
+		}
+
+		/*
+		 * As if dequeued from this twq. The previous slice of the job is finished by now.
+		 */
+		aio->job.twq = twq;
+		aio->job.epoch = aio->epoch;
+		if (caa_unlikely(twq->stat))
+		{
+			aio->job.ts_enq = tm_mono_ns();
+		}
+
+		job_tbl[nr++] = &aio->job;
+	}
+
+	return nr;
+}
@@ -0,0 +1,84 @@
+/*!
+ * \file threadwq_aio.h
+ * \brief Async I/O jobs: Each worker owns an io_uring. A job submits reads/writes/opens and goes on; the
+ *     worker runs the aio job w/ the result once the op completes.
+ *
+ * \details Submit from a worker only: The op goes into the ring of that worker, and so does its completion.
+ *     SQEs are sent to the kernel once per round, in one syscall. The worker reaps completions at the top of
+ *     every round and runs their jobs before the queue; the ring posts the eventfd of the twq, so a parked
+ *     worker wakes up for them.
+ *
+ *     An aio job finishes inline, so it may submit its next op from its own cb_start (open, then read, then
+ *     close...). Otherwise it must be idle: Not queued, no op in flight. Buffers and paths must live until
+ *     the op completes. threadwq_flush() waits for ops in flight too.
+ *
+ *     Ring backend only. Set aio on every twq of a stealing or shared pool: An aio job may run anywhere.
+ *
+ * \par Example:
+ * \code
+	threadwq_set_aio_multi(twq, TWQNUM, 0);
+	...
+	static void cb_start(struct threadwq_job *job, void *priv)
+	{
+		struct threadwq_aio *aio = caa_container_of(job, struct threadwq_aio, job);
+
+		if (threadwq_aio_res(aio) < 0) ...
+		threadwq_aio_read(aio, fd, buf, len, 0); // Runs cb_start again w/ the result.
+	}
+ * \endcode
+ */
+#ifndef SRC_THREADWQ_THREADWQ_AIO_H_
+#define SRC_THREADWQ_THREADWQ_AIO_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "threadwq/threadwq.h"
+
+#define THREADWQ_AIO_ENTRIES_DFL (256) //!< SQ size per worker. The CQ is twice as large.
+#define THREADWQ_AIO_RETRY_US (1000) //!< Max park while the kernel refuses SQEs. They are resent every round.
+
+struct threadwq_aio
+{
+	struct threadwq_job job; //!< Run w/ the result. Set prio/key on it as usual.
+
+	int res; //!< Bytes, a fd, or -errno. See threadwq_aio_res().
+	unsigned int epoch; //!< Flush epoch at submit. job.epoch may still belong to the running slice.
+	struct threadwq_aio *next; //!< Completion list of the worker.
+};
+
+void threadwq_aio_init(struct threadwq_aio *aio,
+	void (*cb_start)(struct threadwq_job *job, void *priv),
+	void (*cb_finish)(struct threadwq_job *job, void *priv),
+	void *priv);
+
+int threadwq_set_aio(struct threadwq *twq, const unsigned int entries);
+int threadwq_set_aio_multi(struct threadwq *twq_tbl, const unsigned int nr, const unsigned int entries);
+
+int threadwq_aio_read(struct threadwq_aio *aio, const int fd, void *buf, const unsigned int len, const uint64_t off);
+int threadwq_aio_write(struct threadwq_aio *aio, const int fd, const void *buf, const unsigned int len,
+	const uint64_t off);
+int threadwq_aio_openat(struct threadwq_aio *aio, const int dfd, const char *path, const int flags,
+	const mode_t mode);
+int threadwq_aio_close(struct threadwq_aio *aio, const int fd);
+
+/*!
+ * \brief Result of the last op: Bytes, a fd, or -errno. Valid in cb_start of the completed job.
+ */
+static inline __attribute__((unused))
+int threadwq_aio_res(const struct threadwq_aio *aio)
+{
+	return aio->res;
+}
+
+/*
+ * Worker side. See thread_func().
+ */
+unsigned int __threadwq_aio_reap(struct threadwq *twq, struct threadwq_job **job_tbl, const unsigned int max,
+	const unsigned int wait);
+unsigned int __threadwq_aio_busy(struct threadwq *twq);
+unsigned int __threadwq_aio_unsent(struct threadwq *twq);
+void __threadwq_aio_refuse(struct threadwq *twq, const unsigned int nr);
+void __threadwq_aio_free(struct threadwq *twq);
+
+#endif /* SRC_THREADWQ_THREADWQ_AIO_H_ */
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <urcu.h>
+#include <urcu/list.h>
+
+#include "lgu/lgu.h"
+#include "threadwq.h"
+#include "threadwq_dag.h"
+
+/*
+ * A graph cannot drop a task. If every twq is at its depth limit, go over the limit: A worker never blocks on a
+ * full ring (it spills, see __threadwq_enqueue()).
+ */
+static inline void submit_one(struct threadwq_dag *dag, struct threadwq *self, struct threadwq_job *job)
+{
+	if (threadwq_man_add_job(dag->man, job))
+	{
+		threadwq_add_job(self ? self : &dag->man->twq_pool[0], job);
+	}
+}
+
+/*
+ * Submit ready successors from a worker. Local adds never wait: A full local twq sends them via the man.
+ *
+ * w/ stealing: All go to the local twq. Idle siblings steal the surplus.
+ * w/o stealing: Only the first one stays local. The rest are spread via the man, or a wide fan-out runs serially.
+ */
+static void submit_ready(struct threadwq_dag *dag, struct threadwq *self,
+	struct threadwq_job **job_tbl, unsigned int nr, unsigned int *local)
+{
+	unsigned int i = 0;
+
+	if (self && self->sibling_tbl)
+	{
+		if (!threadwq_try_add_jobs(self, job_tbl, nr))
+		{
+			return;
+		}
+	}
+	else if (self && !*local)
+	{
+		if (!threadwq_try_add_job(self, job_tbl[0]))
+		{
+			*local = 1;
+			i = 1;
+		}
+	}
+
+	for (; i < nr; i++)
+	{
+		submit_one(dag, self, job_tbl[i]);
+	}
+}
+
+static void task_start(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_task *task = caa_container_of(job, struct threadwq_task, job), *succ;
+	struct threadwq_job *ready_tbl[THREADWQ_DAG_READY_BATCH];
+	struct threadwq *self;
+	unsigned int i, nr = 0, local = 0;
+
+	task->cb_run(task, priv);
+
+	if (task->succ_nr == 0)
+	{
+		return;
+	}
+
+	self = threadwq_self();
+
+	for (i = 0; i < task->succ_nr; i++)
+	{
+		succ = task->succ_tbl[i];
+		if (uatomic_sub_return(&succ->npred, 1) != 0)
+		{
+			continue;
+		}
+
+		ready_tbl[nr++] = &succ->job;
+		if (nr == THREADWQ_DAG_READY_BATCH)
+		{
+			submit_ready(task->dag, self, ready_tbl, nr, &local);
+			nr = 0;
+		}
+	}
+
+	if (nr)
+	{
+		submit_ready(task->dag, self, ready_tbl, nr, &local);
+	}
+}
+
+static void task_finish(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_task *task = caa_container_of(job, struct threadwq_task, job);
+	struct threadwq_dag *dag = task->dag;
+
+	if (uatomic_sub_return(&dag->pending, 1) == 0 && dag->cb_done)
+	{
+		dag->cb_done(dag, dag->priv);
+	}
+}
+
+void threadwq_dag_init(struct threadwq_dag *dag, struct threadwq_man *man,
+	void (*cb_done)(struct threadwq_dag *dag, void *priv), void *priv)
+{
+	BUG_ON(dag == NULL || man == NULL);
+
+	dag->man = man;
+	dag->cb_done = cb_done;
+	dag->priv = priv;
+	dag->nr = 0;
+	dag->pending = 0;
+	CDS_INIT_LIST_HEAD(&dag->task_list);
+}
+
+/*!
+ * \brief Release the dependency tables. The tasks themselves belong to the caller.
+ */
+void threadwq_dag_exit(struct threadwq_dag *dag)
+{
+	struct threadwq_task *task, *tmp;
+
+	if (uatomic_read(&dag->pending))
+	{
+		ERR("dag %p is still running w/ %lu tasks", dag, uatomic_read(&dag->pending));
+		BUG();
+	}
+
+	cds_list_for_each_entry_safe(task, tmp, &dag->task_list, node)
+	{
+		free(task->succ_tbl);
+		task->succ_tbl = NULL;
+		task->succ_nr = 0;
+		task->succ_max = 0;
+		cds_list_del(&task->node);
+	}
+
+	dag->nr = 0;
+}
+
+/*!
+ * \brief Submit the roots. cb_done is called once every task is finished (cb_finish time).
+ *
+ * \details A dag can run again after cb_done. A cycle is only caught if it leaves no root; otherwise
+ *     the tasks on it never run, and cb_done never comes.
+ */
+int threadwq_dag_run(struct threadwq_dag *dag)
+{
+	struct threadwq_task *task;
+	unsigned long nr_root = 0;
+
+	if (uatomic_read(&dag->pending))
+	{
+		ERR("dag %p is running", dag);
+		return -1;
+	}
+
+	if (dag->nr == 0)
+	{
+		ERR("dag %p is empty", dag);
+		return -1;
+	}
+
+	cds_list_for_each_entry(task, &dag->task_list, node)
+	{
+		task->npred = task->npred_init;
+		cds_lfq_node_init_rcu(&task->job.lfq_node); // Reused across runs.
+
+		if (task->npred_init == 0)
+		{
+			nr_root++;
+		}
+	}
+
+	if (nr_root == 0)
+	{
+		ERR("dag %p has no root. Cycle?", dag);
+		return -1;
+	}
+
+	uatomic_set(&dag->pending, dag->nr);
+	cmm_smp_mb(); // Counters are ready before any task runs.
+
+	cds_list_for_each_entry(task, &dag->task_list, node)
+	{
+		if (task->npred_init == 0)
+		{
+			submit_one(dag, NULL, &task->job);
+		}
+	}
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Same as threadwq_job_init(). Add the task into dag.
+ *
+ * \details cb_run is the job body. Successors are released right after it returns.
+ */
+void threadwq_task_init(struct threadwq_task *task, struct threadwq_dag *dag,
+	void (*cb_run)(struct threadwq_task *task, void *priv), void *priv)
+{
+	BUG_ON(cb_run == NULL);
+
+	threadwq_job_init(&task->job, task_start, task_finish, priv);
+	task->cb_run = cb_run;
+	task->dag = dag;
+	task->npred = 0;
+	task->npred_init = 0;
+	task->succ_tbl = NULL;
+	task->succ_nr = 0;
+	task->succ_max = 0;
+
+	cds_list_add_tail(&task->node, &dag->task_list);
+	dag->nr++;
+}
+
+/*!
+ * \brief task starts after pred is done. Plz call it before threadwq_dag_run().
+ */
+int threadwq_task_depend(struct threadwq_task *task, struct threadwq_task *pred)
+{
+	BUG_ON(task->dag != pred->dag || task == pred);
+
+	if (pred->succ_nr == pred->succ_max)
+	{
+		unsigned int max = pred->succ_max ? pred->succ_max * 2 : 4;
+		struct threadwq_task **tbl = realloc(pred->succ_tbl, max * sizeof(*tbl));
+
+		if (!tbl)
+		{
+			ERR("Cannot alloc %u successors", max);
+			return -1;
+		}
+
+		pred->succ_tbl = tbl;
+		pred->succ_max = max;
+	}
+
+	pred->succ_tbl[pred->succ_nr++] = task;
+	task->npred_init++;
+
+	return 0; // ok
+}
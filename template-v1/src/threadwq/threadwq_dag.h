@@ -0,0 +1,71 @@
+/*!
+ * \file threadwq_dag.h
+ * \brief Run a graph of dependent jobs (DAG) on a threadwq_man.
+ *
+ * \details Each task counts its unfinished predecessors atomically. The worker that finishes a task
+ *     releases its successors, and submits the ready ones to its own twq, so they run on a warm cache.
+ *     Roots are submitted via the threadwq_man.
+ *
+ * \par Example:
+ * \code
+	threadwq_dag_init(&dag, &man, cb_done, NULL);
+	threadwq_task_init(&a1, &dag, cb_run, NULL);
+	threadwq_task_init(&a2, &dag, cb_run, NULL);
+	threadwq_task_init(&b, &dag, cb_run, NULL);
+	threadwq_task_depend(&b, &a1); // b after a1
+	threadwq_task_depend(&b, &a2); // b after a2
+	threadwq_dag_run(&dag); // cb_done is called after b is finished.
+	...
+	threadwq_dag_exit(&dag);
+ * \endcode
+ */
+#ifndef SRC_THREADWQ_THREADWQ_DAG_H_
+#define SRC_THREADWQ_THREADWQ_DAG_H_
+
+#include <urcu/list.h>
+
+#include "threadwq/threadwq.h"
+
+#define THREADWQ_DAG_READY_BATCH (64) //!< Max ready successors added to a twq at once.
+
+struct threadwq_dag;
+struct threadwq_task
+{
+	struct threadwq_job job; //!< Set prio/finish mode on it as usual.
+
+	void (*cb_run)(struct threadwq_task *task, void *priv);
+	struct threadwq_dag *dag;
+
+	unsigned long npred; //!< Unfinished predecessors. Counted down while running.
+	unsigned long npred_init;
+
+	struct threadwq_task **succ_tbl;
+	unsigned int succ_nr;
+	unsigned int succ_max;
+
+	struct cds_list_head node; //!< In dag->task_list
+};
+
+struct threadwq_dag
+{
+	struct threadwq_man *man; //!< Roots go here.
+
+	void (*cb_done)(struct threadwq_dag *dag, void *priv); //!< All tasks are finished. Called by a worker.
+	void *priv;
+
+	unsigned long nr; //!< Tasks
+	unsigned long pending; //!< Tasks not finished yet in this run.
+
+	struct cds_list_head task_list;
+};
+
+void threadwq_dag_init(struct threadwq_dag *dag, struct threadwq_man *man,
+	void (*cb_done)(struct threadwq_dag *dag, void *priv), void *priv);
+void threadwq_dag_exit(struct threadwq_dag *dag);
+int threadwq_dag_run(struct threadwq_dag *dag);
+
+void threadwq_task_init(struct threadwq_task *task, struct threadwq_dag *dag,
+	void (*cb_run)(struct threadwq_task *task, void *priv), void *priv);
+int threadwq_task_depend(struct threadwq_task *task, struct threadwq_task *pred);
+
+#endif /* SRC_THREADWQ_THREADWQ_DAG_H_ */
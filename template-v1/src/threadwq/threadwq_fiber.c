@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <urcu.h>
+
+#include "lgu/lgu.h"
+#include "threadwq.h"
+#include "threadwq_fiber.h"
+
+/*
+ * Fiber state. Written by the fiber itself; read by the worker after it switched back.
+ */
+enum
+{
+	FIBER_RUN = 0,
+	FIBER_PARK, //!< Waits for threadwq_fiber_resume().
+	FIBER_YIELD, //!< Requeue right away.
+	FIBER_NOSTACK, //!< Never started: Out of stacks. Wait for one, then retry.
+	FIBER_DONE,
+};
+
+void __threadwq_fiber_main(struct threadwq_fiber *f) __attribute__((noreturn, visibility("hidden")));
+
+#if defined(__x86_64__) && !defined(THREADWQ_FIBER_UCONTEXT)
+/*
+ * Push the callee-saved registers and the SSE/x87 control words, swap stacks, pop them. Everything else is
+ * clobbered by a call anyway (SysV ABI). No signal mask: Fibers share the one of their worker.
+ *
+ * A new fiber starts at __threadwq_fiber_boot w/ itself in r12. See ctx_make().
+ */
+void __threadwq_fiber_switch(void **from_sp, void *to_sp) __attribute__((visibility("hidden")));
+void __threadwq_fiber_boot(void) __attribute__((visibility("hidden")));
+
+__asm__(
+	".pushsection .text\n"
+	".globl __threadwq_fiber_switch\n"
+	".hidden __threadwq_fiber_switch\n"
+	".type __threadwq_fiber_switch, @function\n"
+	".p2align 4\n"
+	"__threadwq_fiber_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size __threadwq_fiber_switch, .-__threadwq_fiber_switch\n"
+	".globl __threadwq_fiber_boot\n"
+	".hidden __threadwq_fiber_boot\n"
+	".type __threadwq_fiber_boot, @function\n"
+	".p2align 4\n"
+	"__threadwq_fiber_boot:\n"
+	"	movq %r12, %rdi\n"
+	"	call __threadwq_fiber_main\n"
+	"	ud2\n"
+	".size __threadwq_fiber_boot, .-__threadwq_fiber_boot\n"
+	".popsection\n"
+);
+
+/*
+ * The first switch pops this frame and returns into __threadwq_fiber_boot w/ a 16-byte aligned stack.
+ */
+static void ctx_make(struct threadwq_fiber *f)
+{
+	uint64_t *top = (uint64_t *) ((char *) f->stack + f->pool->stack_size - 16);
+	uint32_t mxcsr;
+	uint16_t fpucw;
+
+	__asm__ __volatile__("stmxcsr %0\n\tfnstcw %1" : "=m" (mxcsr), "=m" (fpucw));
+
+	top[-1] = (uint64_t) (uintptr_t) __threadwq_fiber_boot; // ret
+	top[-2] = 0; // rbp
+	top[-3] = 0; // rbx
+	top[-4] = (uint64_t) (uintptr_t) f; // r12
+	top[-5] = 0; // r13
+	top[-6] = 0; // r14
+	top[-7] = 0; // r15
+	top[-8] = mxcsr | ((uint64_t) fpucw << 32);
+
+	f->ctx.sp = &top[-8];
+}
+
+static inline void ctx_switch(threadwq_fiber_ctx_t *from, threadwq_fiber_ctx_t *to)
+{
+	__threadwq_fiber_switch(&from->sp, to->sp);
+}
+#else
+/*
+ * makecontext() passes ints only.
+ */
+static void fiber_entry(unsigned int hi, unsigned int lo)
+{
+	__threadwq_fiber_main((struct threadwq_fiber *) (uintptr_t) (((uint64_t) hi << 32) | lo));
+}
+
+static void ctx_make(struct threadwq_fiber *f)
+{
+	getcontext(&f->ctx);
+	f->ctx.uc_stack.ss_sp = f->stack;
+	f->ctx.uc_stack.ss_size = f->pool->stack_size;
+	f->ctx.uc_link = NULL;
+	makecontext(&f->ctx, (void (*)(void)) fiber_entry, 2,
+		(unsigned int) ((uint64_t) (uintptr_t) f >> 32), (unsigned int) (uintptr_t) f);
+}
+
+static inline void ctx_switch(threadwq_fiber_ctx_t *from, threadwq_fiber_ctx_t *to)
+{
+	swapcontext(from, to);
+}
+#endif
+
+/*!
+ * \param stack_size 0: THREADWQ_FIBER_STACK_DFL. Rounded up to pages.
+ * \param max_free Free stacks kept for reuse.
+ */
+int threadwq_fiber_pool_init(struct threadwq_fiber_pool *pool, const size_t stack_size, const unsigned long max_free)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = stack_size ? stack_size : THREADWQ_FIBER_STACK_DFL;
+
+	memset(pool, 0x00, sizeof(*pool));
+
+	pool->stack_size = (size + page - 1) / page * page;
+	pool->max_free = max_free;
+
+	if (pthread_mutex_init(&pool->lock, NULL))
+	{
+		ERR("Cannot init fiber pool lock");
+		return -1;
+	}
+
+	return 0; // ok
+}
+
+static void stack_unmap(struct threadwq_fiber_pool *pool, void *stack)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+
+	munmap((char *) stack - page, pool->stack_size + page);
+}
+
+/*!
+ * \brief Unmap the free stacks. Plz call it after every fiber is done.
+ */
+void threadwq_fiber_pool_exit(struct threadwq_fiber_pool *pool)
+{
+	void *stack;
+
+	while ((stack = pool->free))
+	{
+		pool->free = *(void **) stack;
+		stack_unmap(pool, stack);
+		pool->nr--;
+	}
+
+	if (pool->nr)
+	{
+		ERR("%lu fiber stacks are still in use", pool->nr);
+	}
+
+	if (pool->wait_head)
+	{
+		ERR("Fibers are still waiting for a stack");
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * The usable stack, above a PROT_NONE guard page. An overflow faults instead of corrupting the heap.
+ */
+static void *stack_get(struct threadwq_fiber_pool *pool)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	void *stack;
+	char *base;
+
+	pthread_mutex_lock(&pool->lock);
+	stack = pool->free;
+	if (stack)
+	{
+		pool->free = *(void **) stack;
+		pool->nr_free--;
+		pthread_mutex_unlock(&pool->lock);
+		return stack;
+	}
+	pool->nr++;
+	pthread_mutex_unlock(&pool->lock);
+
+	base = mmap(NULL, pool->stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		ERR("Cannot map fiber stack %s", strerror(errno));
+		pthread_mutex_lock(&pool->lock);
+		pool->nr--;
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	if (mprotect(base, page, PROT_NONE))
+	{
+		ERR("Cannot set fiber stack guard %s", strerror(errno));
+	}
+
+	return base + page;
+}
+
+static void fiber_requeue(struct threadwq_fiber *f);
+
+/*
+ * A fiber waiting for a stack gets this one: Keep it even over max_free.
+ */
+static void stack_put(struct threadwq_fiber_pool *pool, void *stack)
+{
+	struct threadwq_fiber *waiter;
+
+	pthread_mutex_lock(&pool->lock);
+	waiter = pool->wait_head;
+	if (waiter)
+	{
+		pool->wait_head = waiter->wait_next;
+		if (!pool->wait_head)
+		{
+			pool->wait_tail = NULL;
+		}
+	}
+
+	if (waiter || pool->nr_free < pool->max_free)
+	{
+		*(void **) stack = pool->free;
+		pool->free = stack;
+		pool->nr_free++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (waiter)
+		{
+			fiber_requeue(waiter);
+		}
+		return;
+	}
+	pool->nr--;
+	pthread_mutex_unlock(&pool->lock);
+
+	stack_unmap(pool, stack);
+}
+
+/*
+ * The slice found no stack. Wait for one to be put back, unless one is free by now or none is out (nothing
+ * would come back): Retry at once then.
+ */
+static void stack_wait(struct threadwq_fiber *f)
+{
+	struct threadwq_fiber_pool *pool = f->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->free && pool->nr)
+	{
+		f->wait_next = NULL;
+		if (pool->wait_tail)
+		{
+			pool->wait_tail->wait_next = f;
+		}
+		else
+		{
+			pool->wait_head = f;
+		}
+		pool->wait_tail = f;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	fiber_requeue(f);
+}
+
+/*
+ * The fiber body. Never returns: The last switch goes to the worker which ran the last slice.
+ */
+void __threadwq_fiber_main(struct threadwq_fiber *f)
+{
+	f->cb_run(f, f->job.priv);
+
+	f->state = FIBER_DONE;
+	ctx_switch(&f->ctx, f->sched);
+
+	BUG();
+	__builtin_unreachable();
+}
+
+/*
+ * One slice: Run the fiber until it parks, yields or returns.
+ */
+static void fiber_start(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_fiber *f = caa_container_of(job, struct threadwq_fiber, job);
+	threadwq_fiber_ctx_t sched;
+
+	if (caa_unlikely(!f->stack))
+	{
+		f->stack = stack_get(f->pool);
+		if (!f->stack)
+		{
+			f->state = FIBER_NOSTACK;
+			return;
+		}
+
+		ctx_make(f);
+	}
+
+	f->sched = &sched;
+	f->state = FIBER_RUN;
+
+	ctx_switch(&sched, &f->ctx);
+
+	if (f->state == FIBER_DONE)
+	{
+		stack_put(f->pool, f->stack);
+		f->stack = NULL;
+	}
+}
+
+/*
+ * Over the depth limit if need be: A fiber cannot be dropped. Never waits from a worker: If the ring is full, the
+ * job goes to the spill list of the worker, which retries at its next round (see __threadwq_enqueue()).
+ */
+static void fiber_requeue(struct threadwq_fiber *f)
+{
+	cds_lfq_node_init_rcu(&f->job.lfq_node);
+	threadwq_add_job(f->job.twq, &f->job);
+}
+
+/*
+ * The slice is finished. The job may be queued again from here on.
+ */
+static void fiber_finish(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_fiber *f = caa_container_of(job, struct threadwq_fiber, job);
+
+	switch (f->state)
+	{
+	case FIBER_DONE:
+		if (f->cb_done)
+		{
+			f->cb_done(f, priv);
+		}
+		break;
+	case FIBER_PARK:
+		if (uatomic_add_return(&f->gate, 1) == 2)
+		{
+			uatomic_set(&f->gate, 0);
+			fiber_requeue(f);
+		}
+		break;
+	case FIBER_NOSTACK:
+		stack_wait(f);
+		break;
+	case FIBER_YIELD:
+	default:
+		fiber_requeue(f);
+		break;
+	}
+}
+
+static void wake_start(struct threadwq_job *job, void *priv)
+{
+}
+
+static void wake_finish(struct threadwq_job *job, void *priv)
+{
+	threadwq_fiber_resume(priv); // The timer is done w/ the tjob. The next sleep may arm it again.
+}
+
+/*!
+ * \brief Same as threadwq_job_init(). The stack comes from pool at the first slice.
+ *
+ * \details Slices finish inline, so a resume requeues at once (ring backend only; lfq finishes via rcu).
+ */
+void threadwq_fiber_init(struct threadwq_fiber *f, struct threadwq_fiber_pool *pool,
+	void (*cb_run)(struct threadwq_fiber *f, void *priv),
+	void (*cb_done)(struct threadwq_fiber *f, void *priv),
+	void *priv)
+{
+	BUG_ON(pool == NULL || cb_run == NULL);
+
+	threadwq_job_init(&f->job, fiber_start, fiber_finish, priv);
+	threadwq_job_set_finish(&f->job, THREADWQ_FINISH_INLINE);
+	f->cb_run = cb_run;
+	f->cb_done = cb_done;
+	f->pool = pool;
+	f->stack = NULL;
+	f->sched = NULL;
+	f->wait_next = NULL;
+	f->state = FIBER_RUN;
+	f->gate = 0;
+
+	threadwq_tjob_init(&f->wake, wake_start, wake_finish, f);
+	threadwq_job_set_finish(&f->wake.job, THREADWQ_FINISH_INLINE);
+}
+
+/*!
+ * \brief Submit via man. Resumes go back into the twq it picked.
+ *
+ * \return 0: Queued. -EAGAIN: Every twq is full (depth limit). Nothing changed.
+ */
+int threadwq_fiber_submit(struct threadwq_man *man, struct threadwq_fiber *f)
+{
+	return threadwq_man_add_job(man, &f->job);
+}
+
+/*!
+ * \brief Submit into twq directly.
+ */
+void threadwq_fiber_add(struct threadwq *twq, struct threadwq_fiber *f)
+{
+	threadwq_add_job(twq, &f->job);
+}
+
+/*!
+ * \brief From cb_run only: Give the worker back until threadwq_fiber_resume().
+ */
+void threadwq_fiber_park(struct threadwq_fiber *f)
+{
+	if (uatomic_cmpxchg(&f->gate, 1, 0) == 1)
+	{
+		return; // Resumed already.
+	}
+
+	f->state = FIBER_PARK;
+	ctx_switch(&f->ctx, f->sched);
+}
+
+/*!
+ * \brief Wake a parked fiber (or one about to park). Any thread; rcu registered for an lfq backend.
+ */
+void threadwq_fiber_resume(struct threadwq_fiber *f)
+{
+	if (uatomic_add_return(&f->gate, 1) == 2)
+	{
+		uatomic_set(&f->gate, 0);
+		fiber_requeue(f);
+	}
+}
+
+/*!
+ * \brief From cb_run only: Go to the tail of the twq. Jobs queued meanwhile run first.
+ */
+void threadwq_fiber_yield(struct threadwq_fiber *f)
+{
+	f->state = FIBER_YIELD;
+	ctx_switch(&f->ctx, f->sched);
+}
+
+/*!
+ * \brief From cb_run only: Park for ms (one timer tick at least). The worker runs other jobs meanwhile.
+ *
+ * \return 0: Slept. -1: Cannot arm the timer. Did not sleep.
+ */
+int threadwq_fiber_sleep(struct threadwq_fiber *f, struct threadwq_timer *tmr, const unsigned long ms)
+{
+	cds_lfq_node_init_rcu(&f->wake.job.lfq_node); // Reused per sleep.
+
+	if (threadwq_add_job_delayed(tmr, f->job.twq, &f->wake, ms))
+	{
+		return -1;
+	}
+
+	threadwq_fiber_park(f);
+
+	return 0; // ok
+}
@@ -0,0 +1,109 @@
+/*!
+ * \file threadwq_fiber.h
+ * \brief Fiber jobs: A job body w/ its own stack, which can park (wait for I/O or a timer) w/o holding the worker.
+ *
+ * \details A fiber takes a stack from a pool when it first runs and gives it back when cb_run returns.
+ *     Parking switches back to the worker, which goes on w/ other jobs. threadwq_fiber_resume() puts the
+ *     fiber back into the twq it last ran from, and it continues on whichever worker takes it.
+ *
+ *     Exactly one resume per park. The resume may come before the park, e.g. from an I/O callback which
+ *     fires early; the park returns at once then. A fiber is requeued once its resume came and the worker
+ *     finished the slice (cb_finish time): Use a ring backend, so this is inline. On lfq, a resume takes a
+ *     grace period.
+ *
+ *     Parked fibers are not in flight: threadwq_flush() does not wait for them. Resume every parked fiber
+ *     before threadwq_exit(). A fiber may run on another worker after a park: Do not keep thread-local
+ *     pointers (or a held lock) across one.
+ *
+ * \par Example:
+ * \code
+	threadwq_fiber_pool_init(&pool, 0, 256);
+	threadwq_fiber_init(f, &pool, cb_run, cb_done, priv);
+	threadwq_fiber_submit(&man, f);
+
+	static void cb_run(struct threadwq_fiber *f, void *priv)
+	{
+		start_io(..., io_done, f); // io_done() calls threadwq_fiber_resume(f).
+		threadwq_fiber_park(f);
+		threadwq_fiber_sleep(f, &tmr, 10);
+	}
+ * \endcode
+ */
+#ifndef SRC_THREADWQ_THREADWQ_FIBER_H_
+#define SRC_THREADWQ_THREADWQ_FIBER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "threadwq/threadwq.h"
+#include "threadwq/threadwq_timer.h"
+
+#define THREADWQ_FIBER_STACK_DFL (64 * 1024) //!< Usable stack bytes. A guard page sits below.
+
+/*
+ * Saved registers of a fiber, or of the worker which runs it. x86_64: A stack pointer; the callee-saved registers
+ * sit on that stack, and a switch is a few instructions. Elsewhere (or w/ THREADWQ_FIBER_UCONTEXT): ucontext,
+ * whose swapcontext() also saves the signal mask, i.e. a sigprocmask syscall per switch.
+ */
+#if defined(__x86_64__) && !defined(THREADWQ_FIBER_UCONTEXT)
+typedef struct
+{
+	void *sp;
+} threadwq_fiber_ctx_t;
+#else
+typedef ucontext_t threadwq_fiber_ctx_t;
+#endif
+
+struct threadwq_fiber;
+
+/*
+ * Stacks shared by the fibers of any pool. mmap'ed once, then reused.
+ */
+struct threadwq_fiber_pool
+{
+	pthread_mutex_t lock;
+	size_t stack_size; //!< Page aligned. w/o the guard page.
+	void *free; //!< Free stacks, linked through their first word.
+	unsigned long nr_free;
+	unsigned long max_free; //!< Keep up to this many free stacks. The rest are unmapped.
+	unsigned long nr; //!< Mapped stacks.
+	struct threadwq_fiber *wait_head; //!< Fibers which found no stack. Requeued by the next stack put back.
+	struct threadwq_fiber *wait_tail;
+};
+
+struct threadwq_fiber
+{
+	struct threadwq_job job; //!< Set prio/key/deadline on it as usual.
+
+	void (*cb_run)(struct threadwq_fiber *f, void *priv); //!< The job body. May park.
+	void (*cb_done)(struct threadwq_fiber *f, void *priv); //!< Optional. cb_run returned, the stack is back. May free f.
+
+	struct threadwq_fiber_pool *pool;
+	void *stack; //!< NULL until the first slice.
+	threadwq_fiber_ctx_t ctx;
+	threadwq_fiber_ctx_t *sched; //!< The worker to switch back to. Set per slice.
+	struct threadwq_fiber *wait_next; //!< Stack wait list of the pool.
+
+	unsigned int state; //!< See threadwq_fiber.c
+	unsigned long gate; //!< Resume + slice finished: 2 requeues.
+
+	struct threadwq_tjob wake; //!< threadwq_fiber_sleep()
+};
+
+int threadwq_fiber_pool_init(struct threadwq_fiber_pool *pool, const size_t stack_size, const unsigned long max_free);
+void threadwq_fiber_pool_exit(struct threadwq_fiber_pool *pool);
+
+void threadwq_fiber_init(struct threadwq_fiber *f, struct threadwq_fiber_pool *pool,
+	void (*cb_run)(struct threadwq_fiber *f, void *priv),
+	void (*cb_done)(struct threadwq_fiber *f, void *priv),
+	void *priv);
+int threadwq_fiber_submit(struct threadwq_man *man, struct threadwq_fiber *f);
+void threadwq_fiber_add(struct threadwq *twq, struct threadwq_fiber *f);
+
+void threadwq_fiber_park(struct threadwq_fiber *f);
+void threadwq_fiber_resume(struct threadwq_fiber *f);
+void threadwq_fiber_yield(struct threadwq_fiber *f);
+int threadwq_fiber_sleep(struct threadwq_fiber *f, struct threadwq_timer *tmr, const unsigned long ms);
+
+#endif /* SRC_THREADWQ_THREADWQ_FIBER_H_ */
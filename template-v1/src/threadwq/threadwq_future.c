@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <urcu.h>
+#include <urcu/futex.h>
+
+#include "lgu/lgu.h"
+#include "threadwq.h"
+#include "threadwq_future.h"
+
+#define FUTURE_CHAINED ((struct threadwq_future *) 1) //!< In next: Done. Continuations run right away.
+
+static void submit_next(struct threadwq_man *man, struct threadwq_future *next)
+{
+	struct threadwq *self;
+
+	/*
+	 * A continuation cannot be dropped. If every twq is at its depth limit, go over the limit on this worker:
+	 * It never waits on a full ring (it spills, see __threadwq_enqueue()), unlike a blocking add elsewhere.
+	 */
+	if (threadwq_future_submit(man, next))
+	{
+		self = threadwq_self();
+		threadwq_future_add(self ? self : &man->twq_pool[0], next);
+	}
+}
+
+static void future_start(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_future *fut = caa_container_of(job, struct threadwq_future, job);
+	struct threadwq_future *next;
+
+	fut->result = fut->cb_run(fut, priv);
+
+	if (fut->src)
+	{
+		threadwq_future_put(fut->src);
+		fut->src = NULL;
+	}
+
+	cmm_smp_wmb(); // result before done
+	uatomic_set(&fut->done, 1);
+	cmm_smp_mb(); // Pairs w/ threadwq_future_wait(): Either it sees done, or we see the waiter.
+
+	if (CMM_LOAD_SHARED(fut->waiter))
+	{
+		futex_noasync(&fut->done, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+
+	next = uatomic_xchg(&fut->next, FUTURE_CHAINED);
+	if (next)
+	{
+		submit_next(next->man, next);
+	}
+}
+
+static void future_finish(struct threadwq_job *job, void *priv)
+{
+	threadwq_future_put(caa_container_of(job, struct threadwq_future, job));
+}
+
+/*!
+ * \brief Same as threadwq_job_init(). The caller holds one ref: threadwq_future_put() it when done.
+ */
+void threadwq_future_init(struct threadwq_future *fut,
+	long (*cb_run)(struct threadwq_future *fut, void *priv),
+	void (*cb_free)(struct threadwq_future *fut, void *priv),
+	void *priv)
+{
+	BUG_ON(cb_run == NULL);
+
+	threadwq_job_init(&fut->job, future_start, future_finish, priv);
+	fut->cb_run = cb_run;
+	fut->cb_free = cb_free;
+	fut->result = 0;
+	fut->done = 0;
+	fut->waiter = 0;
+	fut->ref = 1;
+	fut->next = NULL;
+	fut->src = NULL;
+	fut->man = NULL;
+}
+
+/*!
+ * \brief Submit via man.
+ *
+ * \return 0: Queued. -EAGAIN: Every twq is full (depth limit). Nothing changed.
+ */
+int threadwq_future_submit(struct threadwq_man *man, struct threadwq_future *fut)
+{
+	int ret;
+
+	uatomic_inc(&fut->ref); // The queue's
+	ret = threadwq_man_add_job(man, &fut->job);
+	if (ret)
+	{
+		uatomic_dec(&fut->ref);
+	}
+
+	return ret;
+}
+
+/*!
+ * \brief Submit into twq directly.
+ */
+void threadwq_future_add(struct threadwq *twq, struct threadwq_future *fut)
+{
+	uatomic_inc(&fut->ref); // The queue's
+	threadwq_add_job(twq, &fut->job);
+}
+
+/*!
+ * \brief Submit next via man once fut is done. If fut is done already, submit it now.
+ *
+ * \details next->src points to fut while next runs, so it can read the result. One continuation per
+ *     future; chain more on next itself. Plz never submit next yourself.
+ *
+ * \return 0: ok. -EBUSY: fut has a continuation already.
+ */
+int threadwq_future_then(struct threadwq_future *fut, struct threadwq_man *man, struct threadwq_future *next)
+{
+	struct threadwq_future *old;
+
+	BUG_ON(man == NULL || next == NULL || next == fut);
+
+	uatomic_inc(&fut->ref); // Held by next->src until next ran.
+	next->src = fut;
+	next->man = man;
+
+	old = uatomic_cmpxchg(&fut->next, NULL, next); // Full barrier: src and man are set before.
+	if (old == NULL)
+	{
+		return 0; // future_start() submits it.
+	}
+
+	if (old == FUTURE_CHAINED)
+	{
+		submit_next(man, next);
+		return 0;
+	}
+
+	next->src = NULL;
+	uatomic_dec(&fut->ref);
+	return -EBUSY;
+}
+
+/*!
+ * \brief Wait until fut is done. Spin THREADWQ_FUTURE_SPIN_DFL rounds, then sleep.
+ *
+ * \param timeout_ms 0: Wait forever.
+ * \return 0: Done. -ETIMEDOUT
+ */
+int threadwq_future_wait(struct threadwq_future *fut, const unsigned int timeout_ms)
+{
+	struct timespec ts;
+	uint64_t deadline = 0, now;
+	unsigned int spin;
+	int ret = 0;
+
+	for (spin = 0; spin < THREADWQ_FUTURE_SPIN_DFL; spin++)
+	{
+		if (threadwq_future_done(fut))
+		{
+			return 0;
+		}
+
+		caa_cpu_relax();
+	}
+
+	if (timeout_ms)
+	{
+		deadline = tm_mono_ns() + (uint64_t) timeout_ms * 1000000ULL;
+	}
+
+	uatomic_inc(&fut->waiter);
+
+	for (;;)
+	{
+		cmm_smp_mb();
+
+		if (threadwq_future_done(fut))
+		{
+			break;
+		}
+
+		if (timeout_ms)
+		{
+			now = tm_mono_ns();
+			if (now >= deadline)
+			{
+				ret = -ETIMEDOUT;
+				break;
+			}
+
+			ts.tv_sec = (deadline - now) / 1000000000ULL;
+			ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		}
+
+		futex_noasync(&fut->done, FUTEX_WAIT, 0, timeout_ms ? &ts : NULL, NULL, 0);
+	}
+
+	uatomic_dec(&fut->waiter);
+
+	return ret;
+}
+
+/*!
+ * \brief Drop the caller's ref. fut is gone after this (cb_free).
+ */
+void threadwq_future_put(struct threadwq_future *fut)
+{
+	if (uatomic_sub_return(&fut->ref, 1) == 0 && fut->cb_free)
+	{
+		fut->cb_free(fut, fut->job.priv);
+	}
+}
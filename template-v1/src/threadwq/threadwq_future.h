@@ -0,0 +1,82 @@
+/*!
+ * \file threadwq_future.h
+ * \brief Jobs w/ a result: Submit, then wait, poll, or chain a continuation.
+ *
+ * \details The future is the job: Embed it (or alloc it from a mempool). Nothing is allocated per job.
+ *     It is done when cb_run returns. Waiters spin a little, then sleep on a futex.
+ *
+ *     Two refs: The caller's, and the queue's (dropped at cb_finish time). cb_free is called when both are
+ *     gone, so a future is never freed under a worker.
+ *
+ * \par Example:
+ * \code
+	fut = mempool_alloc(&mp);
+	threadwq_future_init(fut, cb_run, cb_free, NULL);
+	threadwq_future_submit(&man, fut);
+	...
+	threadwq_future_wait(fut, 0);
+	result = threadwq_future_result(fut);
+	threadwq_future_put(fut); // cb_free: mempool_free()
+ * \endcode
+ */
+#ifndef SRC_THREADWQ_THREADWQ_FUTURE_H_
+#define SRC_THREADWQ_THREADWQ_FUTURE_H_
+
+#include <stdint.h>
+
+#include "threadwq/threadwq.h"
+
+#define THREADWQ_FUTURE_SPIN_DFL (1000) //!< cpu_relax rounds before a waiter sleeps.
+
+struct threadwq_future
+{
+	struct threadwq_job job; //!< Set prio/key/finish mode on it as usual.
+
+	long (*cb_run)(struct threadwq_future *fut, void *priv); //!< The job body. Returns the result.
+	void (*cb_free)(struct threadwq_future *fut, void *priv); //!< Optional. The last ref is gone.
+
+	long result;
+	int32_t done; //!< futex. 0: Pending. 1: Done.
+	unsigned int waiter;
+	unsigned long ref;
+
+	struct threadwq_future *next; //!< Continuation. See threadwq_future_then().
+	struct threadwq_future *src; //!< Continuation only: The future it waited for. Valid during cb_run.
+	struct threadwq_man *man; //!< Continuation only: Submitted via it.
+};
+
+void threadwq_future_init(struct threadwq_future *fut,
+	long (*cb_run)(struct threadwq_future *fut, void *priv),
+	void (*cb_free)(struct threadwq_future *fut, void *priv),
+	void *priv);
+int threadwq_future_submit(struct threadwq_man *man, struct threadwq_future *fut);
+void threadwq_future_add(struct threadwq *twq, struct threadwq_future *fut);
+int threadwq_future_then(struct threadwq_future *fut, struct threadwq_man *man, struct threadwq_future *next);
+int threadwq_future_wait(struct threadwq_future *fut, const unsigned int timeout_ms);
+void threadwq_future_put(struct threadwq_future *fut);
+
+/*!
+ * \brief 1 if done. The result is readable then.
+ */
+static inline __attribute__((unused))
+int threadwq_future_done(struct threadwq_future *fut)
+{
+	if (uatomic_read(&fut->done))
+	{
+		cmm_smp_rmb(); // done before result
+		return 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief The return value of cb_run. Only after threadwq_future_done() or threadwq_future_wait().
+ */
+static inline __attribute__((unused))
+long threadwq_future_result(const struct threadwq_future *fut)
+{
+	return fut->result;
+}
+
+#endif /* SRC_THREADWQ_THREADWQ_FUTURE_H_ */
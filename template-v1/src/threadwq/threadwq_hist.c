@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <urcu.h>
+
+#include "lgu/lgu.h"
+#include "threadwq_hist.h"
+
+/*
+ * The highest value of a bucket. Percentiles never under-report.
+ */
+static uint64_t idx2val(const unsigned int idx)
+{
+	unsigned int e, sub;
+
+	if (idx < THREADWQ_HIST_SUB)
+	{
+		return idx;
+	}
+
+	e = (idx >> THREADWQ_HIST_SUB_BITS) + THREADWQ_HIST_SUB_BITS - 1;
+	sub = idx & (THREADWQ_HIST_SUB - 1);
+
+	return (((uint64_t) (THREADWQ_HIST_SUB + sub + 1)) << (e - THREADWQ_HIST_SUB_BITS)) - 1;
+}
+
+void threadwq_hist_reset(struct threadwq_hist *h)
+{
+	memset(h, 0x00, sizeof(*h));
+}
+
+/*!
+ * \brief dst += src. src may be recorded by its owner meanwhile.
+ */
+void threadwq_hist_merge(struct threadwq_hist *dst, const struct threadwq_hist *src)
+{
+	unsigned long nr = 0, cnt;
+	uint64_t max;
+	unsigned int i;
+
+	for (i = 0; i < THREADWQ_HIST_BUCKET; i++)
+	{
+		cnt = CMM_LOAD_SHARED(src->cnt[i]);
+		dst->cnt[i] += cnt;
+		nr += cnt; // Not src->nr: Keep nr == sum of buckets.
+	}
+
+	dst->nr += nr;
+
+	max = CMM_LOAD_SHARED(src->max);
+	if (max > dst->max)
+	{
+		dst->max = max;
+	}
+}
+
+/*!
+ * \brief Value at ppm (parts per million), e.g. 990000 for p99. 0 if empty.
+ */
+uint64_t threadwq_hist_percentile(const struct threadwq_hist *h, const unsigned long ppm)
+{
+	unsigned long rank, sum = 0;
+	unsigned int i;
+	uint64_t val;
+
+	if (h->nr == 0)
+	{
+		return 0;
+	}
+
+	rank = (unsigned long) (((unsigned long long) h->nr * ppm + 999999) / 1000000);
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+
+	for (i = 0; i < THREADWQ_HIST_BUCKET; i++)
+	{
+		sum += h->cnt[i];
+		if (sum >= rank)
+		{
+			val = idx2val(i);
+			return val < h->max ? val : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+void threadwq_hist_get_pct(const struct threadwq_hist *h, struct threadwq_pct *pct)
+{
+	pct->nr = h->nr;
+	pct->p50 = threadwq_hist_percentile(h, 500000);
+	pct->p99 = threadwq_hist_percentile(h, 990000);
+	pct->p999 = threadwq_hist_percentile(h, 999000);
+	pct->max = h->max;
+}
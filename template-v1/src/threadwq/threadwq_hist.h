@@ -0,0 +1,79 @@
+/*!
+ * \file threadwq_hist.h
+ * \brief Log-linear latency histogram (HDR style). Values in ns.
+ *
+ * \details Every power of 2 is cut into THREADWQ_HIST_SUB linear buckets, so a percentile is off by
+ *     3% at most, over the whole uint64_t range, in a fixed 15KB table.
+ *
+ *     Single writer: Only one thread records into a histogram (the worker owns its own). Readers merge
+ *     w/o locks and may miss the records in flight.
+ */
+#ifndef SRC_THREADWQ_THREADWQ_HIST_H_
+#define SRC_THREADWQ_THREADWQ_HIST_H_
+
+#include <stdint.h>
+
+#include <urcu/system.h>
+
+#define THREADWQ_HIST_SUB_BITS (5)
+#define THREADWQ_HIST_SUB (1 << THREADWQ_HIST_SUB_BITS)
+#define THREADWQ_HIST_BUCKET ((64 - THREADWQ_HIST_SUB_BITS + 1) * THREADWQ_HIST_SUB)
+
+struct threadwq_hist
+{
+	unsigned long nr;
+	uint64_t max;
+	unsigned long cnt[THREADWQ_HIST_BUCKET];
+};
+
+/*
+ * Percentiles of one histogram.
+ */
+struct threadwq_pct
+{
+	unsigned long nr;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+static inline __attribute__((unused))
+unsigned int threadwq_hist_idx(const uint64_t val)
+{
+	unsigned int e;
+
+	if (val < THREADWQ_HIST_SUB)
+	{
+		return val;
+	}
+
+	e = 63 - __builtin_clzll(val);
+
+	return ((e - THREADWQ_HIST_SUB_BITS + 1) << THREADWQ_HIST_SUB_BITS)
+		+ ((val >> (e - THREADWQ_HIST_SUB_BITS)) & (THREADWQ_HIST_SUB - 1));
+}
+
+/*!
+ * \brief Record a value. Owner only.
+ */
+static inline __attribute__((unused))
+void threadwq_hist_record(struct threadwq_hist *h, const uint64_t val)
+{
+	const unsigned int idx = threadwq_hist_idx(val);
+
+	CMM_STORE_SHARED(h->cnt[idx], h->cnt[idx] + 1);
+	CMM_STORE_SHARED(h->nr, h->nr + 1);
+
+	if (caa_unlikely(val > h->max))
+	{
+		CMM_STORE_SHARED(h->max, val);
+	}
+}
+
+void threadwq_hist_reset(struct threadwq_hist *h);
+void threadwq_hist_merge(struct threadwq_hist *dst, const struct threadwq_hist *src);
+uint64_t threadwq_hist_percentile(const struct threadwq_hist *h, const unsigned long ppm);
+void threadwq_hist_get_pct(const struct threadwq_hist *h, struct threadwq_pct *pct);
+
+#endif /* SRC_THREADWQ_THREADWQ_HIST_H_ */
@@ -1,3 +1,12 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <urcu/futex.h>
+
 #include "lgu/lgu.h"
 
 #include "threadwq.h"
@@ -13,12 +22,314 @@ int threadwq_man_init(struct threadwq_man *man,
 	BUG_ON(twq_tbl == NULL || twq_tbl_nr <= 0);
 	man->twq_pool = twq_tbl;
 	man->twq_pool_nr = twq_tbl_nr;
+	man->twq_pool_cap = twq_tbl_nr;
+	man->elastic = NULL;
 
 	return man->ops->cb_init(man);
 }
 
+static void autoscale_stop(struct threadwq_man_elastic *el)
+{
+	if (!el->running)
+	{
+		return;
+	}
+
+	uatomic_set(&el->exit, 1);
+	pthread_join(el->tid, NULL);
+	el->running = 0;
+	el->exit = 0;
+}
+
 void threadwq_man_exit(struct threadwq_man *man)
 {
 	BUG_ON(man == NULL);
+
+	if (man->elastic)
+	{
+		autoscale_stop(man->elastic);
+		pthread_mutex_destroy(&man->elastic->lock);
+		free(man->elastic);
+		man->elastic = NULL;
+	}
+
 	man->ops->cb_exit(man);
 }
+
+/*
+ * Resize fence of an ordered man. One job at the head of every twq which may take moved keys. It holds the
+ * worker until the jobs of the old mapping have run. The last ref frees it (lfq: after a grace period).
+ */
+struct man_fence
+{
+	int32_t open; //!< futex
+	unsigned long ref;
+	struct threadwq_job job_tbl[];
+};
+
+static void fence_start(struct threadwq_job *job, void *priv)
+{
+	struct man_fence *fence = priv;
+
+	while (!uatomic_read(&fence->open))
+	{
+		futex_noasync(&fence->open, FUTEX_WAIT, 0, NULL, NULL, 0);
+	}
+}
+
+static void fence_put(struct threadwq_job *job, void *priv)
+{
+	struct man_fence *fence = priv;
+
+	if (uatomic_sub_return(&fence->ref, 1) == 0)
+	{
+		free(fence);
+	}
+}
+
+/*
+ * Fence twqs [lo, hi). NULL if out of memory: Resize anyway, w/o the order.
+ */
+static struct man_fence *fence_raise(struct threadwq_man *man, const unsigned int lo, const unsigned int hi)
+{
+	struct man_fence *fence = malloc(sizeof(*fence) + (hi - lo) * sizeof(fence->job_tbl[0]));
+	unsigned int i;
+
+	if (!fence)
+	{
+		ERR("Cannot alloc resize fence. Order of moved keys may break");
+		return NULL;
+	}
+
+	fence->open = 0;
+	fence->ref = hi - lo + 1;
+
+	for (i = lo; i < hi; i++)
+	{
+		threadwq_job_init(&fence->job_tbl[i - lo], fence_start, fence_put, fence);
+		threadwq_add_job(&man->twq_pool[i], &fence->job_tbl[i - lo]); // Over the depth limit if need be.
+	}
+
+	return fence;
+}
+
+static void fence_drop(struct man_fence *fence)
+{
+	if (!fence)
+	{
+		return;
+	}
+
+	uatomic_set(&fence->open, 1);
+	futex_noasync(&fence->open, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	fence_put(NULL, fence);
+}
+
+/*!
+ * \brief Use [0, nr) of the pool. Start or stop workers to match. Dispatching goes on meanwhile.
+ *
+ * \details Grow: Start the workers, then publish nr. Shrink: Unpublish first, wait a grace period so no
+ *     dispatcher still holds the old nr, then stop the workers after they run what they have.
+ *     Plz never call it from a worker of this pool.
+ *
+ *     Ordered man (threadwq_man_ops_hash): The twqs taking moved keys are fenced until the jobs of the old
+ *     mapping ran, so a key never runs on two workers at once. They stall meanwhile. Jobs that wait for
+ *     space in a fenced twq (threadwq_add_job_wait()) deadlock the resize.
+ */
+int threadwq_man_resize(struct threadwq_man *man, const unsigned int nr)
+{
+	struct threadwq_man_elastic *el = man->elastic;
+	struct man_fence *fence = NULL;
+	unsigned int cur, i;
+	int ret = 0;
+
+	if (!el)
+	{
+		ERR("man %p is not elastic", man);
+		return -1;
+	}
+
+	if (nr == 0 || nr > man->twq_pool_cap)
+	{
+		ERR("Invalid pool size %u (cap %u)", nr, man->twq_pool_cap);
+		return -1;
+	}
+
+	pthread_mutex_lock(&el->lock);
+
+	cur = man->twq_pool_nr;
+
+	if (nr > cur)
+	{
+		for (i = cur; i < nr; i++)
+		{
+			if (!man->twq_pool[i].running && threadwq_exec(&man->twq_pool[i]))
+			{
+				ret = -1;
+				break;
+			}
+		}
+
+		if (man->ops->ordered && i > cur)
+		{
+			/*
+			 * Keys move into the new twqs only. Hold them until the old twqs ran what they got before.
+			 */
+			fence = fence_raise(man, cur, i);
+		}
+
+		cmm_smp_mb(); // Workers are up before dispatchers see them.
+		CMM_STORE_SHARED(man->twq_pool_nr, i);
+		uatomic_add(&el->grow, i - cur);
+
+		if (man->ops->ordered && i > cur)
+		{
+			synchronize_rcu();
+			threadwq_flush_multi(man->twq_pool, cur);
+			fence_drop(fence);
+		}
+	}
+	else if (nr < cur)
+	{
+		if (man->ops->ordered)
+		{
+			/*
+			 * Keys of the retired twqs move into the survivors. Hold them until the retired ones drained.
+			 */
+			fence = fence_raise(man, 0, nr);
+		}
+
+		CMM_STORE_SHARED(man->twq_pool_nr, nr);
+		synchronize_rcu();
+
+		for (i = nr; i < cur; i++)
+		{
+			threadwq_stop(&man->twq_pool[i]);
+		}
+
+		fence_drop(fence);
+
+		uatomic_add(&el->shrink, cur - nr);
+	}
+
+	pthread_mutex_unlock(&el->lock);
+
+	return ret;
+}
+
+/*!
+ * \brief Block until every job added via man (or into its twqs) before the call has finished.
+ *
+ * \details Covers the whole table: A worker retired by a shrink may still owe deferred cb_finish.
+ *     See threadwq_flush_multi().
+ */
+void threadwq_man_flush(struct threadwq_man *man)
+{
+	BUG_ON(man == NULL);
+
+	threadwq_flush_multi(man->twq_pool, man->twq_pool_cap);
+}
+
+static void *autoscale_func(void *data)
+{
+	struct threadwq_man *man = data;
+	struct threadwq_man_elastic *el = man->elastic;
+	const struct threadwq_scale *cfg = &el->cfg;
+	unsigned long depth, busy;
+	unsigned int nr, i, up = 0, down = 0;
+
+	rcu_register_thread();
+
+	while (!uatomic_read(&el->exit))
+	{
+		usleep(cfg->period_ms * 1000);
+
+		nr = threadwq_man_nr(man);
+		depth = 0;
+		busy = 0;
+
+		for (i = 0; i < nr; i++)
+		{
+			depth += CMM_LOAD_SHARED(man->twq_pool[i].depth);
+			if (!CMM_LOAD_SHARED(man->twq_pool[i].sleeping)) // A parked worker keeps its last busy value.
+			{
+				busy += CMM_LOAD_SHARED(man->twq_pool[i].busy);
+			}
+		}
+
+		depth /= nr;
+		busy /= nr;
+
+		up = (depth > cfg->up_depth) ? up + 1 : 0;
+		down = (depth <= cfg->down_depth && busy <= cfg->down_busy) ? down + 1 : 0;
+
+		if (up >= cfg->up_round && nr < man->twq_pool_cap)
+		{
+			threadwq_man_resize(man, nr + 1);
+			up = 0;
+			down = 0;
+		}
+		else if (down >= cfg->down_round && nr > cfg->nr_min)
+		{
+			threadwq_man_resize(man, nr - 1);
+			up = 0;
+			down = 0;
+		}
+	}
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*!
+ * \brief Make the pool elastic. Call it before adding jobs via man. From then on, add jobs from rcu registered
+ *     threads only.
+ *
+ * \param cfg Start the autoscaler w/ it. NULL: Stop the autoscaler. Resize by threadwq_man_resize() only.
+ *     Stop it before threadwq_exit_multi() on the pool.
+ */
+int threadwq_man_set_elastic(struct threadwq_man *man, const struct threadwq_scale *cfg)
+{
+	struct threadwq_man_elastic *el = man->elastic;
+
+	if (cfg && (cfg->nr_min == 0 || cfg->nr_min > man->twq_pool_cap || cfg->period_ms == 0))
+	{
+		ERR("Invalid autoscaler config");
+		return -1;
+	}
+
+	if (!el)
+	{
+		el = calloc(1, sizeof(*el));
+		if (!el)
+		{
+			ERR("Cannot alloc elastic pool");
+			return -1;
+		}
+
+		pthread_mutex_init(&el->lock, NULL);
+
+		man->elastic = el;
+	}
+
+	autoscale_stop(el);
+
+	if (!cfg)
+	{
+		return 0; // ok
+	}
+
+	el->cfg = *cfg;
+
+	if (pthread_create(&el->tid, NULL, &autoscale_func, man))
+	{
+		ERR("Cannot create autoscaler %s", strerror(errno));
+		return -1;
+	}
+
+	el->running = 1;
+
+	return 0; // ok
+}
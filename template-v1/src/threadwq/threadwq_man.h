@@ -2,16 +2,57 @@
 #ifndef SRC_THREADWQ_THREADWQ_MANAGER_H_
 #define SRC_THREADWQ_THREADWQ_MANAGER_H_
 
+#include <pthread.h>
+
 #include "threadwq/threadwq_man_ops.h"
 
+/*
+ * Autoscaler config. See threadwq_man_set_elastic().
+ *
+ * Hysteresis: Grow fast on a deep queue, shrink slowly on an empty and idle one.
+ */
+struct threadwq_scale
+{
+	unsigned int nr_min; //!< Never go below. >= 1
+	unsigned int period_ms; //!< Sampling period
+	unsigned long up_depth; //!< Grow when avg queued jobs per active worker > up_depth,
+	unsigned int up_round; //!< ... for up_round samples in a row.
+	unsigned long down_depth; //!< Shrink when avg queued jobs per active worker <= down_depth,
+	unsigned int down_busy; //!< ... and avg busy <= down_busy,
+	unsigned int down_round; //!< ... for down_round samples in a row.
+};
+
+#define THREADWQ_SCALE_INITIALIZER(_nr_min) \
+	{ .nr_min = _nr_min, .period_ms = 50, .up_depth = 64, .up_round = 2, .down_depth = 0, .down_busy = 1, .down_round = 20 }
+
+struct threadwq_man_elastic
+{
+	pthread_mutex_t lock; //!< Serializes resizes. Never taken on the submit path.
+
+	struct threadwq_scale cfg;
+	pthread_t tid; //!< Autoscaler
+	unsigned int running;
+	unsigned int exit;
+
+	unsigned long grow; //!< Workers added
+	unsigned long shrink; //!< Workers retired
+};
+
 struct threadwq;
+
+/*
+ * Read-mostly fields first. Per-algorithm state that producers write lives on its own cache line.
+ */
 struct threadwq_man
 {
 	struct threadwq *twq_pool;
-	unsigned int twq_pool_nr;
+	unsigned int twq_pool_nr; //!< Active twqs: [0, twq_pool_nr). Changes at runtime in an elastic pool.
+	unsigned int twq_pool_cap; //!< Size of twq_pool.
 
 	const struct threadwq_man_ops *ops;
 
+	struct threadwq_man_elastic *elastic; //!< NULL: Fixed pool.
+
 	/*
 	 * per-algorithm private data
 	 */
@@ -19,22 +60,97 @@ struct threadwq_man
 	{
 		struct
 		{
-			unsigned int twq_idx;
+			unsigned int twq_idx; //!< Jobs dispatched so far. rr: Next twq is twq_idx % nr.
 		} rr;
-	};
+	} __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
 };
 
 #include "threadwq_man_rr.h"
+#include "threadwq_man_hash.h"
+#include "threadwq_man_load.h"
+#include "threadwq_man_shared.h"
 
+/*
+ * Dispatchers only pick the twq. The job priority (threadwq_job_set_prio()) is honoured by the target twq.
+ */
+/*!
+ * \brief Active twqs. Dispatchers read it once per pick.
+ */
+static inline __attribute__((unused))
+unsigned int threadwq_man_nr(struct threadwq_man *man)
+{
+	return CMM_LOAD_SHARED(man->twq_pool_nr);
+}
+
+/*
+ * Dispatchers skip twqs at their depth limit (threadwq_set_depth_max()), and return -EAGAIN if all are full.
+ * Without limits they never fail.
+ */
 static inline __attribute__((unused))
 int threadwq_man_add_job(struct threadwq_man *man, struct threadwq_job *job)
 {
-	return man->ops->cb_add_job(man, job);
+	int ret;
+
+	if (caa_likely(!man->elastic))
+	{
+		return man->ops->cb_add_job(man, job);
+	}
+
+	/*
+	 * A retiring twq is unpublished, then waited for a grace period. Nobody adds into it after that.
+	 */
+	rcu_read_lock();
+	ret = man->ops->cb_add_job(man, job);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*!
+ * \brief Add a batch via the dispatcher.
+ *
+ * \return The number queued: job_tbl[0, ret) are in, the rest are untouched. Less than nr only w/ depth limits.
+ */
+static inline __attribute__((unused))
+unsigned int threadwq_man_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	const struct threadwq_man_elastic *elastic = man->elastic; // Read once: lock and unlock must pair.
+	unsigned int i;
+
+	if (caa_unlikely(elastic))
+	{
+		rcu_read_lock(); // See threadwq_man_add_job()
+	}
+
+	if (man->ops->cb_add_jobs)
+	{
+		i = man->ops->cb_add_jobs(man, job_tbl, nr);
+	}
+	else
+	{
+		for (i = 0; i < nr; i++)
+		{
+			if (man->ops->cb_add_job(man, job_tbl[i]))
+			{
+				break;
+			}
+		}
+	}
+
+	if (caa_unlikely(elastic))
+	{
+		rcu_read_unlock();
+	}
+
+	return i;
 }
 
 int threadwq_man_init(struct threadwq_man *man,
 	struct threadwq *twq_tbl, const unsigned int twq_tbl_nr,
 	const struct threadwq_man_ops *ops);
 void threadwq_man_exit(struct threadwq_man *man);
+int threadwq_man_set_elastic(struct threadwq_man *man, const struct threadwq_scale *cfg);
+int threadwq_man_resize(struct threadwq_man *man, const unsigned int nr);
+void threadwq_man_flush(struct threadwq_man *man);
 
 #endif /* SRC_THREADWQ_THREADWQ_MANAGER_H_ */
@@ -0,0 +1,112 @@
+#include "lgu/lgu.h"
+
+#include "threadwq.h"
+#include "threadwq_man.h"
+#include "threadwq_man_ops.h"
+
+#include "threadwq_man_hash.h"
+
+/*
+ * Hash affinity: Jobs w/ the same key (threadwq_job_set_key()) go to the same twq, so they run in FIFO
+ * order on one worker and keep its cache warm.
+ *
+ * Jump consistent hash (Lamping & Veach): No table, and when the pool grows from n to n + 1, only 1/(n + 1)
+ * of the keys move, all into the new twq. An elastic pool only uses [0, nr), which is what it wants.
+ * threadwq_man_resize() fences the moved keys, so the order holds across a resize too.
+ *
+ * The order holds per producer. hash_init() refuses pools which reorder it: Work-stealing, a shared pool, EDF,
+ * and priority classes.
+ * A full twq (depth limit) is not skipped: -EAGAIN.
+ */
+static inline unsigned int jump_hash(uint64_t key, const unsigned int nr)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < nr)
+	{
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (int64_t) ((b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1)));
+	}
+
+	return b;
+}
+
+static int hash_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	struct threadwq *twq = &man->twq_pool[jump_hash(job->key, threadwq_man_nr(man))];
+
+	return threadwq_try_add_job(twq, job);
+}
+
+/*
+ * Consecutive jobs of one twq go in as one batch. A full twq stops the batch: The jobs before its run are added.
+ */
+static unsigned int hash_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	unsigned int i = 0, j, idx;
+
+	while (i < nr)
+	{
+		idx = jump_hash(job_tbl[i]->key, pool_nr);
+
+		for (j = i + 1; j < nr && jump_hash(job_tbl[j]->key, pool_nr) == idx; j++);
+
+		if (threadwq_try_add_jobs(&man->twq_pool[idx], &job_tbl[i], j - i))
+		{
+			return i;
+		}
+
+		i = j;
+	}
+
+	return nr;
+}
+
+/*
+ * Set stealing, sharing, EDF and priority classes before threadwq_man_init(): They are checked here only.
+ */
+static int hash_init(struct threadwq_man *man)
+{
+	const struct threadwq *twq;
+	unsigned int i;
+
+	if (man->twq_pool[0].sibling_tbl)
+	{
+		ERR("Hash affinity cannot keep the order w/ work-stealing");
+		return -1;
+	}
+
+	for (i = 0; i < man->twq_pool_cap; i++)
+	{
+		twq = &man->twq_pool[i];
+
+		if (twq->shared)
+		{
+			ERR("Hash affinity cannot keep the order in a shared pool: Every worker drains one queue");
+			return -1;
+		}
+
+		if (twq->edf)
+		{
+			ERR("Hash affinity cannot keep the order w/ EDF: twq %p runs by deadline", twq);
+			return -1;
+		}
+
+		if (twq->nr_prio > 1)
+		{
+			ERR("Hash affinity cannot keep the order w/ %u priority classes on twq %p", twq->nr_prio, twq);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void hash_exit(struct threadwq_man *man)
+{
+	return;
+}
+
+DEFINE_THREADWQ_MAN_OPS_ORDERED(threadwq_man_ops_hash, hash_init, hash_exit, hash_add_job, hash_add_jobs);
@@ -0,0 +1,165 @@
+#include <limits.h>
+#include <stdint.h>
+
+#include "lgu/lgu.h"
+
+#include "threadwq.h"
+#include "threadwq_man.h"
+#include "threadwq_man_ops.h"
+
+#include "threadwq_man_load.h"
+
+/*
+ * Load-aware dispatchers. The load of a twq is its queue depth (twq->depth), which the producers and the
+ * worker keep up to date anyway. A full twq (depth limit) is skipped. If every twq is full:
+ * -EAGAIN, or nothing queued for a batch.
+ */
+
+static __thread uint32_t rng_state; //!< Per producer. No shared cache line on the submit path.
+
+/*
+ * xorshift32. Seeded on first use from the thread and the clock.
+ */
+static inline uint32_t rng_next(void)
+{
+	uint32_t x = rng_state;
+
+	if (caa_unlikely(x == 0))
+	{
+		x = ((uint32_t) (uintptr_t) &rng_state ^ (uint32_t) tm_mono_ns()) | 1;
+	}
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return rng_state = x;
+}
+
+/*
+ * [0, nr) w/o a division.
+ */
+static inline unsigned int rng_idx(const unsigned int nr)
+{
+	return ((uint64_t) rng_next() * nr) >> 32;
+}
+
+/*
+ * Least-loaded: Scan every active twq, and pick the shallowest queue.
+ *
+ * Pros: Best pick. Cons: O(n) cache misses per job, and producers herd onto the same twq between two
+ * depth updates. The scan starts at a random twq, so ties are spread.
+ */
+static unsigned int least_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	unsigned int i, idx, best, round;
+	unsigned long depth, best_depth;
+	struct threadwq *twq;
+
+	for (round = 0; round < pool_nr; round++) // Lost a race for the last slots: Pick again.
+	{
+		idx = rng_idx(pool_nr);
+		best = pool_nr;
+		best_depth = ULONG_MAX;
+
+		for (i = 0; i < pool_nr; i++, idx++)
+		{
+			if (idx >= pool_nr)
+			{
+				idx = 0;
+			}
+
+			twq = &man->twq_pool[idx];
+			if (threadwq_full(twq))
+			{
+				continue;
+			}
+
+			depth = CMM_LOAD_SHARED(twq->depth);
+			if (depth < best_depth)
+			{
+				best_depth = depth;
+				best = idx;
+
+				if (depth == 0)
+				{
+					break; // Cannot do better.
+				}
+			}
+		}
+
+		if (best == pool_nr)
+		{
+			return 0;
+		}
+
+		if (!threadwq_try_add_jobs(&man->twq_pool[best], job_tbl, nr))
+		{
+			return nr;
+		}
+	}
+
+	return 0;
+}
+
+static int least_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	return least_add_jobs(man, &job, 1) ? 0 : -EAGAIN;
+}
+
+/*
+ * Power of two choices: Sample two twqs at random, and pick the shallower one.
+ *
+ * Almost as good as least-loaded (max load drops from O(log n / log log n) to O(log log n) vs one random
+ * pick), at two cache misses per job, and random picks do not herd.
+ */
+static unsigned int p2c_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	struct threadwq *a, *b, *tmp;
+
+	if (caa_unlikely(pool_nr == 1))
+	{
+		return threadwq_try_add_jobs(&man->twq_pool[0], job_tbl, nr) ? 0 : nr;
+	}
+
+	a = &man->twq_pool[rng_idx(pool_nr)];
+	b = &man->twq_pool[rng_idx(pool_nr - 1)];
+	if (b >= a)
+	{
+		b++; // Two different twqs.
+	}
+
+	if (CMM_LOAD_SHARED(b->depth) < CMM_LOAD_SHARED(a->depth))
+	{
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	if (!threadwq_try_add_jobs(a, job_tbl, nr) || !threadwq_try_add_jobs(b, job_tbl, nr))
+	{
+		return nr;
+	}
+
+	return least_add_jobs(man, job_tbl, nr); // Both full. Look at all.
+}
+
+static int p2c_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	return p2c_add_jobs(man, &job, 1) ? 0 : -EAGAIN;
+}
+
+static int load_init(struct threadwq_man *man)
+{
+	return 0;
+}
+
+static void load_exit(struct threadwq_man *man)
+{
+	return;
+}
+
+DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_least, load_init, load_exit, least_add_job, least_add_jobs);
+DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_p2c, load_init, load_exit, p2c_add_job, p2c_add_jobs);
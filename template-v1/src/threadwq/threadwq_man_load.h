@@ -0,0 +1,9 @@
+#ifndef SRC_THREADWQ_THREADWQ_MAN_LOAD_H_
+#define SRC_THREADWQ_THREADWQ_MAN_LOAD_H_
+
+#include "threadwq/threadwq_man_ops.h"
+
+DECLARE_THREADWQ_MAN_OPS(threadwq_man_ops_least);
+DECLARE_THREADWQ_MAN_OPS(threadwq_man_ops_p2c);
+
+#endif /* SRC_THREADWQ_THREADWQ_MAN_LOAD_H_ */
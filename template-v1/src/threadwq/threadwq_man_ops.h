@@ -10,10 +10,17 @@ struct threadwq_man_ops
 	void (*cb_exit)(struct threadwq_man *twq_man);
 
 	int (*cb_add_job)(struct threadwq_man *twq_man, struct threadwq_job *job);
+	unsigned int (*cb_add_jobs)(struct threadwq_man *twq_man, struct threadwq_job **job_tbl, const unsigned int nr); //!< Optional. NULL: Use cb_add_job one by one. Return the number queued: job_tbl[0, ret).
+
+	unsigned int ordered; //!< 1: Jobs of one key go to one twq in order. Resizes fence the moved keys.
 };
 
-#define DEFINE_THREADWQ_MAN_OPS(_name, _init, _exit, _add_job) \
-	struct threadwq_man_ops _name = { .cb_init = _init, .cb_exit = _exit, .cb_add_job = _add_job }
+#define DEFINE_THREADWQ_MAN_OPS(_name, _init, _exit, _add_job, _add_jobs) \
+	struct threadwq_man_ops _name = { .cb_init = _init, .cb_exit = _exit, .cb_add_job = _add_job, .cb_add_jobs = _add_jobs }
+
+#define DEFINE_THREADWQ_MAN_OPS_ORDERED(_name, _init, _exit, _add_job, _add_jobs) \
+	struct threadwq_man_ops _name = { .cb_init = _init, .cb_exit = _exit, .cb_add_job = _add_job, .cb_add_jobs = _add_jobs, \
+		.ordered = 1 }
 
 #define DECLARE_THREADWQ_MAN_OPS(_name) \
 	extern struct threadwq_man_ops _name
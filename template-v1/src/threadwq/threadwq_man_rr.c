@@ -1,3 +1,6 @@
+#include <limits.h>
+#include <stdint.h>
+
 #include "lgu/lgu.h"
 
 #include "threadwq.h"
@@ -10,31 +13,43 @@
  * Round-robin (RR): Add job into twq one by one.
  *
  * Assume the job is w/ similar cost. Then round-robin is usually good. Consider others if cache-hit is critical.
+ *
+ * One fetch-and-add per pick: Strict rr across all producers. The counter still bounces between producers;
+ * see threadwq_man_ops_rr_local for many producers.
  */
-static int rr_add_job(struct threadwq_man *man, struct threadwq_job *job)
+static inline unsigned int rr_next_idx(struct threadwq_man *man)
 {
-	{
-		unsigned int idx = uatomic_read(&man->rr.twq_idx);
+	return (uatomic_add_return(&man->rr.twq_idx, 1) - 1) % threadwq_man_nr(man);
+}
 
-		if (idx >= man->twq_pool_nr)
-		{
-			idx = 0;
-			uatomic_set(&man->rr.twq_idx, 0);
-		}
-		else
-		{
-			uatomic_inc(&man->rr.twq_idx);
-		}
+/*
+ * The whole batch goes to one twq. One wakeup per batch.
+ *
+ * A full twq (depth limit) is skipped. All or nothing: 0 if every twq is full.
+ */
+static unsigned int rr_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	unsigned int i;
+
+	for (i = 0; i < pool_nr; i++)
+	{
+		struct threadwq *twq = &man->twq_pool[rr_next_idx(man)];
 
+		if (!threadwq_try_add_jobs(twq, job_tbl, nr))
 		{
-			struct threadwq *twq = &man->twq_pool[idx];
-			threadwq_add_job(twq, job);
+			return nr;
 		}
 	}
 
 	return 0;
 }
 
+static int rr_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	return rr_add_jobs(man, &job, 1) ? 0 : -EAGAIN;
+}
+
 static int rr_init(struct threadwq_man *man)
 {
 #define my_priv man->rr
@@ -47,48 +62,81 @@ static void rr_exit(struct threadwq_man *man)
 	return;
 }
 
-DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_rr, rr_init, rr_exit, rr_add_job);
+DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_rr, rr_init, rr_exit, rr_add_job, rr_add_jobs);
 
-#if THREADWQ_BLOCKED_ENQUEUE
 /*
- * Round-robin (RR): Check q one by one, and make sure it's in idle state. Good for few writer.
+ * Round-robin (RR): Check q one by one, and pick the first one in idle (parked) state.
  *
  * Pros: This can make sure the twq won't get too many tasks in queue.
- * Cons: But if you have multiple-writer, one writer may get longer latency (starvation)
+ * Cons: If nobody is idle, fall back to plain rr. Workers that never park (busy-poll) always look busy.
  */
-static int rr4idle_add_job(struct threadwq_man *man, struct threadwq_job *job)
+static unsigned int rr4idle_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
 {
-	register unsigned int idx = uatomic_read(&man->rr.twq_idx);
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	register unsigned int idx = uatomic_read(&man->rr.twq_idx) % pool_nr;
+	unsigned int i;
+	struct threadwq *twq;
 
-	for (;; idx++)
+	for (i = 0; i < pool_nr; i++, idx++)
 	{
-		struct threadwq *twq;
-
-		if (caa_unlikely(idx >= man->twq_pool_nr))
+		if (caa_unlikely(idx >= pool_nr))
 		{
 			idx = 0;
 		}
 
 		twq = &man->twq_pool[idx];
 
-		if (caa_likely(pthread_mutex_trylock(&twq->mutex)))
-		{
-			continue; // lock fail.
-		}
-		else
+		if (CMM_LOAD_SHARED(twq->sleeping) && !threadwq_try_add_jobs(twq, job_tbl, nr))
 		{
 			uatomic_set(&man->rr.twq_idx, idx + 1); // Avoid using this index again.
+			return nr;
+		}
+	} // end for
+
+	return rr_add_jobs(man, job_tbl, nr);
+}
+
+static int rr4idle_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	return rr4idle_add_jobs(man, &job, 1) ? 0 : -EAGAIN;
+}
+
+DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_rr4idle, rr_init, rr_exit, rr4idle_add_job, rr4idle_add_jobs);
+
+static __thread unsigned int rr_cursor = UINT_MAX; //!< Per producer. UINT_MAX: Not seeded yet.
+
+/*
+ * Round-robin (RR) per producer: Every producer walks the pool w/ its own cursor. The submit path writes
+ * no shared cache line, so it scales w/ producers.
+ *
+ * Each producer is fair on its own. Producers start at different twqs, so they do not move in lockstep.
+ */
+static unsigned int rr_local_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	unsigned int i;
+
+	if (caa_unlikely(rr_cursor == UINT_MAX))
+	{
+		rr_cursor = (unsigned int) (((uint64_t) (uintptr_t) &rr_cursor * 0x9E3779B97F4A7C15ULL) >> 32); // TLS address differs per thread.
+	}
 
-			threadwq_add_job_locked(twq, job);
+	for (i = 0; i < pool_nr; i++)
+	{
+		struct threadwq *twq = &man->twq_pool[rr_cursor++ % pool_nr];
 
-			pthread_cond_signal(&twq->cond);
-			pthread_mutex_unlock(&twq->mutex);
-			break;
+		if (!threadwq_try_add_jobs(twq, job_tbl, nr))
+		{
+			return nr;
 		}
-	} // end for
+	}
 
 	return 0;
 }
 
-DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_rr4idle, rr_init, rr_exit, rr4idle_add_job);
-#endif
+static int rr_local_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	return rr_local_add_jobs(man, &job, 1) ? 0 : -EAGAIN;
+}
+
+DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_rr_local, rr_init, rr_exit, rr_local_add_job, rr_local_add_jobs);
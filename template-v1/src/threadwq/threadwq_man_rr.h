@@ -6,5 +6,6 @@
 
 DECLARE_THREADWQ_MAN_OPS(threadwq_man_ops_rr);
 DECLARE_THREADWQ_MAN_OPS(threadwq_man_ops_rr4idle);
+DECLARE_THREADWQ_MAN_OPS(threadwq_man_ops_rr_local);
 
 #endif /* SRC_THREADWQ_THREADWQ_MAN_RR_H_ */
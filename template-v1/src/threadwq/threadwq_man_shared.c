@@ -0,0 +1,90 @@
+#include <limits.h>
+#include <stdint.h>
+
+#include "lgu/lgu.h"
+
+#include "threadwq.h"
+#include "threadwq_man.h"
+#include "threadwq_man_ops.h"
+
+#include "threadwq_man_shared.h"
+
+/*
+ * Shared queue: Every job goes into the queue of twq_pool[0], which all workers drain
+ * (threadwq_set_shared_multi()). Then wake up as many parked workers as jobs were added.
+ *
+ * Pros: A job never waits behind a long one while a worker idles. Cons: One queue for all.
+ */
+
+static __thread unsigned int shared_cursor = UINT_MAX; //!< Per producer. Where the scan for a parked worker starts.
+
+/*
+ * Pairs w/ park(): Either the worker sees the job before it sleeps, or we see it sleeping here.
+ */
+static inline void shared_wake(struct threadwq_man *man, unsigned int nr)
+{
+	const unsigned int pool_nr = threadwq_man_nr(man);
+	struct threadwq *twq;
+	unsigned int i;
+
+	if (caa_unlikely(shared_cursor == UINT_MAX))
+	{
+		shared_cursor = (unsigned int) (((uint64_t) (uintptr_t) &shared_cursor * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	cmm_smp_mb();
+
+	for (i = 0; i < pool_nr && nr; i++)
+	{
+		twq = &man->twq_pool[shared_cursor++ % pool_nr];
+
+		if (CMM_LOAD_SHARED(twq->sleeping) && uatomic_xchg(&twq->sleeping, 0))
+		{
+			__threadwq_wakeup(twq);
+			nr--;
+		}
+	}
+}
+
+/*
+ * No per-twq wakeup: It would wake twq_pool[0] on top of the nr workers shared_wake() picks.
+ */
+static unsigned int shared_add_jobs(struct threadwq_man *man, struct threadwq_job **job_tbl, const unsigned int nr)
+{
+	if (threadwq_try_add_jobs_nowake(&man->twq_pool[0], job_tbl, nr))
+	{
+		return 0;
+	}
+
+	shared_wake(man, nr);
+
+	return nr;
+}
+
+static int shared_add_job(struct threadwq_man *man, struct threadwq_job *job)
+{
+	return shared_add_jobs(man, &job, 1) ? 0 : -EAGAIN;
+}
+
+static int shared_init(struct threadwq_man *man)
+{
+	unsigned int i;
+
+	for (i = 0; i < man->twq_pool_cap; i++)
+	{
+		if (man->twq_pool[i].src != &man->twq_pool[0])
+		{
+			ERR("twq %u does not drain the shared queue. Plz threadwq_set_shared_multi()", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void shared_exit(struct threadwq_man *man)
+{
+	return;
+}
+
+DEFINE_THREADWQ_MAN_OPS(threadwq_man_ops_shared, shared_init, shared_exit, shared_add_job, shared_add_jobs);
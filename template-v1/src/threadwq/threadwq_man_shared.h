@@ -0,0 +1,8 @@
+#ifndef SRC_THREADWQ_THREADWQ_MAN_SHARED_H_
+#define SRC_THREADWQ_THREADWQ_MAN_SHARED_H_
+
+#include "threadwq/threadwq_man_ops.h"
+
+DECLARE_THREADWQ_MAN_OPS(threadwq_man_ops_shared);
+
+#endif /* SRC_THREADWQ_THREADWQ_MAN_SHARED_H_ */
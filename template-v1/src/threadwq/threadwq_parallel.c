@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include <urcu.h>
+#include <urcu/futex.h>
+
+#include "lgu/lgu.h"
+#include "threadwq.h"
+#include "threadwq_parallel.h"
+
+#define PARALLEL_WAIT_SPIN (1000) //!< cpu_relax rounds before sleeping on a futex while waiting for helpers.
+
+/*
+ * Shared by the caller and the helper jobs. On heap: A helper job can be finished (lfq: after a grace
+ * period) long after the caller returned. The last ref frees it.
+ */
+struct parallel_ctx
+{
+	unsigned long begin;
+	unsigned long end;
+	unsigned long grain;
+
+	unsigned long next; //!< Cursor. Next chunk to take. Never beyond end.
+	unsigned long done; //!< Items done.
+	unsigned long ref;
+	int32_t finished; //!< futex. 1 once done is full.
+	unsigned int waiter; //!< The caller sleeps on finished.
+
+	void (*fn)(const unsigned long lo, const unsigned long hi, void *priv);
+	long (*fn_reduce)(const unsigned long lo, const unsigned long hi, const long acc, void *priv);
+	long (*join)(const long a, const long b, void *priv);
+	void *priv;
+
+	long identity;
+	long result;
+	pthread_mutex_t lock; //!< For result
+
+	unsigned int nr_job;
+	struct threadwq_job job_tbl[];
+};
+
+static void ctx_put(struct parallel_ctx *ctx)
+{
+	if (uatomic_sub_return(&ctx->ref, 1) == 0)
+	{
+		pthread_mutex_destroy(&ctx->lock);
+		free(ctx);
+	}
+}
+
+/*
+ * Take the next chunk: [*lo, *hi). 0: None left.
+ *
+ * Move the cursor by cmpxchg, up to end only: A fetch_add would run it past end, and wrap near ULONG_MAX.
+ */
+static inline int take_chunk(struct parallel_ctx *ctx, unsigned long *lo, unsigned long *hi)
+{
+	unsigned long old = CMM_LOAD_SHARED(ctx->next), cur;
+
+	for (;;)
+	{
+		if (old >= ctx->end)
+		{
+			return 0;
+		}
+
+		*hi = (ctx->end - old > ctx->grain) ? old + ctx->grain : ctx->end;
+
+		cur = uatomic_cmpxchg(&ctx->next, old, *hi);
+		if (cur == old)
+		{
+			*lo = old;
+			return 1;
+		}
+		old = cur;
+	}
+}
+
+/*
+ * Take chunks until none is left. Run by the caller and every helper.
+ */
+static void run_chunks(struct parallel_ctx *ctx)
+{
+	unsigned long lo, hi, nr = 0;
+	long acc = ctx->identity;
+
+	while (take_chunk(ctx, &lo, &hi))
+	{
+
+		if (ctx->fn_reduce)
+		{
+			acc = ctx->fn_reduce(lo, hi, acc, ctx->priv);
+		}
+		else
+		{
+			ctx->fn(lo, hi, ctx->priv);
+		}
+
+		nr += hi - lo;
+	}
+
+	if (nr == 0)
+	{
+		return;
+	}
+
+	if (ctx->fn_reduce)
+	{
+		pthread_mutex_lock(&ctx->lock);
+		ctx->result = ctx->join(ctx->result, acc, ctx->priv);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	/*
+	 * Publish the result before done: The caller reads it once done is full. The last one wakes the caller
+	 * (pairs w/ parallel_wait(): Either it sees finished, or we see it waiting).
+	 */
+	if (uatomic_add_return(&ctx->done, nr) == ctx->end - ctx->begin)
+	{
+		uatomic_set(&ctx->finished, 1);
+		cmm_smp_mb();
+
+		if (CMM_LOAD_SHARED(ctx->waiter))
+		{
+			futex_noasync(&ctx->finished, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		}
+	}
+}
+
+/*
+ * Spin a while: Helpers are usually on their last chunk. Then sleep until the last one wakes us.
+ */
+static void parallel_wait(struct parallel_ctx *ctx)
+{
+	unsigned int spin;
+
+	for (spin = 0; spin < PARALLEL_WAIT_SPIN; spin++)
+	{
+		if (uatomic_read(&ctx->finished))
+		{
+			return;
+		}
+		caa_cpu_relax();
+	}
+
+	uatomic_set(&ctx->waiter, 1);
+	cmm_smp_mb();
+
+	while (!uatomic_read(&ctx->finished))
+	{
+		futex_noasync(&ctx->finished, FUTEX_WAIT, 0, NULL, NULL, 0);
+	}
+}
+
+static void helper_start(struct threadwq_job *job, void *priv)
+{
+	run_chunks(priv);
+}
+
+static void helper_finish(struct threadwq_job *job, void *priv)
+{
+	ctx_put(priv);
+}
+
+static int parallel_run(struct threadwq_man *man, struct parallel_ctx *tmpl)
+{
+	struct parallel_ctx *ctx;
+	unsigned long nr_chunk, total = tmpl->end - tmpl->begin;
+	unsigned int i, nr_job, pool_nr;
+
+	BUG_ON(man == NULL);
+
+	if (tmpl->begin >= tmpl->end)
+	{
+		return 0; // ok, nothing to do
+	}
+
+	pool_nr = threadwq_man_nr(man);
+
+	if (tmpl->grain == 0)
+	{
+		tmpl->grain = total / ((pool_nr + 1) * THREADWQ_PARALLEL_CHUNK_PER_THREAD);
+		if (tmpl->grain == 0)
+		{
+			tmpl->grain = 1;
+		}
+	}
+
+	nr_chunk = total / tmpl->grain + (total % tmpl->grain != 0); // No overflow near ULONG_MAX.
+	nr_job = (nr_chunk - 1 < pool_nr) ? nr_chunk - 1 : pool_nr; // The caller takes one.
+
+	ctx = malloc(sizeof(*ctx) + nr_job * sizeof(ctx->job_tbl[0]));
+	if (!ctx)
+	{
+		ERR("Cannot alloc parallel ctx");
+		return -1;
+	}
+
+	memcpy(ctx, tmpl, sizeof(*ctx));
+	ctx->next = ctx->begin;
+	ctx->done = 0;
+	ctx->finished = 0;
+	ctx->waiter = 0;
+	ctx->ref = nr_job + 1;
+	ctx->result = ctx->identity;
+	ctx->nr_job = nr_job;
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	for (i = 0; i < nr_job; i++)
+	{
+		threadwq_job_init(&ctx->job_tbl[i], helper_start, helper_finish, ctx);
+		if (threadwq_man_add_job(man, &ctx->job_tbl[i]))
+		{
+			ERR("Cannot add helper %u. Run the rest here", i);
+			uatomic_sub(&ctx->ref, nr_job - i); // Never queued. Helpers already queued may run now.
+			break;
+		}
+	}
+
+	run_chunks(ctx);
+	parallel_wait(ctx);
+
+	cmm_smp_mb();
+	tmpl->result = ctx->result;
+
+	ctx_put(ctx);
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Run fn over [begin, end) in chunks on the pool of man and the calling thread. Block until done.
+ *
+ * \param grain Items per chunk. 0: Auto.
+ */
+int threadwq_parallel_for(struct threadwq_man *man, const unsigned long begin, const unsigned long end,
+	const unsigned long grain,
+	void (*fn)(const unsigned long lo, const unsigned long hi, void *priv), void *priv)
+{
+	struct parallel_ctx tmpl;
+
+	BUG_ON(fn == NULL);
+
+	memset(&tmpl, 0x00, sizeof(tmpl));
+	tmpl.begin = begin;
+	tmpl.end = end;
+	tmpl.grain = grain;
+	tmpl.fn = fn;
+	tmpl.priv = priv;
+
+	return parallel_run(man, &tmpl);
+}
+
+/*!
+ * \brief Reduce [begin, end) in chunks on the pool of man and the calling thread. Block until done.
+ *
+ * \details Each thread folds its chunks w/ fn, starting from identity. The partial results are merged
+ *     w/ join in no particular order, so join must be associative and commutative.
+ *
+ * \param grain Items per chunk. 0: Auto.
+ */
+int threadwq_parallel_reduce(struct threadwq_man *man, const unsigned long begin, const unsigned long end,
+	const unsigned long grain, const long identity,
+	long (*fn)(const unsigned long lo, const unsigned long hi, const long acc, void *priv),
+	long (*join)(const long a, const long b, void *priv),
+	void *priv, long *result)
+{
+	struct parallel_ctx tmpl;
+	int ret;
+
+	BUG_ON(fn == NULL || join == NULL || result == NULL);
+
+	memset(&tmpl, 0x00, sizeof(tmpl));
+	tmpl.begin = begin;
+	tmpl.end = end;
+	tmpl.grain = grain;
+	tmpl.fn_reduce = fn;
+	tmpl.join = join;
+	tmpl.priv = priv;
+	tmpl.identity = identity;
+	tmpl.result = identity;
+
+	ret = parallel_run(man, &tmpl);
+	if (ret == 0)
+	{
+		*result = tmpl.result;
+	}
+
+	return ret;
+}
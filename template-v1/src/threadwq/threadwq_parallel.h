@@ -0,0 +1,28 @@
+/*!
+ * \file threadwq_parallel.h
+ * \brief Data-parallel loops over a threadwq pool.
+ *
+ * \details [begin, end) is cut into chunks of grain items. One helper job per twq of the man pulls chunks
+ *     from a shared cursor; the caller pulls chunks, too, then waits until every chunk is done.
+ *     Helpers that start late find no chunk and return at once, so calling this from a worker is ok.
+ *
+ *     Plz call them from an rcu registered thread (lfq backend), like threadwq_man_add_job().
+ */
+#ifndef SRC_THREADWQ_THREADWQ_PARALLEL_H_
+#define SRC_THREADWQ_THREADWQ_PARALLEL_H_
+
+#include "threadwq/threadwq.h"
+
+#define THREADWQ_PARALLEL_CHUNK_PER_THREAD (4) //!< grain 0: Chunks per thread, for load balance.
+
+int threadwq_parallel_for(struct threadwq_man *man, const unsigned long begin, const unsigned long end,
+	const unsigned long grain,
+	void (*fn)(const unsigned long lo, const unsigned long hi, void *priv), void *priv);
+
+int threadwq_parallel_reduce(struct threadwq_man *man, const unsigned long begin, const unsigned long end,
+	const unsigned long grain, const long identity,
+	long (*fn)(const unsigned long lo, const unsigned long hi, const long acc, void *priv),
+	long (*join)(const long a, const long b, void *priv),
+	void *priv, long *result);
+
+#endif /* SRC_THREADWQ_THREADWQ_PARALLEL_H_ */
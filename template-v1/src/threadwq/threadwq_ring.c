@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "lgu/lgu.h"
+
+#include "threadwq_ring.h"
+
+/*!
+ * \brief Allocate the slots. nr_slot is rounded up to power of 2.
+ */
+int threadwq_ring_init(struct threadwq_ring *ring, const unsigned int nr_slot)
+{
+	unsigned long i, nr = 1;
+
+	if (nr_slot == 0)
+	{
+		ERR("Invalid ring size %u", nr_slot);
+		return -1;
+	}
+
+	while (nr < nr_slot)
+	{
+		nr <<= 1;
+	}
+
+	/*
+	 * Page aligned, so the slots can be moved to the worker NUMA node.
+	 */
+	if (posix_memalign((void **) &ring->slot_tbl, sysconf(_SC_PAGESIZE), nr * sizeof(ring->slot_tbl[0])))
+	{
+		ERR("Cannot alloc ring w/ %lu slots", nr);
+		ring->slot_tbl = NULL;
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		ring->slot_tbl[i].seq = i;
+		ring->slot_tbl[i].job = NULL;
+	}
+
+	ring->mask = nr - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->sc = 0;
+
+	return 0; // ok
+}
+
+void threadwq_ring_exit(struct threadwq_ring *ring)
+{
+	free(ring->slot_tbl);
+	ring->slot_tbl = NULL;
+}
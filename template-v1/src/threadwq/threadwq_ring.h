@@ -0,0 +1,133 @@
+/*!
+ * \file threadwq_ring.h
+ * \brief A bounded array ring to carry threadwq jobs. No rcu, no allocation per job.
+ *
+ * \details Each slot carries a sequence number (D. Vyukov's bounded queue), so producers and consumers
+ *     only meet on the slot they hand over. Multiple producers are always allowed. Multiple consumers
+ *     (work-stealing) are allowed unless the ring is set single-consumer, which saves the cmpxchg
+ *     on dequeue.
+ */
+#ifndef SRC_THREADWQ_THREADWQ_RING_H_
+#define SRC_THREADWQ_THREADWQ_RING_H_
+
+#include <errno.h>
+
+#include <urcu/arch.h>
+#include <urcu/uatomic.h>
+
+#include "lgu/lgu.h"
+
+struct threadwq_job;
+
+struct threadwq_ring_slot
+{
+	unsigned long seq;
+	struct threadwq_job *job;
+};
+
+struct threadwq_ring
+{
+	/*
+	 * Producer-written and consumer-written positions live in their own cache lines.
+	 */
+	unsigned long head __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< Next enqueue position.
+	unsigned long tail __attribute__((aligned(CAA_CACHE_LINE_SIZE))); //!< Next dequeue position.
+
+	struct threadwq_ring_slot *slot_tbl __attribute__((aligned(CAA_CACHE_LINE_SIZE)));
+	unsigned long mask; //!< Slot number - 1. Slot number is power of 2.
+	unsigned int sc; //!< 1: Single consumer.
+};
+
+int threadwq_ring_init(struct threadwq_ring *ring, const unsigned int nr_slot);
+void threadwq_ring_exit(struct threadwq_ring *ring);
+
+/*!
+ * \brief Enqueue a job. Return 0 if ok, or -EAGAIN if the ring is full.
+ */
+static inline __attribute__((unused))
+int threadwq_ring_enqueue(struct threadwq_ring *ring, struct threadwq_job *job)
+{
+	struct threadwq_ring_slot *slot;
+	unsigned long pos = CMM_LOAD_SHARED(ring->head);
+	long dif;
+
+	for (;;)
+	{
+		slot = &ring->slot_tbl[pos & ring->mask];
+		dif = (long) CMM_LOAD_SHARED(slot->seq) - (long) pos;
+		cmm_smp_rmb();
+
+		if (dif == 0)
+		{
+			if (uatomic_cmpxchg(&ring->head, pos, pos + 1) == pos)
+			{
+				break;
+			}
+			pos = CMM_LOAD_SHARED(ring->head);
+		}
+		else if (dif < 0)
+		{
+			return -EAGAIN; // full
+		}
+		else
+		{
+			pos = CMM_LOAD_SHARED(ring->head); // Lost the race. Retry.
+		}
+	}
+
+	slot->job = job;
+	cmm_smp_wmb();
+	CMM_STORE_SHARED(slot->seq, pos + 1); // Publish to consumer.
+
+	return 0;
+}
+
+/*!
+ * \brief Dequeue a job. Return NULL if the ring is empty.
+ */
+static inline __attribute__((unused))
+struct threadwq_job *threadwq_ring_dequeue(struct threadwq_ring *ring)
+{
+	struct threadwq_ring_slot *slot;
+	struct threadwq_job *job;
+	unsigned long pos = CMM_LOAD_SHARED(ring->tail);
+	long dif;
+
+	for (;;)
+	{
+		slot = &ring->slot_tbl[pos & ring->mask];
+		dif = (long) CMM_LOAD_SHARED(slot->seq) - (long) (pos + 1);
+		cmm_smp_rmb();
+
+		if (dif == 0)
+		{
+			if (ring->sc)
+			{
+				CMM_STORE_SHARED(ring->tail, pos + 1);
+				break;
+			}
+
+			if (uatomic_cmpxchg(&ring->tail, pos, pos + 1) == pos)
+			{
+				break;
+			}
+			pos = CMM_LOAD_SHARED(ring->tail);
+		}
+		else if (dif < 0)
+		{
+			return NULL; // empty
+		}
+		else
+		{
+			pos = CMM_LOAD_SHARED(ring->tail); // Lost the race. Retry.
+		}
+	}
+
+	job = slot->job;
+	cmm_smp_mb(); // Read the job before giving the slot back to producers.
+	CMM_STORE_SHARED(slot->seq, pos + ring->mask + 1);
+
+	return job;
+}
+
+#endif /* SRC_THREADWQ_THREADWQ_RING_H_ */
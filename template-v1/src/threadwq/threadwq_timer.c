@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <urcu.h>
+#include <urcu/list.h>
+
+#include "lgu/lgu.h"
+#include "threadwq.h"
+#include "threadwq_timer.h"
+
+/*
+ * Job state. A tjob is armed only in TJOB_IDLE: A fired one is unlinked, but still on its way into the twq.
+ */
+enum
+{
+	TJOB_IDLE = 0, //!< Not in a twq.
+	TJOB_RUN, //!< Fired: Being added, queued or running in a twq.
+	TJOB_CANCEL, //!< Periodic, cancelled while TJOB_RUN. The worker calls the user cb_finish.
+};
+
+static void tjob_finish(struct threadwq_job *job, void *priv)
+{
+	struct threadwq_tjob *tj = caa_container_of(job, struct threadwq_tjob, job);
+
+	if (tj->period && uatomic_cmpxchg(&tj->state, TJOB_RUN, TJOB_IDLE) == TJOB_RUN)
+	{
+		return; // Fire again next period.
+	}
+
+	uatomic_set(&tj->state, TJOB_IDLE); // One-shot, or cancelled while running. Done: tj may be armed again.
+
+	tj->cb_finish(job, priv);
+}
+
+/*!
+ * \brief Same as threadwq_job_init(). cb_finish runs when a one-shot job is done, or a periodic job is cancelled.
+ */
+void threadwq_tjob_init(struct threadwq_tjob *tj,
+	void (*cb_start)(struct threadwq_job *job, void *priv),
+	void (*cb_finish)(struct threadwq_job *job, void *priv),
+	void *priv)
+{
+	BUG_ON(cb_finish == NULL);
+
+	threadwq_job_init(&tj->job, cb_start, tjob_finish, priv);
+	tj->cb_finish = cb_finish;
+	tj->twq = NULL;
+	tj->expire = 0;
+	tj->period = 0;
+	tj->linked = 0;
+	tj->state = TJOB_IDLE;
+	CDS_INIT_LIST_HEAD(&tj->node);
+	tj->fire_next = NULL;
+}
+
+static inline uint64_t now_tick(const struct threadwq_timer *tmr)
+{
+	return (tm_mono_ns() - tmr->base_ns) / tmr->tick_ns;
+}
+
+static inline uint64_t ms2tick(const struct threadwq_timer *tmr, const unsigned long ms)
+{
+	return ((uint64_t) ms * 1000000ULL + tmr->tick_ns - 1) / tmr->tick_ns;
+}
+
+/*
+ * Put tj into the slot of its expire tick. Plz hold tmr->lock.
+ *
+ * Level l holds timers due in [2^(8l), 2^(8(l+1))) ticks. A slot of level l > 0 is moved down a level
+ * (cascade) when the lower levels wrap around.
+ */
+static void wheel_insert(struct threadwq_timer *tmr, struct threadwq_tjob *tj)
+{
+	uint64_t expire = tj->expire, delta;
+	unsigned int lv, idx;
+
+	if (expire < tmr->now)
+	{
+		expire = tmr->now; // Overdue: Fire on the next tick.
+	}
+
+	delta = expire - tmr->now;
+
+	for (lv = 0; lv < THREADWQ_TIMER_LV_NR - 1; lv++)
+	{
+		if (delta < (1ULL << (THREADWQ_TIMER_LV_BITS * (lv + 1))))
+		{
+			break;
+		}
+	}
+
+	if (delta >= (1ULL << (THREADWQ_TIMER_LV_BITS * THREADWQ_TIMER_LV_NR)))
+	{
+		expire = tmr->now + (1ULL << (THREADWQ_TIMER_LV_BITS * THREADWQ_TIMER_LV_NR)) - 1; // Cascade again later.
+	}
+
+	idx = (expire >> (THREADWQ_TIMER_LV_BITS * lv)) & THREADWQ_TIMER_LV_MASK;
+	cds_list_add_tail(&tj->node, &tmr->wheel[lv][idx]);
+	tj->linked = 1;
+}
+
+static void wheel_cascade(struct threadwq_timer *tmr, const unsigned int lv, const unsigned int idx)
+{
+	struct threadwq_tjob *tj, *tmp;
+	CDS_LIST_HEAD(list);
+
+	cds_list_splice(&tmr->wheel[lv][idx], &list);
+	CDS_INIT_LIST_HEAD(&tmr->wheel[lv][idx]);
+
+	cds_list_for_each_entry_safe(tj, tmp, &list, node)
+	{
+		wheel_insert(tmr, tj);
+	}
+}
+
+/*
+ * Due jobs of one pass. Collected under tmr->lock, fired after it.
+ */
+struct fire_list
+{
+	struct threadwq_tjob *head;
+	struct threadwq_tjob **tail;
+};
+
+static inline void due_add(struct fire_list *due, struct threadwq_tjob *tj)
+{
+	tj->fire_next = NULL;
+	*due->tail = tj;
+	due->tail = &tj->fire_next;
+}
+
+struct fire_bucket
+{
+	struct threadwq *twq;
+	unsigned int nr;
+	struct threadwq_job *job_tbl[THREADWQ_TIMER_FIRE_BATCH];
+};
+
+struct fire_batch
+{
+	unsigned int nr;
+	struct fire_bucket bucket[THREADWQ_TIMER_FIRE_TWQ];
+};
+
+static void fire_flush(struct fire_batch *fb)
+{
+	unsigned int i;
+
+	for (i = 0; i < fb->nr; i++)
+	{
+		threadwq_add_jobs(fb->bucket[i].twq, fb->bucket[i].job_tbl, fb->bucket[i].nr);
+	}
+
+	fb->nr = 0;
+}
+
+static void fire_add(struct fire_batch *fb, struct threadwq_tjob *tj)
+{
+	struct fire_bucket *b = NULL;
+	unsigned int i;
+
+	for (i = 0; i < fb->nr; i++)
+	{
+		if (fb->bucket[i].twq == tj->twq)
+		{
+			b = &fb->bucket[i];
+			break;
+		}
+	}
+
+	if (!b)
+	{
+		if (fb->nr == THREADWQ_TIMER_FIRE_TWQ)
+		{
+			fire_flush(fb);
+		}
+
+		b = &fb->bucket[fb->nr++];
+		b->twq = tj->twq;
+		b->nr = 0;
+	}
+
+	cds_lfq_node_init_rcu(&tj->job.lfq_node); // A periodic job reuses the node of its last run.
+	b->job_tbl[b->nr++] = &tj->job;
+
+	if (b->nr == THREADWQ_TIMER_FIRE_BATCH)
+	{
+		threadwq_add_jobs(b->twq, b->job_tbl, b->nr);
+		b->nr = 0;
+	}
+}
+
+/*
+ * Run one tick: Cascade, then collect the due jobs of the level 0 slot. Plz hold tmr->lock.
+ */
+static void wheel_tick(struct threadwq_timer *tmr, struct fire_list *due)
+{
+	struct threadwq_tjob *tj, *tmp;
+	const uint64_t t = tmr->now;
+	unsigned int lv, idx;
+	CDS_LIST_HEAD(list);
+
+	for (lv = 1; lv < THREADWQ_TIMER_LV_NR; lv++)
+	{
+		if ((t >> (THREADWQ_TIMER_LV_BITS * (lv - 1))) & THREADWQ_TIMER_LV_MASK)
+		{
+			break;
+		}
+
+		wheel_cascade(tmr, lv, (t >> (THREADWQ_TIMER_LV_BITS * lv)) & THREADWQ_TIMER_LV_MASK);
+	}
+
+	idx = t & THREADWQ_TIMER_LV_MASK;
+	cds_list_splice(&tmr->wheel[0][idx], &list);
+	CDS_INIT_LIST_HEAD(&tmr->wheel[0][idx]);
+
+	tmr->now++;
+
+	cds_list_for_each_entry_safe(tj, tmp, &list, node)
+	{
+		cds_list_del(&tj->node);
+		tj->linked = 0;
+
+		if (tj->period == 0)
+		{
+			uatomic_set(&tj->state, TJOB_RUN); // Armed in TJOB_IDLE only. Back to it in tjob_finish().
+			tmr->nr--;
+			tmr->fired++;
+			due_add(due, tj);
+			continue;
+		}
+
+		/*
+		 * Periodic: Re-arm first, on the period grid. Skip periods we are late for.
+		 */
+		tj->expire += tj->period;
+		if (tj->expire <= t)
+		{
+			tmr->overrun += (t - tj->expire) / tj->period + 1;
+			tj->expire += ((t - tj->expire) / tj->period + 1) * tj->period;
+		}
+		wheel_insert(tmr, tj);
+
+		if (uatomic_cmpxchg(&tj->state, TJOB_IDLE, TJOB_RUN) != TJOB_IDLE)
+		{
+			tmr->overrun++; // The last run is not done yet.
+			continue;
+		}
+
+		tmr->fired++;
+		due_add(due, tj);
+	}
+}
+
+/*
+ * The next tick w/ work: A due level 0 slot, or the cascade of a non-empty slot. The ticks before it are empty.
+ * UINT64_MAX: No timer. Plz hold tmr->lock.
+ *
+ * Slot i of level l holds the timers cascaded at the first tick m << 8l >= now w/ m & 0xff == i: Its timers
+ * were inserted less than one round of the level ahead. Each level is scanned in tick order from now, up to its
+ * first non-empty slot or the best tick so far.
+ */
+static uint64_t wheel_next(struct threadwq_timer *tmr)
+{
+	const uint64_t t = tmr->now;
+	uint64_t best = UINT64_MAX, m0, tick;
+	unsigned int lv, shift, k;
+
+	for (lv = 0; lv < THREADWQ_TIMER_LV_NR; lv++)
+	{
+		shift = THREADWQ_TIMER_LV_BITS * lv;
+		m0 = (t + (1ULL << shift) - 1) >> shift;
+
+		for (k = 0; k < THREADWQ_TIMER_LV_SLOT; k++)
+		{
+			tick = (m0 + k) << shift;
+			if (tick >= best)
+			{
+				break;
+			}
+
+			if (!cds_list_empty(&tmr->wheel[lv][(m0 + k) & THREADWQ_TIMER_LV_MASK]))
+			{
+				best = tick;
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+static void *timer_func(void *data)
+{
+	struct threadwq_timer *tmr = data;
+	struct threadwq_tjob *tj, *next;
+	struct fire_list due;
+	struct fire_batch fb;
+	struct timespec ts;
+	uint64_t cur, wake, deadline;
+
+	rcu_register_thread(); // threadwq_add_jobs() on lfq
+
+	fb.nr = 0;
+
+	pthread_mutex_lock(&tmr->lock);
+
+	while (!tmr->exit)
+	{
+		tmr->wakeup++;
+
+		if (tmr->nr == 0)
+		{
+			tmr->next = UINT64_MAX;
+			pthread_cond_wait(&tmr->cond, &tmr->lock);
+			continue;
+		}
+
+		due.head = NULL;
+		due.tail = &due.head;
+
+		/*
+		 * Run the ticks w/ work only. The empty ones between are skipped, so far timers cost no tick each.
+		 */
+		cur = now_tick(tmr);
+		while ((wake = wheel_next(tmr)) <= cur)
+		{
+			tmr->now = wake;
+			wheel_tick(tmr, &due);
+		}
+
+		if (tmr->now <= cur)
+		{
+			tmr->now = cur + 1;
+		}
+
+		/*
+		 * Fire w/o the lock: An add may wait for a full ring, while its worker waits for the lock to arm a timer.
+		 * A due job is unlinked and TJOB_RUN already: A cancel meanwhile returns -EBUSY, an add fails.
+		 */
+		if (due.head)
+		{
+			pthread_mutex_unlock(&tmr->lock);
+
+			for (tj = due.head; tj; tj = next)
+			{
+				next = tj->fire_next; // tj may run and be armed again once added.
+				fire_add(&fb, tj);
+			}
+			fire_flush(&fb);
+
+			pthread_mutex_lock(&tmr->lock);
+		}
+
+		/*
+		 * Sleep until the next tick w/ work. An add due earlier signals us.
+		 */
+		wake = wheel_next(tmr);
+		if (wake == UINT64_MAX)
+		{
+			continue;
+		}
+
+		tmr->next = wake;
+		deadline = tmr->base_ns + wake * tmr->tick_ns;
+		ts.tv_sec = deadline / 1000000000ULL;
+		ts.tv_nsec = deadline % 1000000000ULL;
+		pthread_cond_timedwait(&tmr->cond, &tmr->lock, &ts);
+	}
+
+	pthread_mutex_unlock(&tmr->lock);
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*!
+ * \brief Start a timer thread.
+ *
+ * \param tick_us Resolution. 0: THREADWQ_TIMER_TICK_US_DFL
+ */
+int threadwq_timer_init(struct threadwq_timer *tmr, const unsigned int tick_us)
+{
+	pthread_condattr_t cattr;
+	unsigned int lv, idx;
+
+	memset(tmr, 0x00, sizeof(*tmr));
+
+	tmr->tick_ns = (uint64_t) (tick_us ? tick_us : THREADWQ_TIMER_TICK_US_DFL) * 1000ULL;
+	tmr->base_ns = tm_mono_ns();
+	tmr->next = UINT64_MAX;
+
+	for (lv = 0; lv < THREADWQ_TIMER_LV_NR; lv++)
+	{
+		for (idx = 0; idx < THREADWQ_TIMER_LV_SLOT; idx++)
+		{
+			CDS_INIT_LIST_HEAD(&tmr->wheel[lv][idx]);
+		}
+	}
+
+	pthread_mutex_init(&tmr->lock, NULL);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tmr->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (pthread_create(&tmr->tid, NULL, &timer_func, tmr))
+	{
+		ERR("Cannot create timer thread %s", strerror(errno));
+		pthread_cond_destroy(&tmr->cond);
+		pthread_mutex_destroy(&tmr->lock);
+		return -1;
+	}
+
+	tmr->running = 1;
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Stop the timer thread. Pending timers are dropped, not fired. Their jobs go back to the caller.
+ *
+ * \details Exit the timer before the twqs it fires into.
+ */
+void threadwq_timer_exit(struct threadwq_timer *tmr)
+{
+	if (!tmr->running)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&tmr->lock);
+	tmr->exit = 1;
+	pthread_cond_signal(&tmr->cond);
+	pthread_mutex_unlock(&tmr->lock);
+
+	pthread_join(tmr->tid, NULL);
+	tmr->running = 0;
+
+	if (tmr->nr)
+	{
+		VBS("Drop %lu pending timers", tmr->nr);
+	}
+
+	pthread_cond_destroy(&tmr->cond);
+	pthread_mutex_destroy(&tmr->lock);
+}
+
+static int timer_add(struct threadwq_timer *tmr, struct threadwq *twq, struct threadwq_tjob *tj,
+	const unsigned long delay_ms, const unsigned long period_ms)
+{
+	BUG_ON(twq == NULL || tj == NULL);
+
+	pthread_mutex_lock(&tmr->lock);
+
+	if (tj->linked || uatomic_read(&tj->state) != TJOB_IDLE)
+	{
+		pthread_mutex_unlock(&tmr->lock);
+		ERR("tjob %p is armed already, or its last run is not finished", tj);
+		return -1;
+	}
+
+	if (tmr->nr == 0)
+	{
+		tmr->now = now_tick(tmr); // Empty wheel: Skip the idle ticks, so slots are relative to now.
+	}
+
+	tj->twq = twq;
+	tj->period = period_ms ? ms2tick(tmr, period_ms) : 0;
+	tj->expire = (tm_mono_ns() - tmr->base_ns + (uint64_t) delay_ms * 1000000ULL + tmr->tick_ns - 1) / tmr->tick_ns;
+
+	wheel_insert(tmr, tj);
+
+	if (tmr->nr++ == 0 || tj->expire < tmr->next)
+	{
+		pthread_cond_signal(&tmr->cond); // The thread sleeps until its next tick w/ work, or w/o timeout when idle.
+	}
+
+	pthread_mutex_unlock(&tmr->lock);
+
+	return 0; // ok
+}
+
+/*!
+ * \brief Add tj into twq after delay_ms. Resolution is one tick, never earlier.
+ */
+int threadwq_add_job_delayed(struct threadwq_timer *tmr, struct threadwq *twq, struct threadwq_tjob *tj,
+	const unsigned long delay_ms)
+{
+	return timer_add(tmr, twq, tj, delay_ms, 0);
+}
+
+/*!
+ * \brief Add tj into twq after delay_ms, then every period_ms until cancelled.
+ */
+int threadwq_add_job_periodic(struct threadwq_timer *tmr, struct threadwq *twq, struct threadwq_tjob *tj,
+	const unsigned long delay_ms, const unsigned long period_ms)
+{
+	if (period_ms == 0)
+	{
+		ERR("Invalid period 0");
+		return -1;
+	}
+
+	return timer_add(tmr, twq, tj, delay_ms, period_ms);
+}
+
+/*!
+ * \brief Cancel a timer.
+ *
+ * \return 0: Cancelled before it fired (the last time). The caller owns tj, no cb_finish is called.
+ *     -EBUSY: Fired already. cb_finish will be called by the worker as usual.
+ */
+int threadwq_cancel_job_timer(struct threadwq_timer *tmr, struct threadwq_tjob *tj)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&tmr->lock);
+
+	if (tj->linked)
+	{
+		cds_list_del(&tj->node);
+		tj->linked = 0;
+		tmr->nr--;
+	}
+	else if (tj->period == 0)
+	{
+		ret = -EBUSY; // One-shot fired.
+	}
+
+	if (tj->period && uatomic_cmpxchg(&tj->state, TJOB_RUN, TJOB_CANCEL) == TJOB_RUN)
+	{
+		ret = -EBUSY;
+	}
+
+	pthread_mutex_unlock(&tmr->lock);
+
+	return ret;
+}
@@ -0,0 +1,86 @@
+/*!
+ * \file threadwq_timer.h
+ * \brief Delayed and periodic jobs. A hierarchical timer wheel fires due jobs into their twq.
+ *
+ * \details One timer thread per struct threadwq_timer. Insert and cancel are O(1) (list ops under a mutex).
+ *     Due jobs are grouped per twq and added w/ threadwq_add_jobs(), so a worker is woken once per tick.
+ *     They are collected under the timer lock and added after it is dropped: Arming a timer never waits
+ *     for a full twq. The thread sleeps until the next tick w/ work (a due slot, or a cascade), not every tick.
+ *
+ *     A periodic job is not queued twice: If it is still queued/running when it is due again, that
+ *     period is skipped and counted as overrun. Its cb_finish runs only once, after it is cancelled. It may
+ *     be armed again from then on. A one-shot job may be armed again from its cb_finish on: An add while
+ *     it is on its way into the twq, queued or running fails.
+ */
+#ifndef SRC_THREADWQ_THREADWQ_TIMER_H_
+#define SRC_THREADWQ_THREADWQ_TIMER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <urcu/list.h>
+
+#include "threadwq/threadwq.h"
+
+#define THREADWQ_TIMER_TICK_US_DFL (1000) //!< Timer resolution (usec).
+
+#define THREADWQ_TIMER_LV_BITS (8)
+#define THREADWQ_TIMER_LV_SLOT (1 << THREADWQ_TIMER_LV_BITS)
+#define THREADWQ_TIMER_LV_MASK (THREADWQ_TIMER_LV_SLOT - 1)
+#define THREADWQ_TIMER_LV_NR (4) //!< 2^32 ticks in range. Longer delays are re-cascaded from the top level.
+
+#define THREADWQ_TIMER_FIRE_BATCH (64) //!< Max jobs added to a twq at once.
+#define THREADWQ_TIMER_FIRE_TWQ (8) //!< Max twq targets grouped at once.
+
+struct threadwq_tjob
+{
+	struct threadwq_job job; //!< Set prio/finish mode on it as usual.
+
+	void (*cb_finish)(struct threadwq_job *job, void *priv); //!< User cb_finish.
+
+	struct threadwq *twq; //!< Target
+	uint64_t expire; //!< Tick
+	uint64_t period; //!< Ticks. 0: One-shot.
+	unsigned int linked; //!< In the wheel.
+	unsigned int state; //!< See threadwq_timer.c
+
+	struct cds_list_head node;
+	struct threadwq_tjob *fire_next; //!< Due list of the timer thread.
+};
+
+struct threadwq_timer
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t tid;
+	unsigned int running;
+	unsigned int exit;
+
+	uint64_t tick_ns;
+	uint64_t base_ns; //!< Monotonic time of tick 0.
+	uint64_t now; //!< Next tick to process.
+	uint64_t next; //!< The thread sleeps until this tick. An add due earlier wakes it.
+
+	unsigned long nr; //!< Pending timers.
+	unsigned long fired;
+	unsigned long overrun; //!< Skipped periods.
+	unsigned long wakeup; //!< Rounds of the timer thread. The ticks w/o work are skipped.
+
+	struct cds_list_head wheel[THREADWQ_TIMER_LV_NR][THREADWQ_TIMER_LV_SLOT];
+};
+
+void threadwq_tjob_init(struct threadwq_tjob *tj,
+	void (*cb_start)(struct threadwq_job *job, void *priv),
+	void (*cb_finish)(struct threadwq_job *job, void *priv),
+	void *priv);
+
+int threadwq_timer_init(struct threadwq_timer *tmr, const unsigned int tick_us);
+void threadwq_timer_exit(struct threadwq_timer *tmr);
+
+int threadwq_add_job_delayed(struct threadwq_timer *tmr, struct threadwq *twq, struct threadwq_tjob *tj,
+	const unsigned long delay_ms);
+int threadwq_add_job_periodic(struct threadwq_timer *tmr, struct threadwq *twq, struct threadwq_tjob *tj,
+	const unsigned long delay_ms, const unsigned long period_ms);
+int threadwq_cancel_job_timer(struct threadwq_timer *tmr, struct threadwq_tjob *tj);
+
+#endif /* SRC_THREADWQ_THREADWQ_TIMER_H_ */